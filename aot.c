@@ -0,0 +1,528 @@
+// Ahead-of-time translator -- walks a ROM's control flow from 0x200 and writes
+// it out as C for aot.h, one function per basic block. Given an output ending
+// in .so it also compiles that into a module runCyclesAot() can load.
+//
+//  usage: aot [-Q quirks] [-I include dir] rom output.c|output.so
+//
+// The module only runs on machines with the same quirks (-Q, default none).
+// -I is where chip8.h and aot.h are found when compiling (default .); the
+// compiler is $CC, or cc.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "chip8.h"
+#include "aot.h"
+
+enum {
+    AOT_BODY = 0, // straight-line, translated
+    AOT_STORE,    // FX33 / FX55, translated but ends the block so the runner sees the write
+    AOT_BRANCH,   // ends a block and decides the next pc, translated
+    AOT_INTERPRET // left to emulateCycle()
+};
+
+static unsigned char image[CHIP8_MAX_ROM];
+static size_t imageSize;
+static int quirks;
+
+// visited instructions and block leaders, by pc
+static unsigned char reached[4096];
+static unsigned char leader[4096];
+
+static int inImage(unsigned short pc)
+{
+    return pc >= 0x200 && pc + 1 < 0x200 + imageSize;
+}
+
+static unsigned short opcodeAt(unsigned short pc)
+{
+    return image[pc - 0x200] << 8 | image[pc + 1 - 0x200];
+}
+
+static int classify(unsigned short opcode)
+{
+    switch (opcode & 0xF000)
+    {
+        case 0x0000:
+            if (opcode == 0x00E0)
+                return AOT_BODY;
+            return opcode == 0x00EE ? AOT_BRANCH : AOT_INTERPRET;
+        case 0x1000: case 0x2000: case 0x3000: case 0x4000: case 0x5000: case 0x9000:
+            return AOT_BRANCH;
+        case 0x6000: case 0x7000: case 0xA000: case 0xC000: case 0xD000:
+            return AOT_BODY;
+        case 0x8000:
+            return (opcode & 0xF) <= 0x7 || (opcode & 0xF) == 0xE ? AOT_BODY : AOT_INTERPRET;
+        case 0xE000:
+            return (opcode & 0xFF) == 0x9E || (opcode & 0xFF) == 0xA1 ? AOT_BRANCH : AOT_INTERPRET;
+        case 0xF000:
+            switch (opcode & 0xFF)
+            {
+                case 0x07: case 0x15: case 0x18: case 0x1E: case 0x29: case 0x65:
+                    return AOT_BODY;
+                case 0x33: case 0x55:
+                    return AOT_STORE;
+            }
+            return AOT_INTERPRET;
+    }
+    return AOT_INTERPRET; // BNNN
+}
+
+// marks everything reachable from 0x200 without running it, and the leaders
+static void walk()
+{
+    // every instruction is visited once and pushes at most two more
+    static unsigned short pending[2 * 4096];
+    int count = 0;
+
+    pending[count++] = 0x200;
+    leader[0x200] = 1;
+
+    while (count > 0)
+    {
+        unsigned short pc = pending[--count];
+        if (!inImage(pc) || reached[pc])
+            continue;
+        reached[pc] = 1;
+
+        unsigned short opcode = opcodeAt(pc);
+        unsigned short targets[2];
+        int targetCount = 0;
+
+        switch (classify(opcode))
+        {
+            case AOT_BODY:
+                pending[count++] = pc + 2;
+                continue;
+            case AOT_STORE:
+            case AOT_INTERPRET:
+                // BNNN goes who knows where -- the rest carry on at pc + 2
+                if ((opcode & 0xF000) != 0xB000)
+                    targets[targetCount++] = pc + 2;
+                break;
+            case AOT_BRANCH:
+                if ((opcode & 0xF000) == 0x1000)
+                    targets[targetCount++] = opcode & 0x0FFF;
+                else if ((opcode & 0xF000) == 0x2000)
+                {
+                    targets[targetCount++] = opcode & 0x0FFF;
+                    targets[targetCount++] = pc + 2; // where 00EE comes back to
+                }
+                else if (opcode != 0x00EE)
+                {
+                    targets[targetCount++] = pc + 2;
+                    targets[targetCount++] = pc + 4;
+                }
+                break;
+        }
+
+        for (int i = 0; i < targetCount; i++)
+        {
+            leader[targets[i] & 0xFFF] = 1;
+            pending[count++] = targets[i] & 0xFFF;
+        }
+    }
+}
+
+// instructions in the block starting at a leader -- 0 if it starts with an interpreted one
+static int blockLength(unsigned short start)
+{
+    unsigned short pc = start;
+    int length = 0;
+
+    if (classify(opcodeAt(start)) == AOT_INTERPRET)
+        return 0;
+
+    for (;;)
+    {
+        length++;
+        if (classify(opcodeAt(pc)) == AOT_BRANCH || classify(opcodeAt(pc)) == AOT_STORE)
+            return length;
+
+        pc += 2;
+        if (!inImage(pc) || leader[pc] || classify(opcodeAt(pc)) == AOT_INTERPRET)
+            return length;
+        if (length == AOT_MAX_BLOCK)
+        {
+            // carry on in a block of its own
+            leader[pc] = 1;
+            return length;
+        }
+    }
+}
+
+// registers an instruction reads or writes, as (written << 16) | read
+static unsigned int registersUsed(unsigned short opcode)
+{
+    int x = (opcode & 0x0F00) >> 8;
+    int y = (opcode & 0x00F0) >> 4;
+    unsigned int vx = 1u << x, vy = 1u << y, vf = 1u << 0xF;
+
+    switch (opcode & 0xF000)
+    {
+        case 0x3000: case 0x4000:
+            return vx;
+        case 0x5000: case 0x9000:
+            return vx | vy;
+        case 0x6000: case 0xC000:
+            return vx << 16;
+        case 0x7000:
+            return vx << 16 | vx;
+        case 0x8000:
+            if ((opcode & 0xF) == 0x0)
+                return vx << 16 | vy;
+            if ((opcode & 0xF) <= 0x3)
+                return vx << 16 | vx | vy;
+            return (vx | vf) << 16 | vx | vy;
+        case 0xD000:
+            return vf << 16 | vx | vy;
+        case 0xE000:
+            return vx;
+        case 0xF000:
+            switch (opcode & 0xFF)
+            {
+                case 0x07:
+                    return vx << 16;
+                case 0x55:
+                    return (2u << x) - 1;
+                case 0x65:
+                    return ((2u << x) - 1) << 16;
+            }
+            return vx;
+    }
+    return 0;
+}
+
+static int usesI(unsigned short opcode)
+{
+    switch (opcode & 0xF000)
+    {
+        case 0xA000: case 0xD000:
+            return 1;
+        case 0xF000:
+            return (opcode & 0xFF) == 0x1E || (opcode & 0xFF) == 0x29 || (opcode & 0xFF) >= 0x33;
+    }
+    return 0;
+}
+
+// one statement (or a braced group) for a straight-line instruction
+static void emitBody(FILE *out, unsigned short opcode)
+{
+    int x = (opcode & 0x0F00) >> 8;
+    int y = (opcode & 0x00F0) >> 4;
+    int nn = opcode & 0xFF;
+    int shifted = quirks & QUIRK_SHIFT_VY ? y : x;
+
+    fprintf(out, "    // %04X\n    ", opcode);
+    switch (opcode & 0xF000)
+    {
+        case 0x0000:
+            fprintf(out, "memset(chip8->gfx, 0, sizeof(chip8->gfx));\n");
+            break;
+        case 0x6000:
+            fprintf(out, "v%X = 0x%02X;\n", x, nn);
+            break;
+        case 0x7000:
+            fprintf(out, "v%X += 0x%02X;\n", x, nn);
+            break;
+        case 0x8000:
+            switch (opcode & 0xF)
+            {
+                case 0x0: fprintf(out, "v%X = v%X;\n", x, y); break;
+                case 0x1: fprintf(out, "v%X |= v%X;\n", x, y); break;
+                case 0x2: fprintf(out, "v%X &= v%X;\n", x, y); break;
+                case 0x3: fprintf(out, "v%X ^= v%X;\n", x, y); break;
+                case 0x4:
+                    fprintf(out, "{ unsigned int sum = v%X + v%X; v%X = sum; vF = sum > 0xFF; }\n", x, y, x);
+                    break;
+                case 0x5:
+                    fprintf(out, "{ unsigned char x = v%X, y = v%X; v%X = x - y; vF = x >= y; }\n", x, y, x);
+                    break;
+                case 0x6:
+                    fprintf(out, "{ unsigned char s = v%X; v%X = s >> 1; vF = s & 0x1; }\n", shifted, x);
+                    break;
+                case 0x7:
+                    fprintf(out, "{ unsigned char x = v%X, y = v%X; v%X = y - x; vF = y >= x; }\n", x, y, x);
+                    break;
+                case 0xE:
+                    fprintf(out, "{ unsigned char s = v%X; v%X = s << 1; vF = s >> 7; }\n", shifted, x);
+                    break;
+            }
+            break;
+        case 0xA000:
+            fprintf(out, "I = 0x%03X;\n", opcode & 0x0FFF);
+            break;
+        case 0xC000:
+            fprintf(out, "v%X = 0x%02X & nextRandom(chip8);\n", x, nn);
+            break;
+        case 0xD000:
+            fprintf(out, "vF = %s(chip8->gfx, chip8->memory, I, v%X, v%X, %d);\n    chip8->drawFlag = 1;\n",
+                quirks & QUIRK_CLIP ? "drawSpriteRowsClipped" : "drawSpriteRows", x, y, opcode & 0xF);
+            break;
+        case 0xF000:
+            switch (nn)
+            {
+                case 0x07: fprintf(out, "v%X = chip8->delay_timer;\n", x); break;
+                case 0x15: fprintf(out, "chip8->delay_timer = v%X;\n", x); break;
+                case 0x18: fprintf(out, "chip8->sound_timer = v%X;\n", x); break;
+                case 0x1E: fprintf(out, "I += v%X;\n", x); break;
+                case 0x29: fprintf(out, "I = v%X * 5;\n", x); break;
+                case 0x33:
+                    fprintf(out, "chip8->memory[I & 0xFFF] = v%X / 100;\n", x);
+                    fprintf(out, "    chip8->memory[(I + 1) & 0xFFF] = v%X / 10 %% 10;\n", x);
+                    fprintf(out, "    chip8->memory[(I + 2) & 0xFFF] = v%X %% 10;\n", x);
+                    fprintf(out, "    invalidateDecoded(chip8, I, 3);\n");
+                    break;
+                case 0x55:
+                    for (int i = 0; i <= x; i++)
+                        fprintf(out, "%schip8->memory[(I + %d) & 0xFFF] = v%X;\n", i > 0 ? "    " : "", i, i);
+                    fprintf(out, "    invalidateDecoded(chip8, I, %d);\n", x + 1);
+                    if (quirks & QUIRK_LOAD_STORE_I)
+                        fprintf(out, "    I += %d;\n", x + 1);
+                    break;
+                case 0x65:
+                    for (int i = 0; i <= x; i++)
+                        fprintf(out, "%sv%X = chip8->memory[(I + %d) & 0xFFF];\n", i > 0 ? "    " : "", i, i);
+                    if (quirks & QUIRK_LOAD_STORE_I)
+                        fprintf(out, "    I += %d;\n", x + 1);
+                    break;
+            }
+            break;
+    }
+}
+
+// sets chip8->pc after the block's last instruction
+static void emitExit(FILE *out, unsigned short pc, unsigned short opcode)
+{
+    int x = (opcode & 0x0F00) >> 8;
+    int y = (opcode & 0x00F0) >> 4;
+    unsigned short skip = (pc + 4) & 0xFFFF, next = (pc + 2) & 0xFFFF;
+
+    if (classify(opcode) != AOT_BRANCH)
+    {
+        fprintf(out, "    chip8->pc = 0x%03X;\n", next);
+        return;
+    }
+
+    fprintf(out, "    // %04X\n", opcode);
+    switch (opcode & 0xF000)
+    {
+        case 0x0000:
+            fprintf(out, "    chip8->sp = (chip8->sp - 1) & 0xF;\n    chip8->pc = chip8->stack[chip8->sp] + 2;\n");
+            break;
+        case 0x1000:
+            fprintf(out, "    chip8->pc = 0x%03X;\n", opcode & 0x0FFF);
+            break;
+        case 0x2000:
+            fprintf(out, "    chip8->stack[chip8->sp] = 0x%03X;\n    chip8->sp = (chip8->sp + 1) & 0xF;\n"
+                "    chip8->pc = 0x%03X;\n", pc, opcode & 0x0FFF);
+            break;
+        case 0x3000:
+            fprintf(out, "    chip8->pc = v%X == 0x%02X ? 0x%03X : 0x%03X;\n", x, opcode & 0xFF, skip, next);
+            break;
+        case 0x4000:
+            fprintf(out, "    chip8->pc = v%X != 0x%02X ? 0x%03X : 0x%03X;\n", x, opcode & 0xFF, skip, next);
+            break;
+        case 0x5000:
+            fprintf(out, "    chip8->pc = v%X == v%X ? 0x%03X : 0x%03X;\n", x, y, skip, next);
+            break;
+        case 0x9000:
+            fprintf(out, "    chip8->pc = v%X != v%X ? 0x%03X : 0x%03X;\n", x, y, skip, next);
+            break;
+        case 0xE000:
+            fprintf(out, "    chip8->pc = chip8->key[v%X & 0xF] %s 0 ? 0x%03X : 0x%03X;\n",
+                x, (opcode & 0xFF) == 0x9E ? "!=" : "==", skip, next);
+            break;
+    }
+}
+
+static void emitBlock(FILE *out, unsigned short start, int length)
+{
+    unsigned int used = 0;
+    int withI = 0;
+
+    for (int i = 0; i < length; i++)
+    {
+        unsigned short opcode = opcodeAt(start + i * 2);
+        used |= registersUsed(opcode);
+        withI |= usesI(opcode);
+    }
+    unsigned int written = used >> 16;
+    unsigned int read = (used | written) & 0xFFFF;
+
+    fprintf(out, "\nstatic int block%03X(Chip8 *chip8)\n{\n", start);
+    for (int i = 0; i < 16; i++)
+    {
+        if (read & (1u << i))
+            fprintf(out, "    unsigned char v%X = chip8->V[%d];\n", i, i);
+    }
+    if (withI)
+        fprintf(out, "    unsigned short I = chip8->I;\n");
+    fprintf(out, "\n");
+
+    unsigned short last = start + (length - 1) * 2;
+    for (int i = 0; i < length; i++)
+    {
+        unsigned short opcode = opcodeAt(start + i * 2);
+        if (classify(opcode) == AOT_BODY || classify(opcode) == AOT_STORE)
+            emitBody(out, opcode);
+    }
+
+    fprintf(out, "\n");
+    for (int i = 0; i < 16; i++)
+    {
+        if (written & (1u << i))
+            fprintf(out, "    chip8->V[%d] = v%X;\n", i, i);
+    }
+    if (withI)
+        fprintf(out, "    chip8->I = I;\n");
+    emitExit(out, last, opcodeAt(last));
+    fprintf(out, "    return %d;\n}\n", length);
+}
+
+// returns the number of blocks written, or -1 if the file couldn't be written
+static int translate(const char *romPath, const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (out == NULL)
+        return -1;
+
+    static unsigned short starts[4096];
+    static int lengths[4096];
+    int blocks = 0;
+
+    // leaders found while sizing blocks are always further on, so one pass does
+    for (int pc = 0x200; pc < 0x1000; pc++)
+    {
+        if (leader[pc] && inImage(pc) && (lengths[blocks] = blockLength(pc)) > 0)
+            starts[blocks++] = pc;
+    }
+
+    fprintf(out, "// generated by aot from %s (quirks %d) -- do not edit\n\n", romPath, quirks);
+    fprintf(out, "#define AOT_MODULE\n#include \"aot.h\"\n\nstatic const unsigned char image[%zu] = {", imageSize);
+    for (size_t i = 0; i < imageSize; i++)
+        fprintf(out, "%s0x%02X,", i % 12 == 0 ? "\n    " : " ", image[i]);
+    fprintf(out, "\n};\n");
+
+    for (int i = 0; i < blocks; i++)
+        emitBlock(out, starts[i], lengths[i]);
+
+    fprintf(out, "\nstatic const AotBlock blocks[%d] = {\n", blocks > 0 ? blocks : 1);
+    for (int i = 0; i < blocks; i++)
+    {
+        // FX33 writes 3 bytes, FX55 V0 - VX
+        unsigned short last = opcodeAt(starts[i] + (lengths[i] - 1) * 2);
+        int writes = 0, advance = 0;
+        if (classify(last) == AOT_STORE)
+        {
+            writes = (last & 0xFF) == 0x33 ? 3 : ((last & 0x0F00) >> 8) + 1;
+            advance = (last & 0xFF) == 0x55 && (quirks & QUIRK_LOAD_STORE_I) ? writes : 0;
+        }
+        fprintf(out, "    { 0x%03X, %d, %d, %d, block%03X },\n", starts[i], lengths[i], writes, advance, starts[i]);
+    }
+    fprintf(out, "};\n\n__attribute__((visibility(\"default\")))\nconst AotModule chip8AotModule = {\n"
+        "    AOT_VERSION, offsetof(Chip8, decoded), %d, sizeof(image), image, %d, blocks\n};\n", quirks, blocks);
+
+    return fclose(out) == 0 ? blocks : -1;
+}
+
+static void usage()
+{
+    printf("usage: aot [-Q quirks] [-I include dir] rom output.c|output.so\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *includeDir = ".";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "Q:I:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'Q':
+                quirks = quirksParse(optarg);
+                if (quirks < 0)
+                {
+                    printf("Unknown quirks: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'I':
+                includeDir = optarg;
+                break;
+            default:
+                usage();
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    if (argc - optind != 2)
+    {
+        usage();
+        return -1;
+    }
+    const char *romPath = argv[optind];
+    const char *outPath = argv[optind + 1];
+
+    Chip8 *chip8 = malloc(sizeof(Chip8));
+    *chip8 = initialize();
+    int result = loadGame(chip8, romPath);
+    if (result != ROM_OK)
+    {
+        printf("Could not load ROM %s: %s\n", romPath, romErrorString(result));
+        return -1;
+    }
+
+    struct stat info;
+    if (stat(romPath, &info) != 0)
+    {
+        printf("Could not load ROM %s: %s\n", romPath, romErrorString(ROM_UNREADABLE));
+        return -1;
+    }
+    imageSize = info.st_size;
+    memcpy(image, chip8->memory + 0x200, imageSize);
+    free(chip8);
+
+    walk();
+
+    size_t length = strlen(outPath);
+    int shared = length >= 3 && strcmp(outPath + length - 3, ".so") == 0;
+    char source[4096];
+    snprintf(source, sizeof(source), shared ? "%s.c" : "%s", outPath);
+
+    int blocks = translate(romPath, source);
+    if (blocks < 0)
+    {
+        printf("Could not write %s\n", source);
+        return -1;
+    }
+
+    int instructions = 0, translated = 0;
+    for (int pc = 0x200; pc < 0x1000; pc++)
+    {
+        instructions += reached[pc];
+        translated += reached[pc] && classify(opcodeAt(pc)) != AOT_INTERPRET;
+    }
+    printf("%s: %d blocks, %d of %d reachable instructions translated\n", romPath, blocks, translated, instructions);
+
+    if (shared)
+    {
+        const char *cc = getenv("CC") != NULL ? getenv("CC") : "cc";
+        char command[16384];
+
+        snprintf(command, sizeof(command), "%s -std=gnu11 -O2 -shared -fPIC -fvisibility=hidden -I'%s' -o '%s' '%s'",
+            cc, includeDir, outPath, source);
+        result = system(command);
+        remove(source);
+        if (result != 0)
+        {
+            printf("Could not compile %s\n", outPath);
+            return -1;
+        }
+    }
+
+    return 0;
+}
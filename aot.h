@@ -0,0 +1,225 @@
+#ifndef AOT_H
+#define AOT_H
+#include <stddef.h>
+#include <string.h>
+#include "chip8.h"
+
+/* Ahead-of-time translated ROMs
+
+    aot.c walks a ROM's control flow from 0x200 and writes it out as C, one
+    function per basic block, which the C compiler then builds into a shared
+    library. A block is the straight-line run of instructions from a leader
+    (0x200, a jump or call target, or the instruction after a skip, call,
+    store or interpreted instruction) up to the next leader or control
+    transfer, so every block runs a fixed number of instructions and leaves
+    the pc of its successor. V registers and I live in locals inside a block.
+
+    Anything whose effect can't be known when translating is left to
+    emulateCycle(): BNNN (computed jump) and FX0A (key wait). The memory
+    writers FX33 and FX55 always end their block, and are the only writers,
+    so after such a block (or an interpreted one) we know exactly which
+    bytes changed and recheck the blocks over them against the ROM image
+    the module was built from -- code written at runtime is interpreted.
+    Code the walk never reached (only entered through BNNN, say) has no
+    block and is interpreted.
+
+    A module is built for one set of quirks; on a machine with others, or
+    from a ROM it doesn't match, every block is refused and runCyclesAot()
+    is plain interpretation. A module is opened once as an AotLibrary --
+    the library handle and its blocks by pc -- and shared by any number of
+    machines, each with a small Chip8Aot of its own recording which blocks
+    still match its memory. Like a Chip8Jit, a Chip8Aot belongs to one
+    machine -- call aotReset() after loadState() or loading another ROM.
+
+    The generated file includes this header with AOT_MODULE defined, which
+    leaves out the loader and keeps the module free of libdl.
+*/
+
+// bumped whenever AotModule, AotBlock or the block calling convention changes
+#define AOT_VERSION 1
+#define AOT_MAX_BLOCK 64
+#define AOT_MODULE_SYMBOL "chip8AotModule"
+
+// runs one block on the machine -- returns the instruction count with chip8->pc at the successor
+typedef int (*AotBlockFn)(Chip8 *chip8);
+
+typedef struct AotBlock {
+    unsigned short pc;
+    unsigned short length; // instructions executed per call
+    unsigned char writes;  // bytes stored at I by an FX33 / FX55 ending the block, or 0
+    unsigned char advance; // how far that store moved I on (QUIRK_LOAD_STORE_I)
+    AotBlockFn fn;
+} AotBlock;
+
+typedef struct AotModule {
+    unsigned int version;
+    unsigned int stateSize;     // offsetof(Chip8, decoded) the module was compiled against
+    unsigned char quirks;
+    unsigned short imageSize;
+    const unsigned char *image; // the ROM the blocks were translated from, loaded at 0x200
+    int blockCount;
+    const AotBlock *blocks;
+} AotModule;
+
+#ifndef AOT_MODULE
+#include <dlfcn.h>
+
+enum {
+    AOT_UNCHECKED = 0,
+    AOT_VALID,
+    AOT_STALE // memory under the block differs from the image -- interpreted
+};
+
+// a loaded module, shared by every machine running it
+typedef struct AotLibrary {
+    void *handle;
+    const AotModule *module;
+    const AotBlock *blocks[4096]; // by start pc, NULL where the module has none
+} AotLibrary;
+
+// one machine's view of an AotLibrary
+typedef struct Chip8Aot {
+    const AotLibrary *library;
+    const AotModule *module;
+    unsigned char state[4096];
+    unsigned long long stale; // checks that found a block's code changed
+} Chip8Aot;
+
+// returns NULL if the library can't be opened or isn't a module for this build
+AotLibrary *aotLibraryLoad(const char *path)
+{
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (handle == NULL)
+        return NULL;
+
+    const AotModule *module = dlsym(handle, AOT_MODULE_SYMBOL);
+    AotLibrary *library = NULL;
+
+    if (module != NULL && module->version == AOT_VERSION && module->stateSize == offsetof(Chip8, decoded))
+        library = calloc(1, sizeof(AotLibrary));
+    if (library == NULL)
+    {
+        dlclose(handle);
+        return NULL;
+    }
+
+    library->handle = handle;
+    library->module = module;
+    for (int i = 0; i < module->blockCount; i++)
+        library->blocks[module->blocks[i].pc & 0xFFF] = &module->blocks[i];
+    return library;
+}
+
+// every Chip8Aot made from the library has to be gone first
+void aotLibraryDestroy(AotLibrary *library)
+{
+    dlclose(library->handle);
+    free(library);
+}
+
+// 1 if the machine has the ROM and quirks the module was built for
+int aotMatches(const AotLibrary *library, const Chip8 *chip8)
+{
+    const AotModule *module = library->module;
+    return chip8->quirks == module->quirks && memcmp(chip8->memory + 0x200, module->image, module->imageSize) == 0;
+}
+
+// returns NULL if out of memory
+Chip8Aot *aotCreate(const AotLibrary *library)
+{
+    Chip8Aot *aot = calloc(1, sizeof(Chip8Aot));
+    if (aot == NULL)
+        return NULL;
+
+    aot->library = library;
+    aot->module = library->module;
+    return aot;
+}
+
+void aotDestroy(Chip8Aot *aot)
+{
+    free(aot);
+}
+
+// forgets which blocks were found to match memory, so all are checked again
+void aotReset(Chip8Aot *aot)
+{
+    memset(aot->state, AOT_UNCHECKED, sizeof(aot->state));
+}
+
+// rechecks every block overlapping memory[addr, addr + length)
+void aotInvalidate(Chip8Aot *aot, unsigned short addr, int length)
+{
+    // blocks only cover the image, and most stores land in data past it
+    addr &= 0xFFF;
+    if (addr + length <= 0x1000 && (addr + length <= 0x200 || addr >= 0x200 + aot->module->imageSize))
+        return;
+
+    for (int i = -(AOT_MAX_BLOCK * 2 - 1); i < length; i++)
+        aot->state[(addr + i) & 0xFFF] = AOT_UNCHECKED;
+}
+
+// a block may run while the bytes it was translated from are still in memory
+static int aotCheck(Chip8Aot *aot, const Chip8 *chip8, const AotBlock *block)
+{
+    const AotModule *module = aot->module;
+    size_t offset = block->pc - 0x200;
+    size_t bytes = block->length * 2;
+
+    if (memcmp(chip8->memory + block->pc, module->image + offset, bytes) == 0)
+        return AOT_VALID;
+
+    aot->stale++;
+    return AOT_STALE;
+}
+
+// Runs exactly `cycles` instructions -- translated blocks where possible,
+// emulateCycle() for the rest -- and returns how many were executed.
+unsigned long runCyclesAot(Chip8Aot *aot, Chip8 *chip8, unsigned long cycles)
+{
+    unsigned long done = 0;
+    int usable = chip8->quirks == aot->module->quirks;
+
+    while (done < cycles)
+    {
+        unsigned short pc = chip8->pc;
+        const AotBlock *block = usable && pc < 0x1000 ? aot->library->blocks[pc] : NULL;
+
+        if (block != NULL && aot->state[pc] == AOT_UNCHECKED)
+            aot->state[pc] = aotCheck(aot, chip8, block);
+
+        if (block != NULL && aot->state[pc] == AOT_VALID && block->length <= cycles - done)
+        {
+            unsigned long length = block->fn(chip8);
+            done += length;
+            chip8->cycles += length;
+
+            if (block->writes != 0)
+                aotInvalidate(aot, chip8->I - block->advance, block->writes);
+        }
+        else if (waitingForKey(chip8))
+        {
+            // blocked on FX0A for the rest of the call, see runCycles()
+            chip8->cycles += cycles - done;
+            chip8->idleCycles += cycles - done;
+            done = cycles;
+        }
+        else
+        {
+            unsigned short I = chip8->I;
+            emulateCycle(chip8);
+            done++;
+
+            if ((chip8->opcode & 0xF0FF) == 0xF033)
+                aotInvalidate(aot, I, 3);
+            else if ((chip8->opcode & 0xF0FF) == 0xF055)
+                aotInvalidate(aot, I, ((chip8->opcode & 0x0F00) >> 8) + 1);
+        }
+    }
+
+    return done;
+}
+
+#endif
+
+#endif
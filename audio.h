@@ -0,0 +1,211 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "chip8.h"
+
+/* Sound -- the CPU thread's timer ticks to samples
+
+    Every 60Hz frame becomes one block of AUDIO_BLOCK_SAMPLES samples, a
+    square wave while the sound timer is still running after the frame's
+    tick and silence otherwise (so, as on the COSMAC VIP, setting the timer
+    to 1 makes no sound). Blocks line up exactly with timer ticks and the
+    tone's phase carries across them, so back to back beeps don't click.
+
+    Blocks reach the audio callback through a single-producer
+    single-consumer ring like the KeyQueue in handoff.h. The CPU thread
+    never waits on it: a block that doesn't fit is dropped and counted.
+    The callback never allocates or locks: it plays what has been queued,
+    skips the oldest blocks once more than AUDIO_LATENCY_BLOCKS are
+    waiting (after a stall, or with the emulation running fast) and plays
+    silence on an underrun.
+
+    The same blocks can also be written to a WAV file, which needs no
+    audio device at all.
+*/
+
+#define AUDIO_RATE 44100
+#define AUDIO_BLOCK_SAMPLES (AUDIO_RATE / 60) // exactly one timer tick
+#define AUDIO_RING_BLOCKS 16                  // power of two
+#define AUDIO_LATENCY_BLOCKS 3                // ~50ms queued at most
+#define AUDIO_TONE 440
+#define AUDIO_VOLUME 4000
+
+typedef struct AudioBlock {
+    int16_t samples[AUDIO_BLOCK_SAMPLES];
+} AudioBlock;
+
+typedef struct AudioRing {
+    AudioBlock blocks[AUDIO_RING_BLOCKS];
+    atomic_uint head; // next block to write, producer only
+    atomic_uint tail; // next block to read, consumer only
+    // consumer only -- samples of the block at tail already played
+    int offset;
+    // counters, for reporting
+    atomic_uint dropped;
+    atomic_uint underruns;
+} AudioRing;
+
+typedef struct AudioSynth {
+    uint32_t phase; // fixed point, one wave per 2^32
+} AudioSynth;
+
+void audioRingInit(AudioRing *ring)
+{
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->offset = 0;
+    atomic_init(&ring->dropped, 0);
+    atomic_init(&ring->underruns, 0);
+}
+
+// fills one tick's block -- a tone when the sound timer is running
+void audioSynthesize(AudioSynth *synth, const Chip8 *chip8, AudioBlock *block)
+{
+    if (chip8->sound_timer == 0)
+    {
+        memset(block->samples, 0, sizeof(block->samples));
+        return;
+    }
+
+    const uint32_t step = (uint32_t)(((uint64_t)AUDIO_TONE << 32) / AUDIO_RATE);
+    for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++)
+    {
+        block->samples[i] = synth->phase < 0x80000000u ? AUDIO_VOLUME : -AUDIO_VOLUME;
+        synth->phase += step;
+    }
+}
+
+// producer -- returns 0 if the ring is full and the block was dropped
+int audioPush(AudioRing *ring, const AudioBlock *block)
+{
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == AUDIO_RING_BLOCKS)
+    {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return 0;
+    }
+
+    ring->blocks[head & (AUDIO_RING_BLOCKS - 1)] = *block;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 1;
+}
+
+// consumer -- fills out[0, count) from the ring, silence where it runs dry
+void audioPull(AudioRing *ring, int16_t *out, int count)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    // too far behind -- skip to the newest blocks rather than lag behind the game
+    if (head - tail > AUDIO_LATENCY_BLOCKS)
+    {
+        tail = head - AUDIO_LATENCY_BLOCKS;
+        ring->offset = 0;
+    }
+
+    while (count > 0)
+    {
+        if (tail == head)
+        {
+            memset(out, 0, count * sizeof(int16_t));
+            atomic_fetch_add_explicit(&ring->underruns, 1, memory_order_relaxed);
+            break;
+        }
+
+        const AudioBlock *block = &ring->blocks[tail & (AUDIO_RING_BLOCKS - 1)];
+        int available = AUDIO_BLOCK_SAMPLES - ring->offset;
+        int copied = available < count ? available : count;
+
+        memcpy(out, block->samples + ring->offset, copied * sizeof(int16_t));
+        out += copied;
+        count -= copied;
+        ring->offset += copied;
+        if (ring->offset == AUDIO_BLOCK_SAMPLES)
+        {
+            ring->offset = 0;
+            tail++;
+        }
+    }
+
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+}
+
+typedef struct WavWriter {
+    FILE *file;
+    uint32_t samples;
+} WavWriter;
+
+static void wavPut16(FILE *file, uint16_t value)
+{
+    fputc(value & 0xFF, file);
+    fputc(value >> 8, file);
+}
+
+static void wavPut32(FILE *file, uint32_t value)
+{
+    wavPut16(file, value & 0xFFFF);
+    wavPut16(file, value >> 16);
+}
+
+// 16 bit mono PCM at AUDIO_RATE
+static void wavHeader(FILE *file, uint32_t samples)
+{
+    fwrite("RIFF", 1, 4, file);
+    wavPut32(file, 36 + samples * 2);
+    fwrite("WAVEfmt ", 1, 8, file);
+    wavPut32(file, 16);
+    wavPut16(file, 1); // PCM
+    wavPut16(file, 1); // channels
+    wavPut32(file, AUDIO_RATE);
+    wavPut32(file, AUDIO_RATE * 2);
+    wavPut16(file, 2); // bytes per frame
+    wavPut16(file, 16);
+    fwrite("data", 1, 4, file);
+    wavPut32(file, samples * 2);
+}
+
+// returns NULL if the file couldn't be created
+WavWriter *wavOpen(const char *path)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+        return NULL;
+
+    WavWriter *wav = malloc(sizeof(WavWriter));
+    wav->file = file;
+    wav->samples = 0;
+    wavHeader(file, 0); // sizes are filled in by wavClose()
+    return wav;
+}
+
+void wavWrite(WavWriter *wav, const AudioBlock *block)
+{
+    for (int i = 0; i < AUDIO_BLOCK_SAMPLES; i++)
+        wavPut16(wav->file, (uint16_t)block->samples[i]);
+    wav->samples += AUDIO_BLOCK_SAMPLES;
+}
+
+// finishes the header and closes the file -- returns 0 on success, -1 if writing failed
+int wavClose(WavWriter *wav)
+{
+    int result = 0;
+
+    if (fseek(wav->file, 0, SEEK_SET) == 0)
+        wavHeader(wav->file, wav->samples);
+    else
+        result = -1;
+    if (ferror(wav->file))
+        result = -1;
+    if (fclose(wav->file) != 0)
+        result = -1;
+
+    free(wav);
+    return result;
+}
+
+#endif
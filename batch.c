@@ -0,0 +1,570 @@
+// Headless batch runner -- runs many Chip8 instances across a pool of worker
+// threads (one per core by default) with no SDL at all.
+//
+//  usage: batch [-t threads] [-c cycles] [-q quantum] [-s seed] [-j] [-v] [-P profile]
+//               [-Q quirks] [-A module] [-L library] [-W pack] [-a wav] [-V video [-S scale] [-D]]
+//               [-T trace [-N keep]] rom[:count[:quirks]] ...
+//
+// ROMs come from a romlib.h library: -L opens a directory or pack file and
+// a rom without a '/' names a ROM in it, anything else is taken as a path.
+// Each distinct ROM is mapped once and copied straight from the mapping
+// into its instances.
+// -W writes the library, with any ROMs named by path added, to a pack file
+// for quicker opening next time.
+// -Q picks the quirks (default, cosmac, schip or a number of QUIRK_* bits)
+// for every ROM without a :quirks suffix of its own.
+// -j runs every instance through the x86-64 block recompiler in jit.h.
+// -A (repeatable) loads a module built by aot for instances of the ROM and
+// quirks it was built from, which then run translated ahead of time instead.
+// -a records instance 0's sound to a WAV file, one audio.h block per frame.
+// -V records what instance 0 draws, through capture.h: YUV4MPEG2 when the
+// name ends in .y4m and raw RGBA otherwise, "|command" to pipe it. -S scales
+// each pixel up (default 1) and -D leaves out frames that repeat the last.
+// -T (CHIP8_TRACE builds) writes every instruction instance 0 runs to an
+// execution trace, see trace.h and traceread.c. -N keeps only about the last
+// `keep` instructions of it, in memory until the run ends -- a flight recorder.
+// Instance n seeds its random number generator with seed + n, so runs repeat exactly.
+// -P (CHIP8_PROFILE builds) profiles every interpreted instance and writes the
+// sum of them as JSON, or CSV when the file name ends in .csv.
+// Every instance runs `cycles` instructions. Work is handed out in slices of
+// `quantum` instructions: each worker owns a deque of instances, pops from
+// its own end and steals from the other end of a random victim's deque when
+// it runs dry, so long and short jobs even out across cores.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "chip8.h"
+#include "jit.h"
+#include "aot.h"
+#include "scheduler.h"
+#include "romlib.h"
+#include "audio.h"
+#include "capture.h"
+
+typedef struct Instance {
+    Chip8 chip8;
+    Chip8Jit *jit;
+    Chip8Aot *aot;
+    WavWriter *wav; // -a, instance 0 only
+    AudioSynth synth;
+    Capture *capture; // -V, instance 0 only
+    int traced;       // -T, instance 0 only
+    const char *romPath;
+    unsigned long long framesLeft;
+    unsigned long long cyclesRun;
+    unsigned long long nanoseconds;
+} Instance;
+
+// work-stealing deque of instance indices -- owner uses the bottom, thieves the top
+typedef struct WorkQueue {
+    pthread_mutex_t lock;
+    int *items;
+    int capacity;
+    int top;
+    int bottom;
+} WorkQueue;
+
+typedef struct Worker {
+    pthread_t thread;
+    int id;
+    unsigned int seed;
+    unsigned long long steals;
+} Worker;
+
+static Instance *instances;
+static int instanceCount;
+static WorkQueue *queues;
+static int workerCount;
+static unsigned long long quantum = 100000;
+static int instructionsPerFrame = SCHEDULER_DEFAULT_IPF;
+static atomic_int remaining;
+
+static void queueInit(WorkQueue *queue, int capacity)
+{
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->items = malloc(sizeof(int) * capacity);
+    queue->capacity = capacity;
+    queue->top = 0;
+    queue->bottom = 0;
+}
+
+static void queuePush(WorkQueue *queue, int item)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->items[queue->bottom % queue->capacity] = item;
+    queue->bottom++;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// owner end -- returns -1 when empty
+static int queuePop(WorkQueue *queue)
+{
+    int item = -1;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->bottom > queue->top)
+    {
+        queue->bottom--;
+        item = queue->items[queue->bottom % queue->capacity];
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return item;
+}
+
+// thief end -- returns -1 when empty
+static int queueSteal(WorkQueue *queue)
+{
+    int item = -1;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->bottom > queue->top)
+    {
+        item = queue->items[queue->top % queue->capacity];
+        queue->top++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return item;
+}
+
+static void *workerThread(void *workerData)
+{
+    Worker *worker = workerData;
+    WorkQueue *own = &queues[worker->id];
+
+    while (atomic_load(&remaining) > 0)
+    {
+        int index = queuePop(own);
+
+        if (index == -1)
+        {
+            // own deque is empty -- try every other worker once, starting at a random victim
+            int start = rand_r(&worker->seed) % workerCount;
+            for (int i = 0; i < workerCount && index == -1; i++)
+            {
+                int victim = (start + i) % workerCount;
+                if (victim != worker->id)
+                    index = queueSteal(&queues[victim]);
+            }
+
+            if (index == -1)
+            {
+                sched_yield();
+                continue;
+            }
+            worker->steals++;
+        }
+
+        Instance *instance = &instances[index];
+        unsigned long long slice = quantum / instructionsPerFrame + 1;
+        if (slice > instance->framesLeft)
+            slice = instance->framesLeft;
+        unsigned long long start = schedulerNow();
+
+        for (unsigned long long frame = 0; frame < slice; frame++)
+        {
+            if (instance->aot != NULL)
+            {
+                runCyclesAot(instance->aot, &instance->chip8, instructionsPerFrame);
+                updateTimers(&instance->chip8);
+            }
+            else if (instance->jit != NULL)
+            {
+                runCyclesJit(instance->jit, &instance->chip8, instructionsPerFrame);
+                updateTimers(&instance->chip8);
+            }
+            else
+            {
+                runFrame(&instance->chip8, instructionsPerFrame);
+            }
+
+            if (instance->wav != NULL)
+            {
+                AudioBlock block;
+                audioSynthesize(&instance->synth, &instance->chip8, &block);
+                wavWrite(instance->wav, &block);
+            }
+
+            if (instance->capture != NULL && instance->chip8.drawFlag)
+            {
+                captureFrame(instance->capture, instance->chip8.gfx, instance->cyclesRun / instructionsPerFrame + frame);
+                instance->chip8.drawFlag = 0;
+            }
+        }
+
+        instance->nanoseconds += schedulerNow() - start;
+        instance->cyclesRun += slice * instructionsPerFrame;
+        instance->framesLeft -= slice;
+
+        if (instance->framesLeft > 0)
+            queuePush(own, index);
+        else
+            atomic_fetch_sub(&remaining, 1);
+    }
+
+    return NULL;
+}
+
+static void usage()
+{
+    printf("usage: batch [-t threads] [-c cycles] [-i ipf] [-q quantum] [-s seed] [-j] [-v] [-P profile]\n"
+           "             [-Q quirks] [-A module] [-L library] [-W pack] [-a wav] [-V video [-S scale] [-D]]\n"
+           "             [-T trace [-N keep]] rom[:count[:quirks]] ...\n");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long long cycles = 10000000;
+    uint32_t seed = 1;
+    char *profilePath = NULL;
+    char *libraryPath = NULL;
+    char *packPath = NULL;
+    char *wavPath = NULL;
+    char *videoPath = NULL;
+    char *tracePath = NULL;
+    unsigned long long traceKeep = 0;
+    int videoScale = 1;
+    int videoDedup = 0;
+    char **modulePaths = calloc(argc, sizeof(char *));
+    int moduleCount = 0;
+    int verbose = 0;
+    int useJit = 0;
+    int quirks = 0;
+    int opt;
+
+    workerCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    while ((opt = getopt(argc, argv, "t:c:i:q:s:jvQ:A:P:L:W:a:V:S:DT:N:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                workerCount = atoi(optarg);
+                break;
+            case 'c':
+                cycles = strtoull(optarg, NULL, 10);
+                break;
+            case 'i':
+                instructionsPerFrame = atoi(optarg);
+                break;
+            case 'q':
+                quantum = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            case 'j':
+                useJit = 1;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case 'Q':
+                quirks = quirksParse(optarg);
+                if (quirks < 0)
+                {
+                    printf("Unknown quirks: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'A':
+                modulePaths[moduleCount++] = optarg;
+                break;
+            case 'P':
+                profilePath = optarg;
+                break;
+            case 'L':
+                libraryPath = optarg;
+                break;
+            case 'W':
+                packPath = optarg;
+                break;
+            case 'a':
+                wavPath = optarg;
+                break;
+            case 'V':
+                videoPath = optarg;
+                break;
+            case 'S':
+                videoScale = atoi(optarg);
+                break;
+            case 'D':
+                videoDedup = 1;
+                break;
+            case 'T':
+                tracePath = optarg;
+                break;
+            case 'N':
+                traceKeep = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                usage();
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    if ((optind >= argc && packPath == NULL) || workerCount < 1 || cycles == 0 || quantum == 0 || instructionsPerFrame < 1)
+    {
+        usage();
+        return -1;
+    }
+
+#ifndef CHIP8_PROFILE
+    if (profilePath != NULL)
+    {
+        printf("-P needs a build with -DCHIP8_PROFILE\n");
+        return -1;
+    }
+#endif
+#ifndef CHIP8_TRACE
+    if (tracePath != NULL)
+    {
+        printf("-T needs a build with -DCHIP8_TRACE\n");
+        return -1;
+    }
+#endif
+
+    // count instances first so everything can be allocated in one go
+    for (int i = optind; i < argc; i++)
+    {
+        char *count = strchr(argv[i], ':');
+        int copies = count != NULL ? atoi(count + 1) : 1;
+        if (copies < 1)
+        {
+            printf("Instance count for %s must be at least 1\n", argv[i]);
+            usage();
+            return -1;
+        }
+        instanceCount += copies;
+    }
+
+    RomLibrary *library = libraryPath != NULL ? romLibraryOpen(libraryPath) : romLibraryCreate();
+    if (library == NULL)
+    {
+        printf("Could not open ROM library: %s\n", libraryPath);
+        return -1;
+    }
+
+    // each module is opened once and its block table shared by every instance it fits
+    AotLibrary **modules = calloc(moduleCount > 0 ? moduleCount : 1, sizeof(AotLibrary *));
+    for (int m = 0; m < moduleCount; m++)
+    {
+        modules[m] = aotLibraryLoad(modulePaths[m]);
+        if (modules[m] == NULL)
+        {
+            printf("Could not load module %s\n", modulePaths[m]);
+            return -1;
+        }
+    }
+
+    instances = calloc(instanceCount, sizeof(Instance));
+    int next = 0;
+
+    for (int i = optind; i < argc; i++)
+    {
+        char *count = strchr(argv[i], ':');
+        int copies = 1;
+        int romQuirks = quirks;
+        if (count != NULL)
+        {
+            *count = '\0';
+            copies = atoi(count + 1);
+
+            char *suffix = strchr(count + 1, ':');
+            if (suffix != NULL && (romQuirks = quirksParse(suffix + 1)) < 0)
+            {
+                printf("Unknown quirks for %s: %s\n", argv[i], suffix + 1);
+                return -1;
+            }
+        }
+
+        // each ROM is mapped once and copied into all of its instances. Only a bare
+        // name is looked up in a -L library, which keeps just the file names of its
+        // entries -- a path is always mapped, and romAdd() shares the bytes of a copy.
+        const RomEntry *rom = NULL;
+        if (libraryPath != NULL && strchr(argv[i], '/') == NULL)
+            rom = romFindName(library, argv[i]);
+        if (rom == NULL)
+        {
+            int result = romLibraryAddFile(library, argv[i]);
+            if (result < 0)
+            {
+                printf("Could not load ROM %s: %s\n", argv[i], romErrorString(result));
+                return -1;
+            }
+            rom = &library->entries[result];
+        }
+
+        const AotLibrary *module = NULL;
+        for (int j = 0; j < copies; j++, next++)
+        {
+            instances[next].chip8 = initialize();
+            seedRandom(&instances[next].chip8, seed + next);
+            romLoad(&instances[next].chip8, rom);
+            instances[next].chip8.quirks = romQuirks;
+            // the copies all start out the same, so the first one picks the module
+            for (int m = 0; j == 0 && m < moduleCount && module == NULL; m++)
+            {
+                if (aotMatches(modules[m], &instances[next].chip8))
+                    module = modules[m];
+            }
+            if (module != NULL && (instances[next].aot = aotCreate(module)) == NULL)
+            {
+                printf("Out of memory\n");
+                return -1;
+            }
+            instances[next].romPath = argv[i];
+            instances[next].framesLeft = (cycles + instructionsPerFrame - 1) / instructionsPerFrame;
+            if (useJit)
+                instances[next].jit = jitCreate();
+#ifdef CHIP8_PROFILE
+            if (profilePath != NULL)
+                instances[next].chip8.profile = profileCreate();
+#endif
+        }
+    }
+
+    if (packPath != NULL)
+    {
+        if (romLibraryWritePack(library, packPath) != 0)
+        {
+            printf("Could not write pack: %s\n", packPath);
+            return -1;
+        }
+        printf("%d ROMs packed into %s\n", library->count, packPath);
+        if (instanceCount == 0)
+            return 0;
+    }
+
+    if (wavPath != NULL && instanceCount > 0 && (instances[0].wav = wavOpen(wavPath)) == NULL)
+    {
+        printf("Could not create %s\n", wavPath);
+        return -1;
+    }
+
+    if (videoPath != NULL && instanceCount > 0
+        && (instances[0].capture = captureOpen(videoPath, captureFormat(videoPath), videoScale, videoDedup)) == NULL)
+    {
+        printf("Could not capture to %s (scale 1 - %d)\n", videoPath, CAPTURE_MAX_SCALE);
+        return -1;
+    }
+
+#ifdef CHIP8_TRACE
+    // only the interpreter's cores are traced
+    if (tracePath != NULL && instanceCount > 0)
+    {
+        if (instances[0].jit != NULL || instances[0].aot != NULL)
+        {
+            printf("-T traces the interpreter -- instance 0 can't run through -j or -A\n");
+            return -1;
+        }
+        if ((instances[0].chip8.trace = traceOpen(tracePath, traceKeep)) == NULL)
+        {
+            printf("Could not create %s\n", tracePath);
+            return -1;
+        }
+        instances[0].traced = 1;
+    }
+#endif
+
+    queues = malloc(sizeof(WorkQueue) * workerCount);
+    for (int i = 0; i < workerCount; i++)
+        queueInit(&queues[i], instanceCount);
+    for (int i = 0; i < instanceCount; i++)
+        queuePush(&queues[i % workerCount], i);
+
+    atomic_store(&remaining, instanceCount);
+
+    Worker *workers = calloc(workerCount, sizeof(Worker));
+    unsigned long long start = schedulerNow();
+
+    for (int i = 0; i < workerCount; i++)
+    {
+        workers[i].id = i;
+        workers[i].seed = (unsigned int)time(NULL) + i;
+        pthread_create(&workers[i].thread, NULL, workerThread, &workers[i]);
+    }
+
+    unsigned long long steals = 0;
+    for (int i = 0; i < workerCount; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        steals += workers[i].steals;
+    }
+
+    double seconds = (schedulerNow() - start) / 1e9;
+
+    if (instanceCount > 0 && instances[0].wav != NULL && wavClose(instances[0].wav) != 0)
+        printf("Could not write %s\n", wavPath);
+
+    CaptureStats captured;
+    if (instanceCount > 0 && instances[0].capture != NULL)
+    {
+        if (captureClose(instances[0].capture, &captured) != 0)
+            printf("Could not write %s\n", videoPath);
+        printf("video: %llu frames drawn, %llu images written, %llu repeats left out, %llu dropped\n",
+            captured.captured, captured.written, captured.duplicates, captured.dropped);
+    }
+
+#ifdef CHIP8_TRACE
+    TraceStats traced;
+    if (instanceCount > 0 && instances[0].traced)
+    {
+        if (traceClose(instances[0].chip8.trace, &traced) != 0)
+            printf("Could not write %s\n", tracePath);
+        instances[0].chip8.trace = NULL;
+        printf("trace: %llu instructions in %llu records, %llu keyframes, %llu bytes (%.3f per instruction), %llu segments dropped, %llu stalls\n",
+            traced.instructions, traced.records, traced.keyframes, traced.bytes,
+            traced.instructions ? (double)traced.bytes / traced.instructions : 0, traced.dropped, traced.stalls);
+    }
+#endif
+
+    // report
+    unsigned long long totalCycles = 0, idleCycles = 0;
+    double slowest = 0, fastest = 0;
+    for (int i = 0; i < instanceCount; i++)
+    {
+        Instance *instance = &instances[i];
+        double rate = instance->cyclesRun / (instance->nanoseconds / 1e9);
+        totalCycles += instance->cyclesRun;
+        idleCycles += instance->chip8.idleCycles;
+
+        if (i == 0 || rate < slowest)
+            slowest = rate;
+        if (i == 0 || rate > fastest)
+            fastest = rate;
+
+        if (verbose)
+        {
+            printf("instance %d (%s%s): %llu cycles (%llu idle), %.0f instructions/s\n",
+                i, instance->romPath, instance->aot != NULL ? ", translated" : "", instance->cyclesRun,
+                (unsigned long long)instance->chip8.idleCycles, rate);
+        }
+    }
+
+    printf("%d instances on %d threads: %llu cycles in %.3fs\n", instanceCount, workerCount, totalCycles, seconds);
+    printf("aggregate: %.0f instructions/s (%.0f per instance, %llu steals)\n",
+        totalCycles / seconds, totalCycles / seconds / instanceCount, steals);
+    printf("per instance: %.0f - %.0f instructions/s while running\n", slowest, fastest);
+    printf("idle: %.1f%% of cycles skipped over by idle loop detection\n", totalCycles ? 100.0 * idleCycles / totalCycles : 0);
+
+#ifdef CHIP8_PROFILE
+    if (profilePath != NULL)
+    {
+        Chip8Profile *total = profileCreate();
+        for (int i = 0; i < instanceCount; i++)
+            profileMerge(total, instances[i].chip8.profile);
+        if (profileDump(total, profilePath) != 0)
+            printf("Could not write profile to %s\n", profilePath);
+    }
+#endif
+
+    return 0;
+}
@@ -0,0 +1,358 @@
+// Benchmark suite -- runs the generated ROMs in corpus.h headlessly through
+// each engine and reports instructions/s, ns per instruction class and
+// startup time (from a file and from a romlib.h library), optionally checked against a stored baseline.
+//
+//  usage: bench [-c cycles] [-r repeats] [-t threshold] [-b baseline] [-w baseline] [-a]
+//
+// Every figure is the best of `repeats` runs, printed as a "name value" line.
+// -b compares against a baseline file of such lines: an instructions/s figure
+// more than `threshold` (default 0.10) below its baseline, or a startup time
+// more than that above it, fails the run with exit status 1. -w writes the
+// current figures out as the new baseline. Built with -DCHIP8_PROFILE the
+// per-class breakdown is printed too; it is sampled, so never compared.
+// -a also times each ROM translated by ./aot (which has to be built) as
+// engine "aot".
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "chip8.h"
+#include "jit.h"
+#include "aot.h"
+#include "scheduler.h"
+#include "corpus.h"
+#include "romlib.h"
+
+#define BENCH_IPF 1000
+#define BENCH_MAX_METRICS 64
+
+typedef struct Metric {
+    char name[64];
+    double value;
+    int higherIsBetter;
+} Metric;
+
+static Metric metrics[BENCH_MAX_METRICS];
+static int metricCount;
+
+static void addMetric(const char *name, double value, int higherIsBetter)
+{
+    if (metricCount == BENCH_MAX_METRICS)
+        return;
+
+    snprintf(metrics[metricCount].name, sizeof(metrics[0].name), "%s", name);
+    metrics[metricCount].value = value;
+    metrics[metricCount].higherIsBetter = higherIsBetter;
+    metricCount++;
+    printf("%-24s %14.0f\n", name, value);
+}
+
+enum { ENGINE_REFERENCE, ENGINE_THREADED, ENGINE_JIT, ENGINE_AOT, ENGINE_COUNT };
+static const char *engineNames[ENGINE_COUNT] = { "reference", "threaded", "jit", "aot" };
+
+// instructions per second for one engine on one loaded machine -- aot is its module for ENGINE_AOT
+static double runEngine(int engine, const Chip8 *loaded, Chip8Aot *aot, unsigned long long cycles)
+{
+    static Chip8 chip8;
+    Chip8Jit *jit = engine == ENGINE_JIT ? jitCreate() : NULL;
+    unsigned long long frames = cycles / BENCH_IPF;
+
+    chip8 = *loaded;
+    if (aot != NULL)
+        aotReset(aot);
+    uint64_t start = schedulerNow();
+
+    for (unsigned long long frame = 0; frame < frames; frame++)
+    {
+        switch (engine)
+        {
+            case ENGINE_REFERENCE:
+                for (int i = 0; i < BENCH_IPF; i++)
+                    emulateCycle(&chip8);
+                updateTimers(&chip8);
+                break;
+            case ENGINE_THREADED:
+                runFrame(&chip8, BENCH_IPF);
+                break;
+            case ENGINE_JIT:
+                runCyclesJit(jit, &chip8, BENCH_IPF);
+                updateTimers(&chip8);
+                break;
+            case ENGINE_AOT:
+                runCyclesAot(aot, &chip8, BENCH_IPF);
+                updateTimers(&chip8);
+                break;
+        }
+    }
+
+    uint64_t elapsed = schedulerNow() - start;
+    if (jit != NULL)
+        jitDestroy(jit);
+
+    return frames * BENCH_IPF / (elapsed / 1e9);
+}
+
+// writes a ROM where loadGame() can read it -- returns 0 on failure
+static int writeRom(const char *path, const unsigned char *rom, size_t size)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+        return 0;
+
+    int ok = fwrite(rom, 1, size, file) == size;
+    return fclose(file) == 0 && ok;
+}
+
+// returns the number of regressions, or -1 if the baseline couldn't be read
+static int compareBaseline(const char *path, double threshold)
+{
+    FILE *file = fopen(path, "r");
+    char name[64];
+    double baseline;
+    int regressions = 0;
+
+    if (file == NULL)
+        return -1;
+
+    printf("\n%-24s %14s %14s %8s\n", "metric", "now", "baseline", "change");
+    while (fscanf(file, "%63s %lf", name, &baseline) == 2)
+    {
+        for (int i = 0; i < metricCount; i++)
+        {
+            if (strcmp(metrics[i].name, name) != 0 || baseline <= 0)
+                continue;
+
+            double change = metrics[i].value / baseline - 1;
+            int regressed = metrics[i].higherIsBetter ? change < -threshold : change > threshold;
+            regressions += regressed;
+            printf("%-24s %14.0f %14.0f %+7.1f%%%s\n", name, metrics[i].value, baseline, change * 100,
+                regressed ? "  REGRESSION" : "");
+        }
+    }
+
+    fclose(file);
+    return regressions;
+}
+
+static int writeBaseline(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return -1;
+
+    for (int i = 0; i < metricCount; i++)
+        fprintf(file, "%s %.0f\n", metrics[i].name, metrics[i].value);
+
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+static void usage()
+{
+    printf("usage: bench [-c cycles] [-r repeats] [-t threshold] [-b baseline] [-w baseline] [-a]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long long cycles = 20000000;
+    int repeats = 5;
+    double threshold = 0.10;
+    char *baselinePath = NULL;
+    char *writePath = NULL;
+    int translate = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:r:t:b:w:ah")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                cycles = strtoull(optarg, NULL, 10);
+                break;
+            case 'r':
+                repeats = atoi(optarg);
+                break;
+            case 't':
+                threshold = atof(optarg);
+                break;
+            case 'b':
+                baselinePath = optarg;
+                break;
+            case 'w':
+                writePath = optarg;
+                break;
+            case 'a':
+                translate = 1;
+                break;
+            default:
+                usage();
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    if (cycles < BENCH_IPF || repeats < 1)
+    {
+        usage();
+        return -1;
+    }
+
+    // loadGame() only reads files, so the corpus goes through a scratch directory
+    char directory[] = "/tmp/chip8-bench-XXXXXX";
+    if (mkdtemp(directory) == NULL)
+    {
+        printf("Could not create a scratch directory\n");
+        return -1;
+    }
+
+    static Chip8 loaded[CORPUS_SIZE];
+    char paths[CORPUS_SIZE][64];
+
+    for (int i = 0; i < CORPUS_SIZE; i++)
+    {
+        unsigned char rom[4096 - 512];
+        size_t size = corpus[i].build(rom);
+
+        snprintf(paths[i], sizeof(paths[i]), "%s/%s.ch8", directory, corpus[i].name);
+        if (!writeRom(paths[i], rom, size))
+        {
+            printf("Could not write %s\n", paths[i]);
+            return -1;
+        }
+    }
+
+    // startup: a fresh machine with a ROM loaded, from a file and from a mapped library
+    RomLibrary *library = romLibraryOpen(directory);
+    if (library == NULL || library->count != CORPUS_SIZE)
+    {
+        printf("Could not open %s as a ROM library\n", directory);
+        return -1;
+    }
+
+    for (int fromLibrary = 0; fromLibrary < 2; fromLibrary++)
+    {
+        double startup = 0;
+        for (int repeat = 0; repeat < repeats; repeat++)
+        {
+            const int rounds = 1000;
+            uint64_t start = schedulerNow();
+
+            for (int round = 0; round < rounds; round++)
+            {
+                Chip8 *chip8 = &loaded[round % CORPUS_SIZE];
+                *chip8 = initialize();
+                if (fromLibrary)
+                    romLoad(chip8, &library->entries[round % library->count]);
+                else
+                    loadGame(chip8, paths[round % CORPUS_SIZE]);
+            }
+
+            double nanoseconds = (double)(schedulerNow() - start) / rounds;
+            if (repeat == 0 || nanoseconds < startup)
+                startup = nanoseconds;
+        }
+        addMetric(fromLibrary ? "startup.library.ns" : "startup.ns", startup, 0);
+    }
+    romLibraryDestroy(library);
+
+    AotLibrary *libraries[CORPUS_SIZE] = { NULL };
+    Chip8Aot *modules[CORPUS_SIZE] = { NULL };
+    for (int i = 0; i < CORPUS_SIZE; i++)
+    {
+        loaded[i] = initialize();
+        if (loadGame(&loaded[i], paths[i]) != ROM_OK)
+        {
+            printf("Could not load %s\n", paths[i]);
+            return -1;
+        }
+
+        if (translate)
+        {
+            char module[80], command[256];
+            snprintf(module, sizeof(module), "%s.so", paths[i]);
+            snprintf(command, sizeof(command), "./aot '%s' '%s' > /dev/null", paths[i], module);
+            if (system(command) != 0 || (libraries[i] = aotLibraryLoad(module)) == NULL
+                || (modules[i] = aotCreate(libraries[i])) == NULL)
+            {
+                printf("Could not translate %s -- is ./aot built?\n", paths[i]);
+                return -1;
+            }
+            remove(module);
+        }
+        remove(paths[i]);
+    }
+    rmdir(directory);
+
+    for (int i = 0; i < CORPUS_SIZE; i++)
+    {
+        for (int engine = 0; engine < ENGINE_COUNT; engine++)
+        {
+            if (engine == ENGINE_AOT && modules[i] == NULL)
+                continue;
+
+            // the reference interpreter is an order of magnitude slower -- keep its share of the run down
+            unsigned long long engineCycles = engine == ENGINE_REFERENCE ? cycles / 4 : cycles;
+            double best = 0;
+            char name[64];
+
+            for (int repeat = 0; repeat < repeats; repeat++)
+            {
+                double rate = runEngine(engine, &loaded[i], engine == ENGINE_AOT ? modules[i] : NULL, engineCycles);
+                if (rate > best)
+                    best = rate;
+            }
+
+            snprintf(name, sizeof(name), "%s.%s.ips", corpus[i].name, engineNames[engine]);
+            addMetric(name, best, 1);
+        }
+    }
+
+#ifdef CHIP8_PROFILE
+    // ns per instruction class across the whole corpus on the threaded core
+    Chip8Profile *total = profileCreate();
+    for (int i = 0; i < CORPUS_SIZE; i++)
+    {
+        Chip8 *chip8 = &loaded[i];
+        chip8->profile = profileCreate();
+        for (unsigned long long frame = 0; frame < cycles / BENCH_IPF; frame++)
+            runFrame(chip8, BENCH_IPF);
+        profileMerge(total, chip8->profile);
+        profileDestroy(chip8->profile);
+        chip8->profile = NULL;
+    }
+
+    double nsPerTick = profileNanosecondsPerTick(total);
+    printf("\n%-24s %14s %10s\n", "class", "count", "ns/op");
+    for (int i = 1; i < OP_COUNT; i++)
+    {
+        if (total->count[i] != 0)
+        {
+            printf("%-24s %14llu %10.2f\n", profileNames[i], (unsigned long long)total->count[i],
+                profileNanosecondsPerOp(total, i, nsPerTick));
+        }
+    }
+    profileDestroy(total);
+#endif
+
+    if (writePath != NULL && writeBaseline(writePath) != 0)
+    {
+        printf("Could not write baseline to %s\n", writePath);
+        return -1;
+    }
+
+    if (baselinePath != NULL)
+    {
+        int regressions = compareBaseline(baselinePath, threshold);
+        if (regressions < 0)
+        {
+            printf("Could not read baseline %s\n", baselinePath);
+            return -1;
+        }
+        if (regressions > 0)
+        {
+            printf("%d regression(s) beyond %.0f%%\n", regressions, threshold * 100);
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,263 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* Headless video capture -- what the machine draws, written to a file or pipe
+
+    The emulation side only ever copies the display into a bounded
+    single-producer single-consumer queue (like the KeyQueue in handoff.h)
+    along with the number of the frame it was drawn in. It never waits: a
+    frame that finds the queue full is dropped and counted. A writer thread
+    drains the queue, scales each frame up by a whole number and writes it
+    as YUV4MPEG2 (.y4m -- 60 fps 4:2:0, what ffmpeg and most players read
+    from a pipe) or as raw RGBA, scale * 64 by scale * 32 pixels a frame.
+
+    Frames are only handed over when something was drawn, so the writer
+    repeats the last image over the frames in between and the stream keeps
+    real time. With dedup it doesn't: only images that differ from the last
+    one written go out, one per change, which is what a dataset wants.
+
+    A path starting with '|' is run as a command with the stream on its
+    standard input, e.g. "|ffmpeg -i - out.mp4".
+*/
+
+#define CAPTURE_QUEUE_FRAMES 512 // power of two
+#define CAPTURE_MAX_SCALE 16
+
+enum {
+    CAPTURE_Y4M = 0,
+    CAPTURE_RGBA
+};
+
+typedef struct CaptureFrame {
+    uint64_t frame; // 60Hz ticks since the capture started
+    uint64_t rows[32];
+} CaptureFrame;
+
+typedef struct CaptureStats {
+    unsigned long long captured;   // frames queued
+    unsigned long long dropped;    // frames lost to a full queue
+    unsigned long long written;    // images in the stream, repeats included
+    unsigned long long duplicates; // frames left out by dedup
+} CaptureStats;
+
+typedef struct Capture {
+    CaptureFrame *queue;
+    FILE *file;
+    int piped;
+    int format;
+    int scale;
+    int dedup;
+    pthread_t thread;
+    atomic_int closing;
+
+    // each side's fields on its own cache line, so queueing a frame costs
+    // the emulation no more than the copy
+    _Alignas(64) atomic_uint head; // next frame to write, producer only
+    unsigned long long captured;
+    unsigned long long dropped;
+
+    _Alignas(64) atomic_uint tail; // next frame to read, writer only
+    uint64_t last[32];             // last image written
+    uint64_t next;                 // frame number the next image in the stream stands for
+    unsigned char *line;
+    unsigned long long written;
+    unsigned long long duplicates;
+} Capture;
+
+// format from the file name -- .y4m is YUV4MPEG2, anything else raw RGBA
+int captureFormat(const char *path)
+{
+    size_t length = strlen(path);
+    return length >= 4 && strcmp(path + length - 4, ".y4m") == 0 ? CAPTURE_Y4M : CAPTURE_RGBA;
+}
+
+// one scaled image -- Y4M planes are limited range luma with neutral chroma
+static void captureWriteImage(Capture *capture, const uint64_t *rows)
+{
+    int width = 64 * capture->scale;
+    int pixelSize = capture->format == CAPTURE_Y4M ? 1 : 4;
+
+    if (capture->format == CAPTURE_Y4M)
+        fputs("FRAME\n", capture->file);
+
+    for (int y = 0; y < 32; y++)
+    {
+        unsigned char *out = capture->line;
+        for (int x = 0; x < 64; x++)
+        {
+            int on = (rows[y] >> (63 - x)) & 1;
+            for (int i = 0; i < capture->scale; i++)
+            {
+                if (capture->format == CAPTURE_Y4M)
+                {
+                    *out++ = on ? 235 : 16;
+                }
+                else
+                {
+                    memset(out, on ? 0xFF : 0x00, 3);
+                    out[3] = 0xFF;
+                    out += 4;
+                }
+            }
+        }
+
+        for (int i = 0; i < capture->scale; i++)
+            fwrite(capture->line, pixelSize, width, capture->file);
+    }
+
+    if (capture->format == CAPTURE_Y4M)
+    {
+        // both chroma planes, a quarter of the luma each
+        memset(capture->line, 128, width / 2);
+        for (int i = 0; i < 32 * capture->scale; i++)
+            fwrite(capture->line, 1, width / 2, capture->file);
+    }
+
+    capture->written++;
+}
+
+static void captureWrite(Capture *capture, const CaptureFrame *frame)
+{
+    if (capture->dedup)
+    {
+        if (memcmp(frame->rows, capture->last, sizeof(capture->last)) == 0)
+        {
+            capture->duplicates++;
+            return;
+        }
+    }
+    else
+    {
+        // nothing was drawn in between -- the screen still showed the last image
+        for (; capture->next < frame->frame; capture->next++)
+            captureWriteImage(capture, capture->last);
+    }
+
+    captureWriteImage(capture, frame->rows);
+    memcpy(capture->last, frame->rows, sizeof(capture->last));
+    capture->next = frame->frame + 1;
+}
+
+static void *captureThread(void *captureData)
+{
+    Capture *capture = captureData;
+    const struct timespec idle = { 0, 1000000 };
+
+    for (;;)
+    {
+        // closing first -- any frame queued before it is then visible in head
+        int closing = atomic_load(&capture->closing);
+        unsigned int tail = atomic_load_explicit(&capture->tail, memory_order_relaxed);
+        unsigned int head = atomic_load_explicit(&capture->head, memory_order_acquire);
+
+        if (tail == head)
+        {
+            if (closing)
+                break;
+            nanosleep(&idle, NULL);
+            continue;
+        }
+
+        for (; tail != head; tail++)
+        {
+            captureWrite(capture, &capture->queue[tail & (CAPTURE_QUEUE_FRAMES - 1)]);
+            atomic_store_explicit(&capture->tail, tail + 1, memory_order_release);
+        }
+    }
+
+    return NULL;
+}
+
+// returns NULL if the file or command can't be opened, or scale is out of range
+Capture *captureOpen(const char *path, int format, int scale, int dedup)
+{
+    if (scale < 1 || scale > CAPTURE_MAX_SCALE)
+        return NULL;
+
+    int piped = path[0] == '|';
+    FILE *file = piped ? popen(path + 1, "w") : fopen(path, "wb");
+    if (file == NULL)
+        return NULL;
+
+    Capture *capture = aligned_alloc(64, sizeof(Capture));
+    memset(capture, 0, sizeof(Capture));
+    capture->queue = malloc(sizeof(CaptureFrame) * CAPTURE_QUEUE_FRAMES);
+    capture->line = malloc(64 * scale * 4);
+    capture->file = file;
+    capture->piped = piped;
+    capture->format = format;
+    capture->scale = scale;
+    capture->dedup = dedup;
+    atomic_init(&capture->head, 0);
+    atomic_init(&capture->tail, 0);
+    atomic_init(&capture->closing, 0);
+
+    if (format == CAPTURE_Y4M)
+        fprintf(file, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C420jpeg\n", 64 * scale, 32 * scale);
+
+    if (pthread_create(&capture->thread, NULL, captureThread, capture) != 0)
+    {
+        piped ? pclose(file) : fclose(file);
+        free(capture->line);
+        free(capture->queue);
+        free(capture);
+        return NULL;
+    }
+
+    return capture;
+}
+
+// producer -- queues the display as drawn in `frame`, returns 0 if it was dropped
+int captureFrame(Capture *capture, const uint64_t *gfx, uint64_t frame)
+{
+    unsigned int head = atomic_load_explicit(&capture->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&capture->tail, memory_order_acquire) == CAPTURE_QUEUE_FRAMES)
+    {
+        capture->dropped++;
+        return 0;
+    }
+
+    CaptureFrame *slot = &capture->queue[head & (CAPTURE_QUEUE_FRAMES - 1)];
+    slot->frame = frame;
+    memcpy(slot->rows, gfx, sizeof(slot->rows));
+    atomic_store_explicit(&capture->head, head + 1, memory_order_release);
+    capture->captured++;
+    return 1;
+}
+
+// writes out whatever is still queued and closes the stream -- returns 0 on
+// success, -1 if writing failed. stats, when not NULL, gets the final counts.
+int captureClose(Capture *capture, CaptureStats *stats)
+{
+    int result = 0;
+
+    atomic_store(&capture->closing, 1);
+    pthread_join(capture->thread, NULL);
+
+    if (ferror(capture->file))
+        result = -1;
+    if ((capture->piped ? pclose(capture->file) : fclose(capture->file)) != 0)
+        result = -1;
+    if (stats != NULL)
+    {
+        stats->captured = capture->captured;
+        stats->dropped = capture->dropped;
+        stats->written = capture->written;
+        stats->duplicates = capture->duplicates;
+    }
+
+    free(capture->line);
+    free(capture->queue);
+    free(capture);
+    return result;
+}
+
+#endif
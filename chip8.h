@@ -1,12 +1,103 @@
 #ifndef CHIP8_H
 #define CHIP8_H
 #include <stdio.h>
-#include <time.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 int uCharArrayDifference(unsigned char *arr1, unsigned char *arr2, int size);
 
+// Quirks -- behaviours CHIP-8 interpreters disagree on, as bits in chip8->quirks.
+// With none set you get this emulator's own behaviour: VX shifted in place,
+// I left alone by FX55 / FX65, BNNN off V0 and sprites wrapping round.
+#define QUIRK_SHIFT_VY     0x1 // 8XY6 / 8XYE shift VY into VX (COSMAC VIP)
+#define QUIRK_LOAD_STORE_I 0x2 // FX55 / FX65 leave I just past the last register (COSMAC VIP)
+#define QUIRK_JUMP_VX      0x4 // BXNN jumps to XNN + VX (SUPER-CHIP)
+#define QUIRK_CLIP         0x8 // sprites are cut off at the screen edges (COSMAC VIP, SUPER-CHIP)
+#define QUIRK_COMBINATIONS 16
+
+typedef struct QuirkProfile {
+    const char *name;
+    unsigned char quirks;
+} QuirkProfile;
+
+static const QuirkProfile quirkProfiles[] = {
+    { "default", 0 },
+    { "cosmac", QUIRK_SHIFT_VY | QUIRK_LOAD_STORE_I | QUIRK_CLIP },
+    { "schip", QUIRK_JUMP_VX | QUIRK_CLIP },
+};
+
+// a profile name, or QUIRK_* bits as a number -- returns -1 if it is neither
+int quirksParse(const char *text)
+{
+    char *end;
+
+    for (size_t i = 0; i < sizeof(quirkProfiles) / sizeof(quirkProfiles[0]); i++)
+    {
+        if (strcmp(text, quirkProfiles[i].name) == 0)
+            return quirkProfiles[i].quirks;
+    }
+
+    long quirks = strtol(text, &end, 0);
+    if (*text == '\0' || *end != '\0' || quirks < 0 || quirks >= QUIRK_COMBINATIONS)
+        return -1;
+    return quirks;
+}
+
+// predecoded instruction -- handler is one of the OP_* values below (OP_DECODE
+// when the slot has not been decoded yet), NNN is (x << 8) | nn and N is nn & 0xF
+typedef struct Chip8Instr {
+    unsigned char handler;
+    unsigned char x;
+    unsigned char y;
+    unsigned char nn;
+} Chip8Instr;
+
+enum {
+    OP_DECODE = 0,
+    OP_CLS,      // 00E0
+    OP_RET,      // 00EE
+    OP_SYS,      // 0NNN
+    OP_JP,       // 1NNN
+    OP_CALL,     // 2NNN
+    OP_SE_IMM,   // 3XNN
+    OP_SNE_IMM,  // 4XNN
+    OP_SE_REG,   // 5XY0
+    OP_LD_IMM,   // 6XNN
+    OP_ADD_IMM,  // 7XNN
+    OP_LD_REG,   // 8XY0
+    OP_OR,       // 8XY1
+    OP_AND,      // 8XY2
+    OP_XOR,      // 8XY3
+    OP_ADD_REG,  // 8XY4
+    OP_SUB,      // 8XY5
+    OP_SHR,      // 8XY6
+    OP_SUBN,     // 8XY7
+    OP_SHL,      // 8XYE
+    OP_SNE_REG,  // 9XY0
+    OP_LD_I,     // ANNN
+    OP_JP_V0,    // BNNN
+    OP_RND,      // CXNN
+    OP_DRW,      // DXYN
+    OP_SKP,      // EX9E
+    OP_SKNP,     // EXA1
+    OP_LD_VX_DT, // FX07
+    OP_LD_KEY,   // FX0A
+    OP_LD_DT,    // FX15
+    OP_LD_ST,    // FX18
+    OP_ADD_I,    // FX1E
+    OP_LD_F,     // FX29
+    OP_LD_B,     // FX33
+    OP_STORE,    // FX55
+    OP_LOAD,     // FX65
+    OP_UNKNOWN,
+    OP_COUNT
+};
+
+#ifdef CHIP8_PROFILE
+#include "profile.h"
+#endif
+
 typedef struct Chip8 {
     unsigned short opcode;
     unsigned char memory[4096];
@@ -23,8 +114,8 @@ typedef struct Chip8 {
         0x200 - 0xFFF - Program ROM and work RAM
     */
 
-    // graphics pixels
-    unsigned char gfx[64 * 32];
+    // graphics pixels -- one word per row, bit 63 is the leftmost pixel (x = 0)
+    uint64_t gfx[32];
     unsigned short drawFlag;
 
     // timers that count at 60Hz
@@ -39,6 +130,32 @@ typedef struct Chip8 {
     unsigned char key[16];
     unsigned char savedKeyState[16];
     unsigned short inputBlockingFlag;
+
+    // instructions executed since initialize() -- input recordings are stamped with it
+    uint64_t cycles;
+    // CXNN random number generator, see seedRandom()
+    uint32_t rngState;
+    // QUIRK_* bits this machine runs with
+    unsigned char quirks;
+
+    // predecoded instruction cache indexed by pc -- not part of the machine state,
+    // entries are reset to OP_DECODE whenever the memory behind them is written
+    Chip8Instr decoded[4096];
+    // instructions runCycles() accounted for without running them, see IDLE_MAX_PERIOD
+    uint64_t idleCycles;
+
+#ifdef CHIP8_PROFILE
+    // counters for the profiled core, NULL when this machine isn't being profiled
+    Chip8Profile *profile;
+#endif
+#ifdef CHIP8_DEBUGGER
+    // breakpoints and watchpoints, NULL when no debugger is attached -- see debug.h
+    struct Chip8Debug *debug;
+#endif
+#ifdef CHIP8_TRACE
+    // execution trace being written, NULL when there is none -- see trace.h
+    struct Chip8Trace *trace;
+#endif
 } Chip8;
 
 unsigned char chip8_fontset[80] = 
@@ -61,6 +178,39 @@ unsigned char chip8_fontset[80] =
     0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
+// program space runs from 0x200 to the end of memory
+#define CHIP8_MAX_ROM (4096 - 512)
+
+// loadGame() results
+#define ROM_OK 0
+#define ROM_UNREADABLE -1 // missing, or failed while reading
+#define ROM_EMPTY -2
+#define ROM_TOO_LARGE -3  // more than CHIP8_MAX_ROM bytes
+
+#define CHIP8_DEFAULT_SEED 0x2545F491
+
+// xorshift32 state per machine, so runs are reproducible and threads share nothing
+void seedRandom(Chip8 *chip8, uint32_t seed)
+{
+    // zero is the one state xorshift never leaves
+    chip8->rngState = seed != 0 ? seed : CHIP8_DEFAULT_SEED;
+}
+
+uint32_t xorshift32(uint32_t state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// next random byte for CXNN
+unsigned char nextRandom(Chip8 *chip8)
+{
+    chip8->rngState = xorshift32(chip8->rngState);
+    return chip8->rngState >> 24;
+}
+
 Chip8 initialize()
 {
     Chip8 chip8;
@@ -71,9 +221,11 @@ Chip8 initialize()
     chip8.sp = 0;
     chip8.drawFlag = 0;
     chip8.inputBlockingFlag = 0;
+    chip8.delay_timer = 0;
+    chip8.sound_timer = 0;
 
     // clear display
-    for (int i = 0; i < 64*32; i++)
+    for (int i = 0; i < 32; i++)
     {
         chip8.gfx[i] = 0;
     }
@@ -108,32 +260,166 @@ Chip8 initialize()
         chip8.savedKeyState[i] = 0x00;
     }
 
-    // seed rand()
-    srand(time(NULL));
+    // nothing decoded yet
+    memset(chip8.decoded, 0, sizeof(chip8.decoded));
+    chip8.idleCycles = 0;
+#ifdef CHIP8_PROFILE
+    chip8.profile = NULL;
+#endif
+#ifdef CHIP8_DEBUGGER
+    chip8.debug = NULL;
+#endif
+#ifdef CHIP8_TRACE
+    chip8.trace = NULL;
+#endif
+
+    chip8.cycles = 0;
+    chip8.quirks = 0;
+
+    // same seed every time -- call seedRandom() for a different sequence
+    seedRandom(&chip8, CHIP8_DEFAULT_SEED);
 
     return chip8;
 }
 
-void loadGame(Chip8 *chip8, char *filePath)
+// reads a ROM straight into program space (0x200 onwards) -- returns ROM_OK, or
+// one of the ROM_* errors with program space left cleared
+int loadGame(Chip8 *chip8, const char *filePath)
 {
     FILE *file = fopen(filePath, "rb");
+    if (file == NULL)
+        return ROM_UNREADABLE;
+
+    unsigned char *program = chip8->memory + 512;
+    size_t size = fread(program, 1, CHIP8_MAX_ROM, file);
+    int result = ROM_OK;
+
+    if (ferror(file))
+        result = ROM_UNREADABLE;
+    else if (size == 0)
+        result = ROM_EMPTY;
+    else if (fgetc(file) != EOF)
+        result = ROM_TOO_LARGE;
+    fclose(file);
+
+    if (result != ROM_OK)
+        memset(program, 0, CHIP8_MAX_ROM);
+    memset(chip8->decoded, 0, sizeof(chip8->decoded));
+    return result;
+}
+
+// describes one of the ROM_* errors for messages
+const char *romErrorString(int result)
+{
+    switch (result)
+    {
+        case ROM_OK: return "ok";
+        case ROM_EMPTY: return "empty";
+        case ROM_TOO_LARGE: return "too large";
+        default: return "unreadable";
+    }
+}
+
+// copies an already loaded ROM image into program space (0x200 onwards)
+void loadGameFromMemory(Chip8 *chip8, const unsigned char *rom, size_t size)
+{
+    if (size > CHIP8_MAX_ROM)
+        size = CHIP8_MAX_ROM;
+
+    memcpy(chip8->memory + 512, rom, size);
+    memset(chip8->decoded, 0, sizeof(chip8->decoded));
+}
+
+// drops cached decodes of every instruction overlapping memory[addr, addr + length)
+void invalidateDecoded(Chip8 *chip8, unsigned short addr, int length)
+{
+    // an instruction starting one byte earlier also reads the first written byte
+    for (int i = -1; i < length; i++)
+        chip8->decoded[(addr + i) & 0xFFF].handler = OP_DECODE;
+}
+
+// decrements both timers -- called once per 60Hz frame, see runFrame()
+void updateTimers(Chip8 *chip8)
+{
+    if (chip8->delay_timer > 0)
+        chip8->delay_timer--;
+    if (chip8->sound_timer > 0)
+        chip8->sound_timer--;
+}
+
+// XORs an 8 pixel wide sprite from memory[I] onto a display at (x, y), one
+// row word per sprite line -- returns 1 if any lit pixel was turned off
+unsigned char drawSpriteRows(uint64_t *gfx, const unsigned char *memory, unsigned short I, unsigned char x, unsigned char y, int height)
+{
+    uint64_t collision = 0;
+
+    x &= 63;
+    for (int yline = 0; yline < height; yline++)
+    {
+        // line lands at bits 63..56 then rotates right by x, wrapping off the right edge
+        uint64_t line = (uint64_t)memory[(I + yline) & 0xFFF] << 56;
+        uint64_t bits = (line >> x) | (line << ((64 - x) & 63));
+        uint64_t *row = &gfx[(y + yline) & 31];
+
+        collision |= *row & bits;
+        *row ^= bits;
+    }
+
+    return collision != 0;
+}
+
+// drawSpriteRows() for QUIRK_CLIP -- the sprite's origin still wraps, but rows
+// and pixels running off the right or bottom edge are dropped
+unsigned char drawSpriteRowsClipped(uint64_t *gfx, const unsigned char *memory, unsigned short I, unsigned char x, unsigned char y, int height)
+{
+    uint64_t collision = 0;
+
+    x &= 63;
+    y &= 31;
+    if (height > 32 - y)
+        height = 32 - y;
+    for (int yline = 0; yline < height; yline++)
+    {
+        uint64_t bits = ((uint64_t)memory[(I + yline) & 0xFFF] << 56) >> x;
+        uint64_t *row = &gfx[y + yline];
+
+        collision |= *row & bits;
+        *row ^= bits;
+    }
+
+    return collision != 0;
+}
 
-    // should cut this down
-    const size_t bufferSize = 3584;
-    unsigned char buffer[bufferSize];
+unsigned char drawSprite(Chip8 *chip8, unsigned char x, unsigned char y, int height)
+{
+    if (chip8->quirks & QUIRK_CLIP)
+        return drawSpriteRowsClipped(chip8->gfx, chip8->memory, chip8->I, x, y, height);
+    return drawSpriteRows(chip8->gfx, chip8->memory, chip8->I, x, y, height);
+}
 
-    fread(buffer, sizeof(char), bufferSize, file);
+// returns pixel (x, y) of the display, 1 when lit
+int gfxPixel(const Chip8 *chip8, int x, int y)
+{
+    return (chip8->gfx[y] >> (63 - x)) & 1;
+}
 
-    for (int i = 0; i < bufferSize; i++)
+// expands the display into 64 * 32 32 bit pixels for a renderer -- pitch is
+// the distance between rows in pixels
+void gfxToPixels(const uint64_t *gfx, uint32_t *pixels, int pitch, uint32_t on, uint32_t off)
+{
+    for (int y = 0; y < 32; y++)
     {
-        chip8->memory[i + 512] = buffer[i];
+        uint64_t row = gfx[y];
+        for (int x = 0; x < 64; x++)
+            pixels[y * pitch + x] = (row >> (63 - x)) & 1 ? on : off;
     }
 }
 
 void emulateCycle(Chip8 *chip8)
 {
     // fetch opcode (grab first 2 bytes of memory and merge)
-    chip8->opcode = chip8->memory[chip8->pc] << 8 | chip8->memory[chip8->pc + 1];
+    chip8->opcode = chip8->memory[chip8->pc & 0xFFF] << 8 | chip8->memory[(chip8->pc + 1) & 0xFFF];
+    chip8->cycles++;
 
     // decode opcode (0xF000 AND gets first four bits of two-byte opcode)
     switch (chip8->opcode & 0xF000)
@@ -141,20 +427,19 @@ void emulateCycle(Chip8 *chip8)
         // not enough info in first 4 bits when opcode starts with 0 -- have to go deeper
         case 0x0000:
         {
-            switch (chip8->opcode & 0x000F)
+            switch (chip8->opcode)
             {
                 case 0x00E0: // 00E0 - clear display
-                    for (int i = 0; i < 64*32; i++)
+                    for (int i = 0; i < 32; i++)
                             chip8->gfx[i] = 0;
                     chip8->pc += 2;
                     break;
-                case 0x000E: // 00EE - return from subroutine
-                    chip8->sp--;
+                case 0x00EE: // 00EE - return from subroutine
+                    chip8->sp = (chip8->sp - 1) & 0xF;
                     chip8->pc = chip8->stack[chip8->sp] + 2;
                     break;
-                default: // 0NNN - call machine code routine
-                    // todo
-                    printf("Unimplemented 0NNN\n");
+                default: // 0NNN - call machine code routine -- ignored like most interpreters do
+                    chip8->pc += 2;
             }
             break;
         }
@@ -166,12 +451,12 @@ void emulateCycle(Chip8 *chip8)
         case 0x2000: // 2NNN calls subroutine at NNN
         {
             chip8->stack[chip8->sp] = chip8->pc;
-            chip8->sp++;
+            chip8->sp = (chip8->sp + 1) & 0xF;
             chip8->pc = chip8->opcode & 0x0FFF;
             break;
         }
         case 0x3000: // 3XNN skip next instruction if VX == NN
-            if (chip8->V[chip8->opcode & 0x0F00 >> 8] == (chip8->opcode & 0x0FF))
+            if (chip8->V[(chip8->opcode & 0x0F00) >> 8] == (chip8->opcode & 0x0FF))
                 chip8->pc += 4;
             else
                 chip8->pc += 2;
@@ -197,62 +482,63 @@ void emulateCycle(Chip8 *chip8)
             chip8->pc += 2;
             break;
         // not enough info in first 4 bits when opcode starts with 8 -- have to go deeper
+        // (VF is always written last so the flag wins when X is F)
         case 0x8000:
         {
+            unsigned char vx = chip8->V[(chip8->opcode & 0x0F00) >> 8];
+            unsigned char vy = chip8->V[(chip8->opcode & 0x00F0) >> 4];
+
             switch (chip8->opcode & 0x000F)
             {
                 case 0x0000: // 8XY0 VX = VY
-                    chip8->V[(chip8->opcode & 0x0F00) >> 8] = chip8->V[(chip8->opcode & 0x00F0) >> 4];
+                    chip8->V[(chip8->opcode & 0x0F00) >> 8] = vy;
                     chip8->pc += 2;
                     break;
                 case 0x0001: // 8XY1 VX |= VY
-                    chip8->V[(chip8->opcode & 0x0F00) >> 8] |= chip8->V[(chip8->opcode & 0x00F0) >> 4];
+                    chip8->V[(chip8->opcode & 0x0F00) >> 8] = vx | vy;
                     chip8->pc += 2;
                     break;
                 case 0x0002: // 8XY2 VX &= VY
-                    chip8->V[(chip8->opcode & 0x0F00) >> 8] &= chip8->V[(chip8->opcode & 0x00F0) >> 4];
+                    chip8->V[(chip8->opcode & 0x0F00) >> 8] = vx & vy;
                     chip8->pc += 2;
                     break;
                 case 0x0003: // 8XY3 VX ^= VY
-                    chip8->V[(chip8->opcode & 0x0F00) >> 8] ^= chip8->V[(chip8->opcode & 0x00F0) >> 4];
+                    chip8->V[(chip8->opcode & 0x0F00) >> 8] = vx ^ vy;
                     chip8->pc += 2;
                     break;
-                case 0x0004: // 8XY4 Adds VX to VY, VF set to 1 when there is a carry, 0 when not
-                    if (chip8->V[(chip8->opcode & 0x00F0) >> 4] > (0xFF - chip8->V[(chip8->opcode & 0x0F00) >> 8]))
-                        chip8->V[0xF] = 1;
-                    else
-                        chip8->V[0xF] = 0;
-                    chip8->V[(chip8->opcode & 0x0F00) >> 8] += chip8->V[(chip8->opcode & 0x00F0) >> 4];
+                case 0x0004: // 8XY4 Adds VY to VX, VF set to 1 when there is a carry, 0 when not
+                    chip8->V[(chip8->opcode & 0x0F00) >> 8] = vx + vy;
+                    chip8->V[0xF] = vx + vy > 0xFF;
                     chip8->pc += 2;
                     break;
                 case 0x0005: // 8XY5 Subtracts VY from VX, VF is set to 0 when there is a borrow, 1 when not
-                    if (chip8->V[(chip8->opcode & 0x00F0) >> 4] > chip8->V[(chip8->opcode & 0x0F00) >> 8])
-                        chip8->V[0xF] = 0;
-                    else
-                        chip8->V[0xF] = 1;
-                    chip8->V[(chip8->opcode & 0x0F00) >> 8] -= chip8->V[(chip8->opcode & 0x00F0) >> 4];
+                    chip8->V[(chip8->opcode & 0x0F00) >> 8] = vx - vy;
+                    chip8->V[0xF] = vx >= vy;
                     chip8->pc += 2;
                     break;
                 case 0x006: // 8XY6 Stores least significant bit of VX in VF, then shifts VX right by one.
-                    chip8->V[0xF] = (chip8->V[(chip8->opcode & 0x0F00) >> 8] & -chip8->V[(chip8->opcode & 0x0F00) >> 8]);
-                    chip8->V[(chip8->opcode & 0x0F00) >> 8] >>= 1;
+                    // (QUIRK_SHIFT_VY: shifts VY into VX instead)
+                    if (chip8->quirks & QUIRK_SHIFT_VY)
+                        vx = vy;
+                    chip8->V[(chip8->opcode & 0x0F00) >> 8] = vx >> 1;
+                    chip8->V[0xF] = vx & 0x1;
                     chip8->pc += 2;
                     break;
                 case 0x007: // 8XY7 Sets VX to VY - VX. VF is set to 0 when borrow, 1 when not
-                    if (chip8->V[(chip8->opcode & 0x00F0) >> 4] < chip8->V[(chip8->opcode & 0x0F00) >> 8])
-                        chip8->V[0xF] = 0;
-                    else
-                        chip8->V[0xF] = 1;
-                    chip8->V[(chip8->opcode & 0x0F00) >> 8] = chip8->V[(chip8->opcode & 0x00F0) >> 4] - chip8->V[(chip8->opcode & 0x0F00) >> 8];
+                    chip8->V[(chip8->opcode & 0x0F00) >> 8] = vy - vx;
+                    chip8->V[0xF] = vy >= vx;
                     chip8->pc += 2;
                     break;
-                case 0x00E: // 8XYE Stores least significant bit of VX in VF, then shifts VX left by one.
-                    chip8->V[0xF] = (chip8->V[(chip8->opcode & 0x0F00) >> 8] << (chip8->V[(chip8->opcode & 0x0F00) >> 8] - 1));
-                    chip8->V[(chip8->opcode & 0x0F00) >> 8] <<= 1;
+                case 0x00E: // 8XYE Stores most significant bit of VX in VF, then shifts VX left by one.
+                    if (chip8->quirks & QUIRK_SHIFT_VY)
+                        vx = vy;
+                    chip8->V[(chip8->opcode & 0x0F00) >> 8] = vx << 1;
+                    chip8->V[0xF] = vx >> 7;
                     chip8->pc += 2;
                     break;
                 default:
                     printf("Unknown opcode: [0x8000]: 0x%X\n", chip8->opcode);
+                    chip8->pc += 2;
             }
             break;
         }
@@ -262,6 +548,7 @@ void emulateCycle(Chip8 *chip8)
                 chip8->pc += 4;
             else
                 chip8->pc += 2;
+            break;
         }
         case 0xA000: // ANNN sets I to NNN
         {
@@ -269,38 +556,49 @@ void emulateCycle(Chip8 *chip8)
             chip8->pc += 2;
             break;
         }
-        case 0xB000: // BNNN Jumps to NNN + V0
+        case 0xB000: // BNNN Jumps to NNN + V0 (QUIRK_JUMP_VX: BXNN jumps to XNN + VX)
         {
-            chip8->pc = chip8->V[0] + (chip8->opcode & 0x0FFF);
+            if (chip8->quirks & QUIRK_JUMP_VX)
+                chip8->pc = chip8->V[(chip8->opcode & 0x0F00) >> 8] + (chip8->opcode & 0x0FFF);
+            else
+                chip8->pc = chip8->V[0] + (chip8->opcode & 0x0FFF);
+            break;
         }
         case 0xC000: // CXNN Sets VX to NN & rand[0-255]
         {
-
-            chip8->V[(chip8->opcode & 0x0F00) >> 8] = (chip8->opcode & 0x00FF) & (rand() % 255);
+            chip8->V[(chip8->opcode & 0x0F00) >> 8] = (chip8->opcode & 0x00FF) & nextRandom(chip8);
             chip8->pc += 2;
+            break;
         }
         case 0xD000: // DXYN draws sprite at coords (VX, VY) with width of 8 pixels, height of N pixels,
-        // loading sprite from memory location I
+        // loading sprite from memory location I -- pixels past the edge wrap around (QUIRK_CLIP: are dropped)
         {
             unsigned short x = chip8->V[(chip8->opcode & 0x0F00) >> 8];
             unsigned short y = chip8->V[(chip8->opcode & 0x00F0) >> 4];
             unsigned short height = chip8->opcode & 0x000F;
+
             unsigned short pixel;
 
-            // register will hold collision flag
+            // register will hold collision flag -- done pixel by pixel here, see
+            // drawSprite() for the word-wide version used by the fast path
             chip8->V[0xF] = 0;
             for (int yline = 0; yline < height; yline++)
             {
-                pixel = chip8->memory[chip8->I + yline];
+                pixel = chip8->memory[(chip8->I + yline) & 0xFFF];
                 for (int xline = 0; xline < 8; xline++)
                 {
+                    if ((chip8->quirks & QUIRK_CLIP) && ((x & 63) + xline > 63 || (y & 31) + yline > 31))
+                        continue;
                     if ((pixel & (0x80 >> xline)) != 0)
                     {
+                        uint64_t bit = 1ULL << (63 - ((x + xline) & 63));
+                        uint64_t *row = &chip8->gfx[(y + yline) & 31];
+
                         // check if current display pixel is already set - flag collision
-                        if (chip8->gfx[(x + xline + ((y + yline) * 64))] == 1)
+                        if (*row & bit)
                             chip8->V[0xF] = 1;
                         // flip pixel
-                        chip8->gfx[(x + xline + ((y + yline) * 64))] ^= 1;
+                        *row ^= bit;
                     }
                 }
             }
@@ -316,17 +614,20 @@ void emulateCycle(Chip8 *chip8)
             switch (chip8->opcode & 0x00FF)
             {
                 case 0x009E: // EX9E skips next instruction if key stored in VX is pressed
-                    if (chip8->key[chip8->V[(chip8->opcode & 0x0F00) >> 8]] != 0)
+                    if (chip8->key[chip8->V[(chip8->opcode & 0x0F00) >> 8] & 0xF] != 0)
                         chip8->pc += 4;
                     else
                         chip8->pc += 2;
                     break;
                 case 0x00A1: // EXA1 skips next instruction if key stored in VX is not pressed
-                    if (chip8->key[chip8->V[(chip8->opcode & 0x0F00) >> 8]] == 0)
+                    if (chip8->key[chip8->V[(chip8->opcode & 0x0F00) >> 8] & 0xF] == 0)
                         chip8->pc += 4;
                     else
                         chip8->pc += 2;
                     break;
+                default:
+                    printf("Unknown opcode: [0xE000]: 0x%X\n", chip8->opcode);
+                    chip8->pc += 2;
             }
             break;
         }
@@ -372,44 +673,37 @@ void emulateCycle(Chip8 *chip8)
                     chip8->pc += 2;
                     break;
                 case 0x0033: // FX33 Store binary-coded representation of VX, with most significant of digits in I, middle I+1 and last I+2
-                    chip8->memory[chip8->I] = (int)chip8->V[(chip8->opcode & 0x0F00) >> 8] % 10;
-                    (chip8->memory[chip8->I + 1] = (int)chip8->V[(chip8->opcode & 0x0F00) >> 8] / 10) % 10;
-                    (chip8->memory[chip8->I + 2] = (int)chip8->V[(chip8->opcode & 0x0F00) >> 8] / 100) % 10;
+                    chip8->memory[chip8->I & 0xFFF] = chip8->V[(chip8->opcode & 0x0F00) >> 8] / 100;
+                    chip8->memory[(chip8->I + 1) & 0xFFF] = chip8->V[(chip8->opcode & 0x0F00) >> 8] / 10 % 10;
+                    chip8->memory[(chip8->I + 2) & 0xFFF] = chip8->V[(chip8->opcode & 0x0F00) >> 8] % 10;
+                    invalidateDecoded(chip8, chip8->I, 3);
                     chip8->pc += 2;
                     break;
                 case 0x0055: // FX55 Stores V0 to VX (inclusive) in memory starting at address I in increments of 1. However I does not move.
-                    for (int i = 0; i < ((chip8->opcode & 0x0F00) >> 8); i++)
+                    for (int i = 0; i <= ((chip8->opcode & 0x0F00) >> 8); i++)
                     {
-                        chip8->memory[chip8->I + i] = chip8->V[i];
+                        chip8->memory[(chip8->I + i) & 0xFFF] = chip8->V[i];
                     }
+                    invalidateDecoded(chip8, chip8->I, ((chip8->opcode & 0x0F00) >> 8) + 1);
+                    if (chip8->quirks & QUIRK_LOAD_STORE_I)
+                        chip8->I += ((chip8->opcode & 0x0F00) >> 8) + 1;
                     chip8->pc += 2;
                     break;
                 case 0x0065: // FX65 Fills V0 to VX (inclusive) from memory starting at address I in increments of 1. However I does not move.
-                    for (int i = 0; i < ((chip8->opcode & 0x0F00) >> 8); i++)
+                    for (int i = 0; i <= ((chip8->opcode & 0x0F00) >> 8); i++)
                     {
-                        chip8->V[i] = chip8->memory[chip8->I + i];
+                        chip8->V[i] = chip8->memory[(chip8->I + i) & 0xFFF];
                     }
+                    if (chip8->quirks & QUIRK_LOAD_STORE_I)
+                        chip8->I += ((chip8->opcode & 0x0F00) >> 8) + 1;
                     chip8->pc += 2;
                     break;
+                default:
+                    printf("Unknown opcode: [0xF000]: 0x%X\n", chip8->opcode);
+                    chip8->pc += 2;
             }
             break;
         }
-        default:
-        {
-            printf("Unknown opcode: [0x0000]: 0x%X\n", chip8->opcode);
-        }
-    }
-
-    // update timers
-    if (chip8->delay_timer > 0)
-        chip8->delay_timer--;
-    if (chip8->sound_timer > 0)
-    {
-        if (chip8->sound_timer == 1)
-        {
-            printf("BEEP\n");
-        }
-        chip8->sound_timer--;
     }
 }
 
@@ -426,4 +720,209 @@ int uCharArrayDifference(unsigned char *arr1, unsigned char *arr2, int size)
 }
 
 
+// splits an opcode into a predecoded instruction -- mirrors the switch in emulateCycle()
+Chip8Instr decodeOpcode(unsigned short opcode)
+{
+    Chip8Instr instr;
+    unsigned char handler = OP_UNKNOWN;
+
+    instr.x = (opcode & 0x0F00) >> 8;
+    instr.y = (opcode & 0x00F0) >> 4;
+    instr.nn = opcode & 0x00FF;
+
+    switch (opcode & 0xF000)
+    {
+        case 0x0000:
+            handler = opcode == 0x00E0 ? OP_CLS : opcode == 0x00EE ? OP_RET : OP_SYS;
+            break;
+        case 0x1000: handler = OP_JP; break;
+        case 0x2000: handler = OP_CALL; break;
+        case 0x3000: handler = OP_SE_IMM; break;
+        case 0x4000: handler = OP_SNE_IMM; break;
+        case 0x5000: handler = OP_SE_REG; break;
+        case 0x6000: handler = OP_LD_IMM; break;
+        case 0x7000: handler = OP_ADD_IMM; break;
+        case 0x8000:
+            switch (opcode & 0x000F)
+            {
+                case 0x0: handler = OP_LD_REG; break;
+                case 0x1: handler = OP_OR; break;
+                case 0x2: handler = OP_AND; break;
+                case 0x3: handler = OP_XOR; break;
+                case 0x4: handler = OP_ADD_REG; break;
+                case 0x5: handler = OP_SUB; break;
+                case 0x6: handler = OP_SHR; break;
+                case 0x7: handler = OP_SUBN; break;
+                case 0xE: handler = OP_SHL; break;
+            }
+            break;
+        case 0x9000: handler = OP_SNE_REG; break;
+        case 0xA000: handler = OP_LD_I; break;
+        case 0xB000: handler = OP_JP_V0; break;
+        case 0xC000: handler = OP_RND; break;
+        case 0xD000: handler = OP_DRW; break;
+        case 0xE000:
+            if (instr.nn == 0x9E)
+                handler = OP_SKP;
+            else if (instr.nn == 0xA1)
+                handler = OP_SKNP;
+            break;
+        case 0xF000:
+            switch (instr.nn)
+            {
+                case 0x07: handler = OP_LD_VX_DT; break;
+                case 0x0A: handler = OP_LD_KEY; break;
+                case 0x15: handler = OP_LD_DT; break;
+                case 0x18: handler = OP_LD_ST; break;
+                case 0x1E: handler = OP_ADD_I; break;
+                case 0x29: handler = OP_LD_F; break;
+                case 0x33: handler = OP_LD_B; break;
+                case 0x55: handler = OP_STORE; break;
+                case 0x65: handler = OP_LOAD; break;
+            }
+            break;
+    }
+
+    instr.handler = handler;
+    return instr;
+}
+
+// 1 while FX0A is waiting on a key change that hasn't happened -- keys only
+// change between runCycles() calls, so the rest of the call is spent waiting
+int waitingForKey(const Chip8 *chip8)
+{
+    return chip8->inputBlockingFlag != 0 && memcmp(chip8->savedKeyState, chip8->key, sizeof(chip8->key)) == 0;
+}
+
+// Idle loops: within one runCycles() call nothing outside the machine moves --
+// keys change and timers tick between calls -- so a loop that comes back
+// round to the exact state it left will keep doing so until the call ends.
+// The core checks this on backward jumps closing loops of up to
+// IDLE_MAX_PERIOD instructions (delay timer polls, key polls, jumps to
+// self) and skips every remaining whole lap, adding it to cycles as if it
+// had run. Loops that draw, write memory or draw random numbers never
+// repeat a state exactly, so they are never skipped.
+#define IDLE_MAX_PERIOD 8
+
+// what a loop without side effects can still change -- no padding, so memcmp() is exact
+typedef struct IdleState {
+    unsigned short stack[16];
+    unsigned short I;
+    unsigned short sp;
+    unsigned char V[16];
+    unsigned char delay_timer;
+    unsigned char sound_timer;
+    unsigned short inputBlockingFlag;
+} IdleState;
+
+static inline void idleSave(const Chip8 *chip8, IdleState *state)
+{
+    memcpy(state->stack, chip8->stack, sizeof(state->stack));
+    state->I = chip8->I;
+    state->sp = chip8->sp;
+    memcpy(state->V, chip8->V, sizeof(state->V));
+    state->delay_timer = chip8->delay_timer;
+    state->sound_timer = chip8->sound_timer;
+    state->inputBlockingFlag = chip8->inputBlockingFlag;
+}
+
+static inline int idleMatches(const Chip8 *chip8, const IdleState *state)
+{
+    IdleState now;
+    idleSave(chip8, &now);
+    return memcmp(&now, state, sizeof(now)) == 0;
+}
+
+// Fast path for the hot loop: runs up to `cycles` instructions out of the
+// predecoded cache and returns how many were executed. Same semantics as
+// calling emulateCycle() that many times; timers are left to runFrame().
+// With GCC/Clang every handler jumps straight to the next one through a
+// computed goto (threaded dispatch); other compilers get a plain switch
+// over the handler.
+#if defined(__GNUC__)
+#define CHIP8_THREADED_DISPATCH
+#endif
+
+// One core per combination of quirks, each with its quirks compiled in, so
+// none of them tests a quirk per instruction -- runCycles() picks the one
+// matching chip8->quirks on every call.
+#define CORE_CAT(a, b) CORE_CAT2(a, b)
+#define CORE_CAT2(a, b) a##b
+
+#define CORE_PREFIX runCyclesQuirks
+#define CORE_PROFILE 0
+#define CORE_DEBUG 0
+#define CORE_TRACE 0
+#include "cores.inc"
+
+#ifdef CHIP8_PROFILE
+#define CORE_PREFIX runCyclesProfiled
+#define CORE_PROFILE 1
+#define CORE_DEBUG 0
+#define CORE_TRACE 0
+#include "cores.inc"
+#endif
+
+#ifdef CHIP8_DEBUGGER
+#include "debug.h"
+#define CORE_PREFIX runCyclesDebug
+#define CORE_PROFILE 0
+#define CORE_DEBUG 1
+#define CORE_TRACE 0
+#include "cores.inc"
+#endif
+
+#ifdef CHIP8_TRACE
+#include "trace.h"
+#define CORE_PREFIX runCyclesTraced
+#define CORE_PROFILE 0
+#define CORE_DEBUG 0
+#define CORE_TRACE 1
+#include "cores.inc"
+#endif
+
+unsigned long runCycles(Chip8 *chip8, unsigned long cycles)
+{
+#ifdef CHIP8_DEBUGGER
+    // likewise the instrumented cores, only while the debugger has something armed
+    if (chip8->debug != NULL && chip8->debug->armed)
+        return runCyclesDebugTable[chip8->quirks & (QUIRK_COMBINATIONS - 1)](chip8, cycles);
+#endif
+#ifdef CHIP8_TRACE
+    // and the traced ones while a trace is attached, which hear about the call on either side
+    if (chip8->trace != NULL)
+    {
+        traceBegin(chip8->trace, chip8);
+        unsigned long done = runCyclesTracedTable[chip8->quirks & (QUIRK_COMBINATIONS - 1)](chip8, cycles);
+        traceEnd(chip8->trace, chip8);
+        return done;
+    }
+#endif
+#ifdef CHIP8_PROFILE
+    // the profiled cores only run for machines with a profile attached, so an
+    // idle profiler costs one well-predicted branch per call
+    if (chip8->profile != NULL)
+        return runCyclesProfiledTable[chip8->quirks & (QUIRK_COMBINATIONS - 1)](chip8, cycles);
+#endif
+    return runCyclesQuirksTable[chip8->quirks & (QUIRK_COMBINATIONS - 1)](chip8, cycles);
+}
+
+// one 60Hz frame: `instructionsPerFrame` instructions, then a timer tick
+void runFrame(Chip8 *chip8, int instructionsPerFrame)
+{
+    runCycles(chip8, instructionsPerFrame);
+    updateTimers(chip8);
+#ifdef CHIP8_PROFILE
+    if (chip8->profile != NULL)
+        chip8->profile->frames++;
+#endif
+}
+
+// `frames` frames back to back, as run-ahead does on every host frame
+void runFrames(Chip8 *chip8, int frames, int instructionsPerFrame)
+{
+    for (int i = 0; i < frames; i++)
+        runFrame(chip8, instructionsPerFrame);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,129 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+#include <stddef.h>
+
+/* Synthetic ROM corpus
+
+    Small endless programs that each lean on one part of the interpreter,
+    generated in code so the benchmarks need no ROM files. Every program
+    loops forever and stays well inside the 16 entry stack, so any number
+    of cycles can be run on it.
+*/
+
+typedef struct CorpusRom {
+    const char *name;
+    size_t (*build)(unsigned char *rom); // writes the program, returns its size
+} CorpusRom;
+
+// writes opcodes big-endian, returns the size in bytes
+static size_t corpusProgram(unsigned char *rom, const unsigned short *program, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        rom[i * 2] = program[i] >> 8;
+        rom[i * 2 + 1] = program[i] & 0xFF;
+    }
+    return count * 2;
+}
+
+// register arithmetic, flags and a conditional skip
+static size_t corpusAlu(unsigned char *rom)
+{
+    static const unsigned short program[] = {
+        0x6005, // 200: V0 = 5
+        0x7101, // 202: V1 += 1
+        0x8014, // 204: V0 += V1, VF = carry
+        0x8125, // 206: V1 -= V2, VF = !borrow
+        0x8236, // 208: V2 >>= 1
+        0x8303, // 20A: V3 ^= V0
+        0x8431, // 20C: V4 |= V3
+        0x8542, // 20E: V5 &= V4
+        0x8637, // 210: V6 = V3 - V6
+        0x870E, // 212: V7 <<= 1
+        0x4300, // 214: skip if V3 != 0
+        0x6301, // 216: V3 = 1
+        0x1202  // 218: loop
+    };
+
+    return corpusProgram(rom, program, sizeof(program) / sizeof(program[0]));
+}
+
+// font sprites drawn across the screen, clearing it every lap
+static size_t corpusSprite(unsigned char *rom)
+{
+    static const unsigned short program[] = {
+        0x00E0, // 200: clear
+        0x6000, // 202: V0 = 0 (x)
+        0x6100, // 204: V1 = 0 (y)
+        0xF029, // 206: I = font sprite V0 (blank past digit F)
+        0xD015, // 208: draw 8x5 at (V0, V1)
+        0x7008, // 20A: x += 8
+        0x7103, // 20C: y += 3
+        0x3040, // 20E: skip once x == 64
+        0x1206, // 210: next sprite
+        0x1200  // 212: next lap
+    };
+
+    return corpusProgram(rom, program, sizeof(program) / sizeof(program[0]));
+}
+
+// BCD conversion and register block stores/loads, which also invalidate cached decodes
+static size_t corpusBcd(unsigned char *rom)
+{
+    static const unsigned short program[] = {
+        0xA300, // 200: I = 0x300
+        0x7A07, // 202: VA += 7
+        0xFA33, // 204: BCD of VA at I
+        0xF265, // 206: V0 - V2 = digits
+        0xF455, // 208: store V0 - V4 back at I
+        0xFA1E, // 20A: I += VA
+        0xA300, // 20C: I = 0x300
+        0x1202  // 20E: loop
+    };
+
+    return corpusProgram(rom, program, sizeof(program) / sizeof(program[0]));
+}
+
+// recursion 15 calls deep, then all the way back out
+static size_t corpusCalls(unsigned char *rom)
+{
+    static const unsigned short program[] = {
+        0x6000, // 200: V0 = 0 (depth)
+        0x2206, // 202: call 206
+        0x1200, // 204: loop
+        0x7001, // 206: depth += 1
+        0x300F, // 208: skip once depth == 15
+        0x2206, // 20A: recurse
+        0x00EE  // 20C: return
+    };
+
+    return corpusProgram(rom, program, sizeof(program) / sizeof(program[0]));
+}
+
+// a game's frame loop: set the delay timer, then poll it until it runs out
+static size_t corpusWait(unsigned char *rom)
+{
+    static const unsigned short program[] = {
+        0x6003, // 200: V0 = 3
+        0xF015, // 202: delay timer = V0
+        0xF107, // 204: V1 = delay timer
+        0x3100, // 206: skip once it has run out
+        0x1204, // 208: poll
+        0x7201, // 20A: V2 += 1 (waits done)
+        0x1202  // 20C: next wait
+    };
+
+    return corpusProgram(rom, program, sizeof(program) / sizeof(program[0]));
+}
+
+static const CorpusRom corpus[] = {
+    { "alu", corpusAlu },
+    { "sprite", corpusSprite },
+    { "bcd", corpusBcd },
+    { "calls", corpusCalls },
+    { "wait", corpusWait },
+};
+
+#define CORPUS_SIZE (int)(sizeof(corpus) / sizeof(corpus[0]))
+
+#endif
@@ -0,0 +1,258 @@
+#ifndef COW_H
+#define COW_H
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include "chip8.h"
+#include "savestate.h"
+#include "replay.h"
+
+/* Copy-on-write machine states, for exploring many branches of one game
+
+    A CowState keeps memory and the display as COW_PAGES refcounted pages of
+    COW_PAGE_SIZE bytes and only the rest of the state (registers, timers,
+    stack, keys -- COW_REGISTERS_SIZE bytes) by value. Forking a state shares
+    every page, so a branch costs a pointer per page until it writes.
+
+    States are never run directly. A CowMachine is a plain Chip8 that
+    remembers which pages it was loaded from: cowLoad() copies in only the
+    pages that differ from what it already holds (and drops the decode cache
+    only for the memory pages it replaced), and cowStore() compares each
+    page against the state's and gives the state fresh pages for just the
+    ones that changed. So stepping a fork of the state the machine was last
+    loaded from copies little more than the registers and whatever the
+    frame wrote -- usually a page or two of the display.
+
+    Pages are immutable once created and their refcounts atomic, so states
+    sharing pages can be stepped and discarded on different threads. A
+    CowMachine belongs to one thread.
+
+    cowStore() also hashes the state for deduplication, from per-page hashes
+    taken when each page was created. The hash leaves out what can't affect
+    the future of a state that has its keys set before every step: the keys
+    themselves, drawFlag, the last opcode and the cycle count.
+*/
+
+#define COW_PAGE_SIZE 64
+#define COW_MEMORY_PAGES (4096 / COW_PAGE_SIZE)
+#define COW_PAGES (COW_MEMORY_PAGES + 32 * 8 / COW_PAGE_SIZE)
+
+// state outside memory and gfx, kept as three byte ranges of Chip8
+#define COW_REGISTERS_START offsetof(Chip8, V)
+#define COW_REGISTERS_END (offsetof(Chip8, gfx) + sizeof(((Chip8 *)0)->gfx))
+#define COW_REGISTERS_SIZE (offsetof(Chip8, memory) + (offsetof(Chip8, gfx) - COW_REGISTERS_START) \
+    + (CHIP8_STATE_SIZE - COW_REGISTERS_END))
+
+typedef struct CowPage {
+    atomic_int refs;
+    uint64_t hash;
+    unsigned char bytes[COW_PAGE_SIZE];
+} CowPage;
+
+typedef struct CowState {
+    CowPage *pages[COW_PAGES]; // memory, then the display
+    uint64_t hash;             // as of the last cowStore()
+    unsigned char registers[COW_REGISTERS_SIZE];
+} CowState;
+
+typedef struct CowMachine {
+    Chip8 chip8;
+    CowPage *pages[COW_PAGES]; // what chip8 holds, NULL before the first cowLoad()
+} CowMachine;
+
+// for reporting memory use
+static atomic_long cowLivePages;
+static atomic_long cowLiveStates;
+
+static unsigned char *cowPageBytes(Chip8 *chip8, int page)
+{
+    if (page < COW_MEMORY_PAGES)
+        return chip8->memory + page * COW_PAGE_SIZE;
+    return (unsigned char *)chip8->gfx + (page - COW_MEMORY_PAGES) * COW_PAGE_SIZE;
+}
+
+static CowPage *cowPageCreate(const unsigned char *bytes)
+{
+    CowPage *page = malloc(sizeof(CowPage));
+    atomic_init(&page->refs, 1);
+    memcpy(page->bytes, bytes, COW_PAGE_SIZE);
+    page->hash = fnvBytes(0xCBF29CE484222325ULL, bytes, COW_PAGE_SIZE);
+    atomic_fetch_add_explicit(&cowLivePages, 1, memory_order_relaxed);
+    return page;
+}
+
+static CowPage *cowPageRetain(CowPage *page)
+{
+    if (page != NULL)
+        atomic_fetch_add_explicit(&page->refs, 1, memory_order_relaxed);
+    return page;
+}
+
+static void cowPageRelease(CowPage *page)
+{
+    if (page != NULL && atomic_fetch_sub_explicit(&page->refs, 1, memory_order_acq_rel) == 1)
+    {
+        free(page);
+        atomic_fetch_sub_explicit(&cowLivePages, 1, memory_order_relaxed);
+    }
+}
+
+// copies the non-page part of the state between a machine and a byte buffer
+static void cowCopyRegisters(Chip8 *chip8, unsigned char *registers, int toMachine)
+{
+    const size_t ranges[3][2] = {
+        { 0, offsetof(Chip8, memory) },
+        { COW_REGISTERS_START, offsetof(Chip8, gfx) },
+        { COW_REGISTERS_END, CHIP8_STATE_SIZE }
+    };
+
+    for (int i = 0; i < 3; i++)
+    {
+        unsigned char *field = (unsigned char *)chip8 + ranges[i][0];
+        size_t length = ranges[i][1] - ranges[i][0];
+
+        if (toMachine)
+            memcpy(field, registers, length);
+        else
+            memcpy(registers, field, length);
+        registers += length;
+    }
+}
+
+// field by field, so padding never counts -- see the top of the file for what is left out
+static uint64_t cowHash(const Chip8 *chip8, CowPage *const *pages)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    hash = fnvBytes(hash, chip8->V, sizeof(chip8->V));
+    hash = fnvBytes(hash, &chip8->I, sizeof(chip8->I));
+    hash = fnvBytes(hash, &chip8->pc, sizeof(chip8->pc));
+    hash = fnvBytes(hash, &chip8->delay_timer, sizeof(chip8->delay_timer));
+    hash = fnvBytes(hash, &chip8->sound_timer, sizeof(chip8->sound_timer));
+    hash = fnvBytes(hash, chip8->stack, sizeof(chip8->stack));
+    hash = fnvBytes(hash, &chip8->sp, sizeof(chip8->sp));
+    hash = fnvBytes(hash, chip8->savedKeyState, sizeof(chip8->savedKeyState));
+    hash = fnvBytes(hash, &chip8->inputBlockingFlag, sizeof(chip8->inputBlockingFlag));
+    hash = fnvBytes(hash, &chip8->rngState, sizeof(chip8->rngState));
+    hash = fnvBytes(hash, &chip8->quirks, sizeof(chip8->quirks));
+    for (int i = 0; i < COW_PAGES; i++)
+        hash = fnvBytes(hash, &pages[i]->hash, sizeof(pages[i]->hash));
+
+    return hash;
+}
+
+CowMachine *cowMachineCreate()
+{
+    return calloc(1, sizeof(CowMachine));
+}
+
+void cowMachineDestroy(CowMachine *machine)
+{
+    for (int i = 0; i < COW_PAGES; i++)
+        cowPageRelease(machine->pages[i]);
+    free(machine);
+}
+
+// a state of its own from a plain machine -- every page new
+CowState *cowCapture(const Chip8 *chip8)
+{
+    CowState *state = malloc(sizeof(CowState));
+    Chip8 *source = (Chip8 *)chip8;
+
+    for (int i = 0; i < COW_PAGES; i++)
+        state->pages[i] = cowPageCreate(cowPageBytes(source, i));
+    cowCopyRegisters(source, state->registers, 0);
+    state->hash = cowHash(chip8, state->pages);
+    atomic_fetch_add_explicit(&cowLiveStates, 1, memory_order_relaxed);
+    return state;
+}
+
+// a new state sharing every page with `state`
+CowState *cowFork(const CowState *state)
+{
+    CowState *fork = malloc(sizeof(CowState));
+
+    memcpy(fork, state, sizeof(CowState));
+    for (int i = 0; i < COW_PAGES; i++)
+        cowPageRetain(fork->pages[i]);
+    atomic_fetch_add_explicit(&cowLiveStates, 1, memory_order_relaxed);
+    return fork;
+}
+
+void cowDiscard(CowState *state)
+{
+    for (int i = 0; i < COW_PAGES; i++)
+        cowPageRelease(state->pages[i]);
+    free(state);
+    atomic_fetch_sub_explicit(&cowLiveStates, 1, memory_order_relaxed);
+}
+
+// makes the machine hold `state`, copying only the pages it doesn't hold already --
+// so it must not have run since its last cowLoad() / cowStore(), as cowStep() ensures
+void cowLoad(CowMachine *machine, const CowState *state)
+{
+    Chip8 *chip8 = &machine->chip8;
+
+    for (int i = 0; i < COW_PAGES; i++)
+    {
+        if (machine->pages[i] == state->pages[i])
+            continue;
+
+        memcpy(cowPageBytes(chip8, i), state->pages[i]->bytes, COW_PAGE_SIZE);
+        if (i < COW_MEMORY_PAGES)
+            invalidateDecoded(chip8, i * COW_PAGE_SIZE, COW_PAGE_SIZE);
+        cowPageRelease(machine->pages[i]);
+        machine->pages[i] = cowPageRetain(state->pages[i]);
+    }
+    cowCopyRegisters(chip8, (unsigned char *)state->registers, 1);
+}
+
+// writes the machine back into `state`, with new pages only where it differs
+void cowStore(CowMachine *machine, CowState *state)
+{
+    Chip8 *chip8 = &machine->chip8;
+
+    for (int i = 0; i < COW_PAGES; i++)
+    {
+        const unsigned char *bytes = cowPageBytes(chip8, i);
+        if (memcmp(bytes, state->pages[i]->bytes, COW_PAGE_SIZE) == 0)
+            continue;
+
+        CowPage *page = cowPageCreate(bytes);
+        cowPageRelease(state->pages[i]);
+        state->pages[i] = page;
+    }
+
+    // the machine now holds exactly the state's pages
+    for (int i = 0; i < COW_PAGES; i++)
+    {
+        if (machine->pages[i] != state->pages[i])
+        {
+            cowPageRelease(machine->pages[i]);
+            machine->pages[i] = cowPageRetain(state->pages[i]);
+        }
+    }
+
+    cowCopyRegisters(chip8, state->registers, 0);
+    state->hash = cowHash(chip8, state->pages);
+}
+
+// runs `frames` frames of `state` on the machine with `keys` held
+void cowStep(CowMachine *machine, CowState *state, const unsigned char *keys, int frames, int instructionsPerFrame)
+{
+    cowLoad(machine, state);
+    memcpy(machine->chip8.key, keys, sizeof(machine->chip8.key));
+    for (int i = 0; i < frames; i++)
+        runFrame(&machine->chip8, instructionsPerFrame);
+    cowStore(machine, state);
+}
+
+// bytes held by live states and pages -- pages shared between states count once
+size_t cowLiveBytes()
+{
+    return atomic_load(&cowLivePages) * sizeof(CowPage) + atomic_load(&cowLiveStates) * sizeof(CowState);
+}
+
+#endif
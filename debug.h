@@ -0,0 +1,741 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+/* Debugger -- breakpoints, watchpoints and single-step on a live machine
+
+    Only compiled in with -DCHIP8_DEBUGGER, and even then a machine runs on
+    the normal cores until something is armed: runCycles() takes the
+    instrumented cores (core.inc with CORE_DEBUG) only while a breakpoint,
+    watchpoint, step or break on unknown opcodes is set on the machine's
+    Chip8Debug, so an attached but idle debugger costs one branch per call.
+
+    The instrumented core asks debugBreak() before every instruction whether
+    to stop there. Watchpoints are checked against what the instruction is
+    about to access -- worked out from the opcode and the current registers,
+    see debugAccesses() -- so a stop always comes before the access, with
+    the machine as it was. A stop ends the runCycles() call early; the
+    frontend then stops running frames until told to continue or step, and
+    the first instruction after that runs without checks so it isn't caught
+    by the same breakpoint again.
+
+    Everything here runs on the thread that owns the machine: frontends pass
+    command lines to debugCommand() between frames, which writes its replies
+    to whatever FILE it is given. Included by chip8.h after decodeOpcode().
+*/
+
+#define DEBUG_MAX_BREAKPOINTS 32
+#define DEBUG_MAX_WATCHPOINTS 32
+
+// what a condition or watchpoint looks at: V0 - VF are 0 - 15
+enum {
+    DEBUG_I = 16,
+    DEBUG_DT,
+    DEBUG_ST,
+    DEBUG_SP,
+    DEBUG_MEMORY
+};
+
+enum {
+    DEBUG_EQ,
+    DEBUG_NE,
+    DEBUG_LT,
+    DEBUG_LE,
+    DEBUG_GT,
+    DEBUG_GE
+};
+
+#define DEBUG_READ 0x1
+#define DEBUG_WRITE 0x2
+
+typedef struct DebugCondition {
+    unsigned char operand; // V0 - VF, DEBUG_I, DEBUG_DT, DEBUG_ST or DEBUG_SP
+    unsigned char compare; // DEBUG_EQ ...
+    unsigned short value;
+} DebugCondition;
+
+typedef struct DebugBreakpoint {
+    int pc;            // -1 for anywhere -- only useful with a condition
+    int conditional;
+    DebugCondition condition;
+    unsigned long long hits;
+} DebugBreakpoint;
+
+typedef struct DebugWatchpoint {
+    unsigned char target; // DEBUG_MEMORY, DEBUG_I, or 0 for V registers
+    unsigned char access; // DEBUG_READ | DEBUG_WRITE
+    unsigned short low;   // inclusive range of addresses or V register numbers
+    unsigned short high;
+    unsigned long long hits;
+} DebugWatchpoint;
+
+typedef struct Chip8Debug {
+    DebugBreakpoint breakpoints[DEBUG_MAX_BREAKPOINTS];
+    int breakpointCount;
+    unsigned char breakAt[4096]; // breakpoints per pc, so most instructions are one lookup
+    int breakAnywhere;           // breakpoints with no pc
+    DebugWatchpoint watchpoints[DEBUG_MAX_WATCHPOINTS];
+    int watchpointCount;
+    int breakOnUnknown;
+    unsigned long stepsLeft; // stop before the next instruction once this hits 0
+    int stepping;
+
+    int armed;    // anything above set -- runCycles() takes the instrumented core
+    int stopped;  // frontends run no frames while set
+    int resumed;  // the next instruction runs unchecked
+    int reported; // the current stop has been printed
+    char reason[96];
+} Chip8Debug;
+
+// what one instruction is about to touch
+typedef struct DebugAccess {
+    unsigned short memory; // first address of memoryReads / memoryWrites bytes
+    unsigned char memoryReads;
+    unsigned char memoryWrites;
+    unsigned short vReads; // bit n for Vn
+    unsigned short vWrites;
+    unsigned char iAccess; // DEBUG_READ | DEBUG_WRITE
+} DebugAccess;
+
+static const char *debugCompareNames[] = { "==", "!=", "<", "<=", ">", ">=" };
+
+Chip8Debug *debugCreate()
+{
+    return calloc(1, sizeof(Chip8Debug));
+}
+
+void debugDestroy(Chip8Debug *debug)
+{
+    free(debug);
+}
+
+// writes Cowgod-style assembly for one opcode into text
+void debugDisassemble(unsigned short opcode, char *text, size_t size)
+{
+    Chip8Instr instr = decodeOpcode(opcode);
+    int x = instr.x, y = instr.y, nn = instr.nn, n = nn & 0xF, nnn = opcode & 0xFFF;
+
+    switch (instr.handler)
+    {
+        case OP_CLS:      snprintf(text, size, "CLS"); break;
+        case OP_RET:      snprintf(text, size, "RET"); break;
+        case OP_SYS:      snprintf(text, size, "SYS  0x%03X", nnn); break;
+        case OP_JP:       snprintf(text, size, "JP   0x%03X", nnn); break;
+        case OP_CALL:     snprintf(text, size, "CALL 0x%03X", nnn); break;
+        case OP_SE_IMM:   snprintf(text, size, "SE   V%X, 0x%02X", x, nn); break;
+        case OP_SNE_IMM:  snprintf(text, size, "SNE  V%X, 0x%02X", x, nn); break;
+        case OP_SE_REG:   snprintf(text, size, "SE   V%X, V%X", x, y); break;
+        case OP_LD_IMM:   snprintf(text, size, "LD   V%X, 0x%02X", x, nn); break;
+        case OP_ADD_IMM:  snprintf(text, size, "ADD  V%X, 0x%02X", x, nn); break;
+        case OP_LD_REG:   snprintf(text, size, "LD   V%X, V%X", x, y); break;
+        case OP_OR:       snprintf(text, size, "OR   V%X, V%X", x, y); break;
+        case OP_AND:      snprintf(text, size, "AND  V%X, V%X", x, y); break;
+        case OP_XOR:      snprintf(text, size, "XOR  V%X, V%X", x, y); break;
+        case OP_ADD_REG:  snprintf(text, size, "ADD  V%X, V%X", x, y); break;
+        case OP_SUB:      snprintf(text, size, "SUB  V%X, V%X", x, y); break;
+        case OP_SHR:      snprintf(text, size, "SHR  V%X, V%X", x, y); break;
+        case OP_SUBN:     snprintf(text, size, "SUBN V%X, V%X", x, y); break;
+        case OP_SHL:      snprintf(text, size, "SHL  V%X, V%X", x, y); break;
+        case OP_SNE_REG:  snprintf(text, size, "SNE  V%X, V%X", x, y); break;
+        case OP_LD_I:     snprintf(text, size, "LD   I, 0x%03X", nnn); break;
+        case OP_JP_V0:    snprintf(text, size, "JP   V0, 0x%03X", nnn); break;
+        case OP_RND:      snprintf(text, size, "RND  V%X, 0x%02X", x, nn); break;
+        case OP_DRW:      snprintf(text, size, "DRW  V%X, V%X, %d", x, y, n); break;
+        case OP_SKP:      snprintf(text, size, "SKP  V%X", x); break;
+        case OP_SKNP:     snprintf(text, size, "SKNP V%X", x); break;
+        case OP_LD_VX_DT: snprintf(text, size, "LD   V%X, DT", x); break;
+        case OP_LD_KEY:   snprintf(text, size, "LD   V%X, K", x); break;
+        case OP_LD_DT:    snprintf(text, size, "LD   DT, V%X", x); break;
+        case OP_LD_ST:    snprintf(text, size, "LD   ST, V%X", x); break;
+        case OP_ADD_I:    snprintf(text, size, "ADD  I, V%X", x); break;
+        case OP_LD_F:     snprintf(text, size, "LD   F, V%X", x); break;
+        case OP_LD_B:     snprintf(text, size, "LD   B, V%X", x); break;
+        case OP_STORE:    snprintf(text, size, "LD   [I], V%X", x); break;
+        case OP_LOAD:     snprintf(text, size, "LD   V%X, [I]", x); break;
+        default:          snprintf(text, size, "DW   0x%04X", opcode); break;
+    }
+}
+
+// registers and memory the instruction at pc reads and writes, as the machine stands
+static void debugAccesses(const Chip8 *chip8, Chip8Instr instr, DebugAccess *access)
+{
+    unsigned short vx = 1 << instr.x, vy = 1 << instr.y, vf = 1 << 0xF;
+    unsigned short throughX = (2 << instr.x) - 1; // V0 - VX
+    int movesI = chip8->quirks & QUIRK_LOAD_STORE_I ? DEBUG_WRITE : 0;
+
+    memset(access, 0, sizeof(DebugAccess));
+    access->memory = chip8->I & 0xFFF;
+
+    switch (instr.handler)
+    {
+        case OP_SE_IMM: case OP_SNE_IMM: case OP_SKP: case OP_SKNP: case OP_LD_DT: case OP_LD_ST:
+            access->vReads = vx;
+            break;
+        case OP_SE_REG: case OP_SNE_REG:
+            access->vReads = vx | vy;
+            break;
+        case OP_LD_IMM: case OP_RND: case OP_LD_VX_DT: case OP_LD_KEY:
+            access->vWrites = vx;
+            break;
+        case OP_ADD_IMM:
+            access->vReads = vx;
+            access->vWrites = vx;
+            break;
+        case OP_LD_REG:
+            access->vReads = vy;
+            access->vWrites = vx;
+            break;
+        case OP_OR: case OP_AND: case OP_XOR:
+            access->vReads = vx | vy;
+            access->vWrites = vx;
+            break;
+        case OP_ADD_REG: case OP_SUB: case OP_SUBN:
+            access->vReads = vx | vy;
+            access->vWrites = vx | vf;
+            break;
+        case OP_SHR: case OP_SHL:
+            access->vReads = chip8->quirks & QUIRK_SHIFT_VY ? vy : vx;
+            access->vWrites = vx | vf;
+            break;
+        case OP_LD_I:
+            access->iAccess = DEBUG_WRITE;
+            break;
+        case OP_JP_V0:
+            access->vReads = chip8->quirks & QUIRK_JUMP_VX ? vx : 1;
+            break;
+        case OP_DRW:
+            access->vReads = vx | vy;
+            access->vWrites = vf;
+            access->iAccess = DEBUG_READ;
+            access->memoryReads = instr.nn & 0xF;
+            break;
+        case OP_ADD_I:
+            access->vReads = vx;
+            access->iAccess = DEBUG_READ | DEBUG_WRITE;
+            break;
+        case OP_LD_F:
+            access->vReads = vx;
+            access->iAccess = DEBUG_WRITE;
+            break;
+        case OP_LD_B:
+            access->vReads = vx;
+            access->iAccess = DEBUG_READ;
+            access->memoryWrites = 3;
+            break;
+        case OP_STORE:
+            access->vReads = throughX;
+            access->iAccess = DEBUG_READ | movesI;
+            access->memoryWrites = instr.x + 1;
+            break;
+        case OP_LOAD:
+            access->vWrites = throughX;
+            access->iAccess = DEBUG_READ | movesI;
+            access->memoryReads = instr.x + 1;
+            break;
+    }
+}
+
+static int debugOperand(const Chip8 *chip8, int operand)
+{
+    switch (operand)
+    {
+        case DEBUG_I: return chip8->I;
+        case DEBUG_DT: return chip8->delay_timer;
+        case DEBUG_ST: return chip8->sound_timer;
+        case DEBUG_SP: return chip8->sp;
+        default: return chip8->V[operand & 0xF];
+    }
+}
+
+static int debugConditionHolds(const Chip8 *chip8, const DebugCondition *condition)
+{
+    int value = debugOperand(chip8, condition->operand);
+
+    switch (condition->compare)
+    {
+        case DEBUG_EQ: return value == condition->value;
+        case DEBUG_NE: return value != condition->value;
+        case DEBUG_LT: return value < condition->value;
+        case DEBUG_LE: return value <= condition->value;
+        case DEBUG_GT: return value > condition->value;
+        default: return value >= condition->value;
+    }
+}
+
+// 1 if [low, low + length) wraps into [watchLow, watchHigh] anywhere
+static int debugOverlaps(unsigned short low, int length, unsigned short watchLow, unsigned short watchHigh)
+{
+    for (int i = 0; i < length; i++)
+    {
+        unsigned short address = (low + i) & 0xFFF;
+        if (address >= watchLow && address <= watchHigh)
+            return 1;
+    }
+    return 0;
+}
+
+static int debugWatchHit(const DebugWatchpoint *watch, const DebugAccess *access)
+{
+    if (watch->target == DEBUG_MEMORY)
+    {
+        return ((watch->access & DEBUG_READ) && debugOverlaps(access->memory, access->memoryReads, watch->low, watch->high))
+            || ((watch->access & DEBUG_WRITE) && debugOverlaps(access->memory, access->memoryWrites, watch->low, watch->high));
+    }
+    if (watch->target == DEBUG_I)
+        return (watch->access & access->iAccess) != 0;
+
+    unsigned short mask = ((2 << watch->high) - 1) & ~((1 << watch->low) - 1);
+    return ((watch->access & DEBUG_READ) && (access->vReads & mask))
+        || ((watch->access & DEBUG_WRITE) && (access->vWrites & mask));
+}
+
+static void debugStop(Chip8Debug *debug, const char *reason)
+{
+    snprintf(debug->reason, sizeof(debug->reason), "%s", reason);
+    debug->stopped = 1;
+    debug->reported = 0;
+    debug->stepping = 0;
+}
+
+// the instrumented core's check before every instruction -- 1 to stop before it
+static int debugBreak(Chip8 *chip8, unsigned short pc)
+{
+    Chip8Debug *debug = chip8->debug;
+    char reason[96];
+
+    if (debug->stepping)
+    {
+        if (debug->stepsLeft == 0)
+        {
+            debugStop(debug, "step");
+            return 1;
+        }
+        debug->stepsLeft--;
+    }
+
+    if (debug->resumed)
+    {
+        debug->resumed = 0;
+        return 0;
+    }
+
+    pc &= 0xFFF;
+    if (debug->breakAt[pc] != 0 || debug->breakAnywhere != 0)
+    {
+        for (int i = 0; i < debug->breakpointCount; i++)
+        {
+            DebugBreakpoint *breakpoint = &debug->breakpoints[i];
+            if ((breakpoint->pc == pc || breakpoint->pc < 0)
+                && (!breakpoint->conditional || debugConditionHolds(chip8, &breakpoint->condition)))
+            {
+                breakpoint->hits++;
+                snprintf(reason, sizeof(reason), "breakpoint %d", i);
+                debugStop(debug, reason);
+                return 1;
+            }
+        }
+    }
+
+    if (debug->watchpointCount == 0 && !debug->breakOnUnknown)
+        return 0;
+
+    Chip8Instr instr = decodeOpcode(chip8->memory[pc] << 8 | chip8->memory[(pc + 1) & 0xFFF]);
+
+    if (debug->breakOnUnknown && instr.handler == OP_UNKNOWN)
+    {
+        debugStop(debug, "unknown opcode");
+        return 1;
+    }
+
+    DebugAccess access;
+    debugAccesses(chip8, instr, &access);
+    for (int i = 0; i < debug->watchpointCount; i++)
+    {
+        if (debugWatchHit(&debug->watchpoints[i], &access))
+        {
+            debug->watchpoints[i].hits++;
+            snprintf(reason, sizeof(reason), "watchpoint %d", i);
+            debugStop(debug, reason);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void debugUpdateArmed(Chip8Debug *debug)
+{
+    debug->breakAnywhere = 0;
+    memset(debug->breakAt, 0, sizeof(debug->breakAt));
+    for (int i = 0; i < debug->breakpointCount; i++)
+    {
+        if (debug->breakpoints[i].pc < 0)
+            debug->breakAnywhere++;
+        else
+            debug->breakAt[debug->breakpoints[i].pc]++;
+    }
+
+    debug->armed = debug->breakpointCount > 0 || debug->watchpointCount > 0 || debug->breakOnUnknown || debug->stepping;
+}
+
+// disassembles `count` instructions from addr, marking pc and breakpoints
+void debugList(const Chip8Debug *debug, const Chip8 *chip8, unsigned short addr, int count, FILE *out)
+{
+    for (int i = 0; i < count; i++, addr += 2)
+    {
+        unsigned short at = addr & 0xFFF;
+        unsigned short opcode = chip8->memory[at] << 8 | chip8->memory[(at + 1) & 0xFFF];
+        char text[32];
+
+        debugDisassemble(opcode, text, sizeof(text));
+        fprintf(out, "%c%c 0x%03X  %04X  %s\n", at == chip8->pc ? '>' : ' ', debug->breakAt[at] ? '*' : ' ', at, opcode, text);
+    }
+}
+
+void debugRegisters(const Chip8 *chip8, FILE *out)
+{
+    for (int i = 0; i < 16; i++)
+        fprintf(out, "V%X=%02X%s", i, chip8->V[i], i == 7 || i == 15 ? "\n" : " ");
+    fprintf(out, "I=%03X PC=%03X SP=%X DT=%02X ST=%02X cycles=%llu\n", chip8->I, chip8->pc, chip8->sp,
+        chip8->delay_timer, chip8->sound_timer, (unsigned long long)chip8->cycles);
+    fprintf(out, "stack:");
+    for (int i = 0; i < chip8->sp; i++)
+        fprintf(out, " %03X", chip8->stack[i]);
+    fprintf(out, "\n");
+}
+
+// prints where the machine stopped, once per stop -- call after running
+void debugReport(Chip8Debug *debug, const Chip8 *chip8, FILE *out)
+{
+    if (!debug->stopped || debug->reported)
+        return;
+
+    fprintf(out, "stopped (%s)\n", debug->reason);
+    debugList(debug, chip8, chip8->pc, 1, out);
+    debugRegisters(chip8, out);
+    fflush(out);
+    debug->reported = 1;
+}
+
+// V0 - VF, I, DT, ST or SP -- returns -1 for anything else
+static int debugParseOperand(const char *text)
+{
+    if (toupper((unsigned char)text[0]) == 'V' && isxdigit((unsigned char)text[1]) && text[2] == '\0')
+        return (int)strtol(text + 1, NULL, 16);
+    if (strcasecmp(text, "I") == 0)
+        return DEBUG_I;
+    if (strcasecmp(text, "DT") == 0)
+        return DEBUG_DT;
+    if (strcasecmp(text, "ST") == 0)
+        return DEBUG_ST;
+    if (strcasecmp(text, "SP") == 0)
+        return DEBUG_SP;
+    return -1;
+}
+
+// a number in C notation -- returns -1 unless it is one
+static long debugParseNumber(const char *text)
+{
+    char *end;
+    long value = strtol(text, &end, 0);
+    return text[0] != '\0' && *end == '\0' && value >= 0 ? value : -1;
+}
+
+// "OPERAND COMPARE VALUE" -- returns 0 on success
+static int debugParseCondition(char **words, int count, DebugCondition *condition)
+{
+    if (count != 3)
+        return -1;
+
+    int operand = debugParseOperand(words[0]);
+    long value = debugParseNumber(words[2]);
+    int compare = -1;
+    for (int i = 0; i < 6; i++)
+    {
+        if (strcmp(words[1], debugCompareNames[i]) == 0)
+            compare = i;
+    }
+
+    if (operand < 0 || compare < 0 || value < 0 || value > 0xFFFF)
+        return -1;
+
+    condition->operand = operand;
+    condition->compare = compare;
+    condition->value = value;
+    return 0;
+}
+
+static const char *debugOperandName(int operand, char *text)
+{
+    static const char *names[] = { "I", "DT", "ST", "SP" };
+    if (operand >= DEBUG_I)
+        return names[operand - DEBUG_I];
+    sprintf(text, "V%X", operand);
+    return text;
+}
+
+static void debugListPoints(const Chip8Debug *debug, FILE *out)
+{
+    char name[4];
+
+    for (int i = 0; i < debug->breakpointCount; i++)
+    {
+        const DebugBreakpoint *breakpoint = &debug->breakpoints[i];
+        if (breakpoint->pc >= 0)
+            fprintf(out, "breakpoint %d: 0x%03X", i, breakpoint->pc);
+        else
+            fprintf(out, "breakpoint %d: anywhere", i);
+        if (breakpoint->conditional)
+        {
+            fprintf(out, " if %s %s 0x%X", debugOperandName(breakpoint->condition.operand, name),
+                debugCompareNames[breakpoint->condition.compare], breakpoint->condition.value);
+        }
+        fprintf(out, " (%llu hits)\n", breakpoint->hits);
+    }
+
+    for (int i = 0; i < debug->watchpointCount; i++)
+    {
+        const DebugWatchpoint *watch = &debug->watchpoints[i];
+        const char *access = watch->access == (DEBUG_READ | DEBUG_WRITE) ? "rw" : watch->access == DEBUG_READ ? "r" : "w";
+        if (watch->target == DEBUG_MEMORY)
+            fprintf(out, "watchpoint %d: %s memory 0x%03X - 0x%03X", i, access, watch->low, watch->high);
+        else if (watch->target == DEBUG_I)
+            fprintf(out, "watchpoint %d: %s I", i, access);
+        else
+            fprintf(out, "watchpoint %d: %s V%X - V%X", i, access, watch->low, watch->high);
+        fprintf(out, " (%llu hits)\n", watch->hits);
+    }
+
+    fprintf(out, "unknown opcodes: %s\n", debug->breakOnUnknown ? "break" : "ignore");
+}
+
+// "[r|w|rw] mem LOW [HIGH]", "[r|w|rw] VX [VY]" or "[r|w|rw] I" -- returns 0 on success
+static int debugParseWatch(char **words, int count, DebugWatchpoint *watch)
+{
+    memset(watch, 0, sizeof(DebugWatchpoint));
+    watch->access = DEBUG_READ | DEBUG_WRITE;
+
+    if (count > 0 && (strcmp(words[0], "r") == 0 || strcmp(words[0], "w") == 0 || strcmp(words[0], "rw") == 0))
+    {
+        watch->access = strcmp(words[0], "r") == 0 ? DEBUG_READ : strcmp(words[0], "w") == 0 ? DEBUG_WRITE : DEBUG_READ | DEBUG_WRITE;
+        words++;
+        count--;
+    }
+
+    if (count == 0 || count > 3)
+        return -1;
+
+    if (strcmp(words[0], "mem") == 0 && count >= 2)
+    {
+        long low = debugParseNumber(words[1]);
+        long high = count == 3 ? debugParseNumber(words[2]) : low;
+        if (low < 0 || high < low || high > 0xFFF)
+            return -1;
+        watch->target = DEBUG_MEMORY;
+        watch->low = low;
+        watch->high = high;
+        return 0;
+    }
+
+    int low = debugParseOperand(words[0]);
+    int high = count == 2 ? debugParseOperand(words[1]) : low;
+    if (low == DEBUG_I && count == 1)
+    {
+        watch->target = DEBUG_I;
+        return 0;
+    }
+    if (low < 0 || low > 0xF || high < low || high > 0xF || count > 2)
+        return -1;
+    watch->low = low;
+    watch->high = high;
+    return 0;
+}
+
+static void debugHelp(FILE *out)
+{
+    fprintf(out,
+        "b ADDR [if COND]       break at ADDR, optionally only while COND holds\n"
+        "b if COND              break anywhere COND holds (COND: V0-VF, I, DT, ST or SP, ==, !=, <, <=, >, >=, number)\n"
+        "w [r|w|rw] mem LO [HI] watch memory (default rw)\n"
+        "w [r|w|rw] VX [VY]     watch registers VX - VY\n"
+        "w [r|w|rw] I           watch I\n"
+        "d b|w N, d all         delete a breakpoint / watchpoint, or everything\n"
+        "unknown on|off         break on unknown opcodes\n"
+        "l                      list breakpoints and watchpoints\n"
+        "c                      continue\n"
+        "s [N]                  step N instructions (default 1)\n"
+        "p                      pause\n"
+        "r                      registers\n"
+        "u [ADDR] [N]           disassemble N instructions from ADDR (default around pc)\n"
+        "x ADDR [N]             dump N bytes of memory\n");
+}
+
+// Runs one command line against the machine, replying to out. Returns 0, or
+// -1 for a line it couldn't make sense of.
+int debugCommand(Chip8Debug *debug, Chip8 *chip8, char *line, FILE *out)
+{
+    char *words[8];
+    int count = 0;
+    int result = 0;
+
+    for (char *word = strtok(line, " \t\r\n"); word != NULL && count < 8; word = strtok(NULL, " \t\r\n"))
+        words[count++] = word;
+
+    if (count == 0)
+        return 0;
+
+    const char *command = words[0];
+
+    if (strcmp(command, "b") == 0 || strcmp(command, "break") == 0)
+    {
+        DebugBreakpoint breakpoint;
+        int at = 1;
+
+        memset(&breakpoint, 0, sizeof(breakpoint));
+        breakpoint.pc = -1;
+        if (count > 1 && strcmp(words[1], "if") != 0)
+        {
+            long pc = debugParseNumber(words[1]);
+            if (pc < 0 || pc > 0xFFF)
+                result = -1;
+            breakpoint.pc = pc;
+            at = 2;
+        }
+        if (at < count)
+        {
+            breakpoint.conditional = 1;
+            if (strcmp(words[at], "if") != 0 || debugParseCondition(words + at + 1, count - at - 1, &breakpoint.condition) != 0)
+                result = -1;
+        }
+        if (breakpoint.pc < 0 && !breakpoint.conditional)
+            result = -1;
+
+        if (result == 0 && debug->breakpointCount == DEBUG_MAX_BREAKPOINTS)
+            fprintf(out, "too many breakpoints\n");
+        else if (result == 0)
+            debug->breakpoints[debug->breakpointCount++] = breakpoint;
+    }
+    else if (strcmp(command, "w") == 0 || strcmp(command, "watch") == 0)
+    {
+        DebugWatchpoint watch;
+        if (debugParseWatch(words + 1, count - 1, &watch) != 0)
+            result = -1;
+        else if (debug->watchpointCount == DEBUG_MAX_WATCHPOINTS)
+            fprintf(out, "too many watchpoints\n");
+        else
+            debug->watchpoints[debug->watchpointCount++] = watch;
+    }
+    else if (strcmp(command, "d") == 0 || strcmp(command, "delete") == 0)
+    {
+        long index = count == 3 ? debugParseNumber(words[2]) : -1;
+
+        if (count == 2 && strcmp(words[1], "all") == 0)
+        {
+            debug->breakpointCount = 0;
+            debug->watchpointCount = 0;
+        }
+        else if (count == 3 && strcmp(words[1], "b") == 0 && index >= 0 && index < debug->breakpointCount)
+        {
+            memmove(&debug->breakpoints[index], &debug->breakpoints[index + 1],
+                (debug->breakpointCount - index - 1) * sizeof(DebugBreakpoint));
+            debug->breakpointCount--;
+        }
+        else if (count == 3 && strcmp(words[1], "w") == 0 && index >= 0 && index < debug->watchpointCount)
+        {
+            memmove(&debug->watchpoints[index], &debug->watchpoints[index + 1],
+                (debug->watchpointCount - index - 1) * sizeof(DebugWatchpoint));
+            debug->watchpointCount--;
+        }
+        else
+        {
+            result = -1;
+        }
+    }
+    else if (strcmp(command, "unknown") == 0 && count == 2)
+    {
+        debug->breakOnUnknown = strcmp(words[1], "on") == 0;
+        if (!debug->breakOnUnknown && strcmp(words[1], "off") != 0)
+            result = -1;
+    }
+    else if (strcmp(command, "l") == 0 || strcmp(command, "list") == 0)
+    {
+        debugListPoints(debug, out);
+    }
+    else if (strcmp(command, "c") == 0 || strcmp(command, "continue") == 0)
+    {
+        if (debug->stopped)
+        {
+            debug->stopped = 0;
+            debug->resumed = 1;
+        }
+    }
+    else if (strcmp(command, "s") == 0 || strcmp(command, "step") == 0)
+    {
+        long steps = count > 1 ? debugParseNumber(words[1]) : 1;
+        if (steps < 1)
+        {
+            result = -1;
+        }
+        else
+        {
+            debug->stepping = 1;
+            debug->stepsLeft = steps;
+            debug->resumed = debug->stopped;
+            debug->stopped = 0;
+        }
+    }
+    else if (strcmp(command, "p") == 0 || strcmp(command, "pause") == 0)
+    {
+        if (!debug->stopped)
+            debugStop(debug, "paused");
+    }
+    else if (strcmp(command, "r") == 0 || strcmp(command, "registers") == 0)
+    {
+        debugRegisters(chip8, out);
+    }
+    else if (strcmp(command, "u") == 0 || strcmp(command, "disassemble") == 0)
+    {
+        long addr = count > 1 ? debugParseNumber(words[1]) : (chip8->pc - 8) & 0xFFF;
+        long lines = count > 2 ? debugParseNumber(words[2]) : 10;
+        if (addr < 0 || lines < 1)
+            result = -1;
+        else
+            debugList(debug, chip8, addr, lines, out);
+    }
+    else if (strcmp(command, "x") == 0 || strcmp(command, "dump") == 0)
+    {
+        long addr = count > 1 ? debugParseNumber(words[1]) : -1;
+        long length = count > 2 ? debugParseNumber(words[2]) : 64;
+        if (addr < 0 || length < 1)
+            result = -1;
+        for (long i = 0; result == 0 && i < length; i++)
+        {
+            if (i % 16 == 0)
+                fprintf(out, "%s0x%03lX:", i ? "\n" : "", (addr + i) & 0xFFF);
+            fprintf(out, " %02X", chip8->memory[(addr + i) & 0xFFF]);
+        }
+        if (result == 0)
+            fprintf(out, "\n");
+    }
+    else if (strcmp(command, "h") == 0 || strcmp(command, "help") == 0)
+    {
+        debugHelp(out);
+    }
+    else
+    {
+        result = -1;
+    }
+
+    if (result != 0)
+        fprintf(out, "?  (h for help)\n");
+
+    debugUpdateArmed(debug);
+    fflush(out);
+    return result;
+}
+
+#endif
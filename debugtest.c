@@ -0,0 +1,68 @@
+// Debugger checks -- runs tiny ROMs under debug.h and makes sure a step
+// stops after exactly as many instructions as were asked for, including in
+// the places the normal cores skip over (idle loops, FX0A waits).
+//
+//  usage: debugtest
+//
+// Prints a line per check and exits with 1 if any failed. `make check` runs it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define CHIP8_DEBUGGER
+#include "chip8.h"
+
+typedef struct DebugCheck {
+    const char *name;
+    unsigned char rom[8];
+    int romSize;
+    int setup;      // instructions run before stepping starts
+    int steps;
+    unsigned short pc; // where the machine should stop
+} DebugCheck;
+
+static const DebugCheck checks[] = {
+    // 200: LD V0, 1 / 202: JP 202
+    { "self loop", { 0x60, 0x01, 0x12, 0x02 }, 4, 0, 5, 0x202 },
+    // stepping from inside the loop, once the normal cores have seen a lap of it
+    { "self loop, inside", { 0x60, 0x01, 0x12, 0x02 }, 4, 100, 3, 0x202 },
+    // 200: LD V0, 1 / 202: ADD V0, 1 / 204: JP 202
+    { "two instruction loop", { 0x60, 0x01, 0x70, 0x01, 0x12, 0x02 }, 6, 0, 6, 0x204 },
+    // 200: LD V0, K
+    { "key wait", { 0xF0, 0x0A }, 2, 0, 4, 0x200 },
+};
+
+static int runCheck(const DebugCheck *check)
+{
+    Chip8 chip8 = initialize();
+    char line[16];
+
+    loadGameFromMemory(&chip8, check->rom, check->romSize);
+    if (check->setup > 0)
+        runCycles(&chip8, check->setup);
+
+    chip8.debug = debugCreate();
+    snprintf(line, sizeof(line), "s %d", check->steps);
+    debugCommand(chip8.debug, &chip8, line, stdout);
+
+    uint64_t start = chip8.cycles;
+    unsigned long done = runCycles(&chip8, 1000);
+    int ok = chip8.debug->stopped && done == (unsigned long)check->steps
+        && chip8.cycles - start == (uint64_t)check->steps && (chip8.pc & 0xFFF) == check->pc;
+
+    printf("%-22s %s  ran %lu of %d steps, %s at %03X\n", check->name, ok ? "ok  " : "FAIL",
+        done, check->steps, chip8.debug->stopped ? "stopped" : "running", chip8.pc & 0xFFF);
+
+    debugDestroy(chip8.debug);
+    return ok;
+}
+
+int main()
+{
+    int failed = 0;
+
+    for (int i = 0; i < (int)(sizeof(checks) / sizeof(checks[0])); i++)
+        failed += !runCheck(&checks[i]);
+
+    return failed ? 1 : 0;
+}
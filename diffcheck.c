@@ -0,0 +1,590 @@
+// Differential checker -- runs the reference interpreter, emulateCycle(),
+// and a faster engine side by side on the same machines and stops at the
+// first instruction where they disagree.
+//
+//  usage: diffcheck [-e engines] [-c cycles] [-l lanes] [-n interval] [-F sweep] [-i ipf]
+//                   [-s seed] [-Q quirks] [-A module] [rom ...]
+//
+// Engines (comma separated, default cores,jit,batch):
+//   cores  runCycles(), the predecoded cores with idle skipping
+//   jit    runCyclesJit(), the recompiler in jit.h
+//   batch  stepBatch(), every lane in one lockstep.h batch
+//   aot    runCyclesAot() with the module given by -A, built by aot for the ROM
+// Without ROMs the generated corpus from corpus.h is checked.
+//
+// Every ROM runs `cycles` instructions (default 1000000) on `lanes` machines
+// (default 4). Lane n seeds its random number generator with seed + n and
+// gets its own stream of key presses, a different set held every 8 frames,
+// so both sides see exactly the same input. Timers tick every `ipf`
+// instructions, as in runFrame().
+//
+// Every `interval` instructions (default 100) each lane is compared: all
+// of the registers, I, pc, sp, the stack, timers, keys, the random number
+// state, the display, and the parts of memory the reference wrote since the
+// last comparison -- it is stepped one instruction at a time, so FX33 and
+// FX55 say exactly where. Every `sweep` comparisons (default 64), and at
+// the end, all of memory is compared too, which catches an engine writing
+// where it shouldn't.
+//
+// On a mismatch both sides go back to the last full comparison that passed
+// and the cycle count is bisected down to the first instruction after which
+// they differ; its pc and opcode are reported along with every field that
+// differs. The exit status is 1 if any engine diverged.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "chip8.h"
+#include "savestate.h"
+#include "scheduler.h"
+#include "corpus.h"
+#include "lockstep.h"
+#include "jit.h"
+#include "aot.h"
+
+#define DIFF_MAX_LANES 64
+#define DIFF_CHUNK 64 // bytes of memory per bit of a dirty mask
+#define DIFF_KEY_HOLD 8 // frames each set of held keys lasts
+
+enum {
+    ENGINE_CORES = 0,
+    ENGINE_JIT,
+    ENGINE_BATCH,
+    ENGINE_AOT,
+    ENGINE_COUNT
+};
+
+static const char *engineNames[ENGINE_COUNT] = { "cores", "jit", "batch", "aot" };
+
+// the engine under test on every lane
+typedef struct Candidate {
+    int engine;
+    int lanes;
+    Chip8 machines[DIFF_MAX_LANES]; // the lanes themselves, or for batch a copy taken to compare
+    Chip8Jit *jits[DIFF_MAX_LANES];
+    AotLibrary *module;             // aot only, shared by the lanes
+    Chip8Aot *aots[DIFF_MAX_LANES];
+    Chip8Batch *batch;
+} Candidate;
+
+// the reference side, and where it stood at the last full comparison
+typedef struct Reference {
+    int lanes;
+    Chip8 machines[DIFF_MAX_LANES];
+    uint64_t dirty[DIFF_MAX_LANES]; // memory chunks written since the last comparison
+    unsigned char good[DIFF_MAX_LANES][CHIP8_STATE_SIZE];
+    unsigned long long goodCycle;
+} Reference;
+
+static int instructionsPerFrame = SCHEDULER_DEFAULT_IPF;
+static uint32_t seed = CHIP8_DEFAULT_SEED;
+static const char *aotPath;
+
+static uint64_t mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// keys held by a lane during a frame -- a function of the frame alone, so a
+// bisect starting anywhere sees the same presses
+static unsigned short keysAt(int lane, unsigned long long frame)
+{
+    uint64_t bits = mix(((uint64_t)seed << 32 | (uint64_t)lane << 24) ^ mix(frame / DIFF_KEY_HOLD + 1));
+    // mostly one or two keys, sometimes none
+    return (unsigned short)(bits & bits >> 16 & bits >> 32);
+}
+
+static void setKeys(Chip8 *chip8, unsigned short keys)
+{
+    for (int i = 0; i < 16; i++)
+        chip8->key[i] = (keys >> i) & 1;
+}
+
+// one instruction of the reference, noting the memory it wrote
+static void referenceStep(Reference *reference, int lane)
+{
+    Chip8 *chip8 = &reference->machines[lane];
+    unsigned short I = chip8->I;
+
+    emulateCycle(chip8);
+
+    int length = 0;
+    if ((chip8->opcode & 0xF0FF) == 0xF033)
+        length = 3;
+    else if ((chip8->opcode & 0xF0FF) == 0xF055)
+        length = ((chip8->opcode & 0x0F00) >> 8) + 1;
+    for (int i = 0; i < length; i++)
+        reference->dirty[lane] |= 1ULL << (((I + i) & 0xFFF) / DIFF_CHUNK);
+}
+
+static int candidateCreate(Candidate *candidate, int engine, int lanes)
+{
+    memset(candidate, 0, sizeof(Candidate));
+    candidate->engine = engine;
+    candidate->lanes = lanes;
+    if (engine == ENGINE_AOT && (candidate->module = aotLibraryLoad(aotPath)) == NULL)
+        return -1;
+
+    for (int lane = 0; lane < lanes; lane++)
+    {
+        candidate->machines[lane] = initialize();
+        if (engine == ENGINE_JIT && (candidate->jits[lane] = jitCreate()) == NULL)
+            return -1;
+        if (engine == ENGINE_AOT && (candidate->aots[lane] = aotCreate(candidate->module)) == NULL)
+            return -1;
+    }
+    if (engine == ENGINE_BATCH && (candidate->batch = batchCreate(lanes)) == NULL)
+        return -1;
+
+    return 0;
+}
+
+static void candidateDestroy(Candidate *candidate)
+{
+    for (int lane = 0; lane < candidate->lanes; lane++)
+    {
+        if (candidate->jits[lane] != NULL)
+            jitDestroy(candidate->jits[lane]);
+        if (candidate->aots[lane] != NULL)
+            aotDestroy(candidate->aots[lane]);
+    }
+    if (candidate->module != NULL)
+        aotLibraryDestroy(candidate->module);
+    if (candidate->batch != NULL)
+        batchDestroy(candidate->batch);
+}
+
+// starts every lane over from a saved state, with nothing left of what the engine had translated
+static void candidateLoad(Candidate *candidate, unsigned char states[][CHIP8_STATE_SIZE])
+{
+    for (int lane = 0; lane < candidate->lanes; lane++)
+    {
+        Chip8 *chip8 = &candidate->machines[lane];
+        loadState(chip8, states[lane]);
+
+        if (candidate->jits[lane] != NULL)
+        {
+            jitDestroy(candidate->jits[lane]);
+            candidate->jits[lane] = jitCreate();
+        }
+        if (candidate->aots[lane] != NULL)
+            aotReset(candidate->aots[lane]);
+        if (candidate->batch != NULL)
+            batchSetLane(candidate->batch, lane, chip8);
+    }
+}
+
+static void candidateSetKeys(Candidate *candidate, unsigned long long frame)
+{
+    for (int lane = 0; lane < candidate->lanes; lane++)
+    {
+        if (candidate->batch != NULL)
+            batchSetKeys(candidate->batch, lane, keysAt(lane, frame));
+        else
+            setKeys(&candidate->machines[lane], keysAt(lane, frame));
+    }
+}
+
+static void candidateRun(Candidate *candidate, unsigned long cycles)
+{
+    if (candidate->batch != NULL)
+    {
+        stepBatch(candidate->batch, cycles);
+        return;
+    }
+
+    for (int lane = 0; lane < candidate->lanes; lane++)
+    {
+        Chip8 *chip8 = &candidate->machines[lane];
+
+        if (candidate->engine == ENGINE_JIT)
+            runCyclesJit(candidate->jits[lane], chip8, cycles);
+        else if (candidate->engine == ENGINE_AOT)
+            runCyclesAot(candidate->aots[lane], chip8, cycles);
+        else
+            runCycles(chip8, cycles);
+    }
+}
+
+static void candidateUpdateTimers(Candidate *candidate)
+{
+    if (candidate->batch != NULL)
+    {
+        batchUpdateTimers(candidate->batch);
+        return;
+    }
+
+    for (int lane = 0; lane < candidate->lanes; lane++)
+        updateTimers(&candidate->machines[lane]);
+}
+
+// the lane's state as a plain Chip8, for comparing
+static const Chip8 *candidateLane(Candidate *candidate, int lane)
+{
+    if (candidate->batch != NULL)
+        batchGetLaneState(candidate->batch, lane, &candidate->machines[lane]);
+    return &candidate->machines[lane];
+}
+
+// runs both sides from `cycle` to `end`, in frames split at their boundaries --
+// keys are set when a frame starts and timers tick when it ends
+static void advance(Reference *reference, Candidate *candidate, unsigned long long cycle, unsigned long long end)
+{
+    while (cycle < end)
+    {
+        unsigned long long frame = cycle / instructionsPerFrame;
+        unsigned long long frameEnd = (frame + 1) * instructionsPerFrame;
+        unsigned long long stop = end < frameEnd ? end : frameEnd;
+
+        if (cycle % instructionsPerFrame == 0)
+        {
+            for (int lane = 0; lane < reference->lanes; lane++)
+                setKeys(&reference->machines[lane], keysAt(lane, frame));
+            candidateSetKeys(candidate, frame);
+        }
+
+        for (int lane = 0; lane < reference->lanes; lane++)
+        {
+            for (unsigned long long i = cycle; i < stop; i++)
+                referenceStep(reference, lane);
+        }
+        candidateRun(candidate, stop - cycle);
+
+        cycle = stop;
+        if (cycle == frameEnd)
+        {
+            for (int lane = 0; lane < reference->lanes; lane++)
+                updateTimers(&reference->machines[lane]);
+            candidateUpdateTimers(candidate);
+        }
+    }
+}
+
+// 1 if they match -- memory only in the chunks set in `chunks`
+static int sameState(const Chip8 *a, const Chip8 *b, uint64_t chunks)
+{
+    if (memcmp(a->V, b->V, sizeof(a->V)) != 0 || a->I != b->I || a->pc != b->pc || a->sp != b->sp
+        || memcmp(a->stack, b->stack, sizeof(a->stack)) != 0
+        || a->delay_timer != b->delay_timer || a->sound_timer != b->sound_timer
+        || memcmp(a->key, b->key, sizeof(a->key)) != 0 || memcmp(a->savedKeyState, b->savedKeyState, sizeof(a->savedKeyState)) != 0
+        || a->inputBlockingFlag != b->inputBlockingFlag || a->cycles != b->cycles || a->rngState != b->rngState
+        || memcmp(a->gfx, b->gfx, sizeof(a->gfx)) != 0)
+        return 0;
+
+    while (chunks != 0)
+    {
+        int chunk = __builtin_ctzll(chunks);
+        chunks &= chunks - 1;
+        if (memcmp(a->memory + chunk * DIFF_CHUNK, b->memory + chunk * DIFF_CHUNK, DIFF_CHUNK) != 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+// first lane that differs, or -1 -- clears the dirty masks it checked
+static int compareLanes(Reference *reference, Candidate *candidate, int full)
+{
+    int diverged = -1;
+
+    for (int lane = 0; lane < reference->lanes; lane++)
+    {
+        uint64_t chunks = full ? ~0ULL : reference->dirty[lane];
+        reference->dirty[lane] = 0;
+        if (diverged < 0 && !sameState(&reference->machines[lane], candidateLane(candidate, lane), chunks))
+            diverged = lane;
+    }
+
+    return diverged;
+}
+
+// both sides back to the last state known to match, with `cycles` more run on them
+static void replayFromGood(Reference *reference, Candidate *candidate, unsigned long long cycles)
+{
+    for (int lane = 0; lane < reference->lanes; lane++)
+        loadState(&reference->machines[lane], reference->good[lane]);
+    candidateLoad(candidate, reference->good);
+    advance(reference, candidate, reference->goodCycle, reference->goodCycle + cycles);
+}
+
+static void printDifferences(const Chip8 *want, const Chip8 *got)
+{
+    for (int i = 0; i < 16; i++)
+    {
+        if (want->V[i] != got->V[i])
+            printf("    V%X      %02X, engine has %02X\n", i, want->V[i], got->V[i]);
+    }
+    if (want->I != got->I)
+        printf("    I       %03X, engine has %03X\n", want->I, got->I);
+    if (want->pc != got->pc)
+        printf("    pc      %03X, engine has %03X\n", want->pc, got->pc);
+    if (want->sp != got->sp)
+        printf("    sp      %d, engine has %d\n", want->sp, got->sp);
+    for (int i = 0; i < 16; i++)
+    {
+        if (want->stack[i] != got->stack[i])
+            printf("    stack[%d] %03X, engine has %03X\n", i, want->stack[i], got->stack[i]);
+    }
+    if (want->delay_timer != got->delay_timer)
+        printf("    delay   %d, engine has %d\n", want->delay_timer, got->delay_timer);
+    if (want->sound_timer != got->sound_timer)
+        printf("    sound   %d, engine has %d\n", want->sound_timer, got->sound_timer);
+    if (memcmp(want->key, got->key, sizeof(want->key)) != 0 || memcmp(want->savedKeyState, got->savedKeyState, sizeof(want->savedKeyState)) != 0)
+        printf("    keys    differ\n");
+    if (want->inputBlockingFlag != got->inputBlockingFlag)
+        printf("    FX0A    %s, engine %s\n", want->inputBlockingFlag ? "waiting" : "not waiting", got->inputBlockingFlag ? "waiting" : "not waiting");
+    if (want->cycles != got->cycles)
+        printf("    cycles  %llu, engine has %llu\n", (unsigned long long)want->cycles, (unsigned long long)got->cycles);
+    if (want->rngState != got->rngState)
+        printf("    rng     %08X, engine has %08X\n", want->rngState, got->rngState);
+
+    int shown = 0;
+    for (int addr = 0; addr < 4096; addr++)
+    {
+        if (want->memory[addr] != got->memory[addr] && shown++ < 16)
+            printf("    [%03X]   %02X, engine has %02X\n", addr, want->memory[addr], got->memory[addr]);
+    }
+    if (shown > 16)
+        printf("    ... %d bytes of memory differ\n", shown);
+
+    for (int y = 0; y < 32; y++)
+    {
+        if (want->gfx[y] != got->gfx[y])
+            printf("    row %-2d  %016llX, engine has %016llX\n", y, (unsigned long long)want->gfx[y], (unsigned long long)got->gfx[y]);
+    }
+}
+
+// narrows a mismatch seen `cycles` after the last good state down to one
+// instruction -- keeps "matches after lo" and "differs after hi" true
+static void bisect(Reference *reference, Candidate *candidate, unsigned long long cycles)
+{
+    unsigned long long lo = 0, hi = cycles;
+
+    while (hi - lo > 1)
+    {
+        unsigned long long mid = lo + (hi - lo) / 2;
+        replayFromGood(reference, candidate, mid);
+        if (compareLanes(reference, candidate, 1) < 0)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    // the instruction the reference ran last is the one they disagree on
+    replayFromGood(reference, candidate, lo);
+    unsigned short pc[DIFF_MAX_LANES];
+    for (int lane = 0; lane < reference->lanes; lane++)
+        pc[lane] = reference->machines[lane].pc;
+
+    replayFromGood(reference, candidate, hi);
+    int lane = compareLanes(reference, candidate, 1);
+    if (lane < 0)
+    {
+        // only ever seen with the engine stopping where the checks fell
+        printf("  no longer diverges when run from cycle %llu without the checks in between\n", reference->goodCycle);
+        return;
+    }
+    const Chip8 *want = &reference->machines[lane];
+    unsigned short opcode = want->memory[pc[lane] & 0xFFF] << 8 | want->memory[(pc[lane] + 1) & 0xFFF];
+
+    printf("  lane %d diverged at cycle %llu (frame %llu): pc %03X opcode %04X\n", lane,
+        reference->goodCycle + hi, (reference->goodCycle + hi - 1) / instructionsPerFrame, pc[lane], opcode);
+    printDifferences(want, candidateLane(candidate, lane));
+}
+
+// 0 if the engine matched the reference all the way, 1 if not, -1 if it couldn't run
+static int checkRom(const char *name, const unsigned char *rom, size_t size, int quirks, int engine,
+    int lanes, unsigned long long cycles, unsigned long long interval, int sweep)
+{
+    static Reference reference;
+    static Candidate candidate;
+
+    if (candidateCreate(&candidate, engine, lanes) != 0)
+    {
+        printf("%-12s %-6s could not set up the engine\n", name, engineNames[engine]);
+        candidateDestroy(&candidate);
+        return -1;
+    }
+
+    reference.lanes = lanes;
+    reference.goodCycle = 0;
+    for (int lane = 0; lane < lanes; lane++)
+    {
+        Chip8 *chip8 = &reference.machines[lane];
+        *chip8 = initialize();
+        seedRandom(chip8, seed + lane);
+        chip8->quirks = quirks;
+        loadGameFromMemory(chip8, rom, size);
+        saveState(chip8, reference.good[lane]);
+        reference.dirty[lane] = 0;
+    }
+    candidateLoad(&candidate, reference.good);
+
+    if (engine == ENGINE_AOT && !aotMatches(candidate.module, &reference.machines[0]))
+        printf("%-12s %-6s module not built from this ROM and quirks -- only checks interpretation\n", name, engineNames[engine]);
+
+    uint64_t start = schedulerNow();
+    uint64_t comparing = 0;
+    unsigned long long checks = 0;
+    unsigned long long cycle = 0;
+    int diverged = -1;
+
+    while (cycle < cycles && diverged < 0)
+    {
+        unsigned long long end = cycle + interval < cycles ? cycle + interval : cycles;
+        advance(&reference, &candidate, cycle, end);
+        cycle = end;
+
+        uint64_t compareStart = schedulerNow();
+        int full = ++checks % sweep == 0 || cycle == cycles;
+        diverged = compareLanes(&reference, &candidate, full);
+        if (full && diverged < 0)
+        {
+            for (int lane = 0; lane < lanes; lane++)
+                saveState(&reference.machines[lane], reference.good[lane]);
+            reference.goodCycle = cycle;
+        }
+        comparing += schedulerNow() - compareStart;
+    }
+
+    double seconds = (schedulerNow() - start) / 1e9;
+    if (diverged < 0)
+    {
+        printf("%-12s %-6s ok       %llu cycles x %d lanes, %llu checks in %.2fs (%.1f%% comparing)\n", name, engineNames[engine],
+            cycles, lanes, checks, seconds, seconds > 0 ? comparing / 1e7 / seconds : 0);
+    }
+    else
+    {
+        printf("%-12s %-6s DIVERGED between cycles %llu and %llu\n", name, engineNames[engine], reference.goodCycle, cycle);
+        bisect(&reference, &candidate, cycle - reference.goodCycle);
+    }
+
+    candidateDestroy(&candidate);
+    return diverged >= 0;
+}
+
+static void usage()
+{
+    printf("usage: diffcheck [-e engines] [-c cycles] [-l lanes] [-n interval] [-F sweep] [-i ipf]\n"
+           "                 [-s seed] [-Q quirks] [-A module] [rom ...]\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *engineList = "cores,jit,batch";
+    unsigned long long cycles = 1000000;
+    unsigned long long interval = 100;
+    int lanes = 4;
+    int sweep = 64;
+    int quirks = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "e:c:l:n:F:i:s:Q:A:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'e':
+                engineList = optarg;
+                break;
+            case 'c':
+                cycles = strtoull(optarg, NULL, 10);
+                break;
+            case 'l':
+                lanes = atoi(optarg);
+                break;
+            case 'n':
+                interval = strtoull(optarg, NULL, 10);
+                break;
+            case 'F':
+                sweep = atoi(optarg);
+                break;
+            case 'i':
+                instructionsPerFrame = atoi(optarg);
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            case 'Q':
+                quirks = quirksParse(optarg);
+                if (quirks < 0)
+                {
+                    printf("Unknown quirks: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'A':
+                aotPath = optarg;
+                break;
+            default:
+                usage();
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    if (lanes < 1 || lanes > DIFF_MAX_LANES || interval < 1 || sweep < 1 || instructionsPerFrame < 1)
+    {
+        usage();
+        return -1;
+    }
+
+    int engines[ENGINE_COUNT];
+    int engineCount = 0;
+    char list[256];
+    snprintf(list, sizeof(list), "%s", engineList);
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ","))
+    {
+        int engine = 0;
+        while (engine < ENGINE_COUNT && strcmp(name, engineNames[engine]) != 0)
+            engine++;
+        if (engine == ENGINE_COUNT || engineCount == ENGINE_COUNT)
+        {
+            printf("Unknown engine: %s (cores, jit, batch or aot)\n", name);
+            return -1;
+        }
+        if (engine == ENGINE_AOT && aotPath == NULL)
+        {
+            printf("The aot engine needs a module, -A\n");
+            return -1;
+        }
+        engines[engineCount++] = engine;
+    }
+
+    int failed = 0;
+    unsigned char rom[4096 - 512];
+
+    for (int e = 0; e < engineCount; e++)
+    {
+        if (optind == argc)
+        {
+            for (int i = 0; i < CORPUS_SIZE; i++)
+            {
+                size_t size = corpus[i].build(rom);
+                failed |= checkRom(corpus[i].name, rom, size, quirks, engines[e], lanes, cycles, interval, sweep) != 0;
+            }
+            continue;
+        }
+
+        for (int i = optind; i < argc; i++)
+        {
+            FILE *file = fopen(argv[i], "rb");
+            if (file == NULL)
+            {
+                printf("Could not open ROM %s\n", argv[i]);
+                return -1;
+            }
+            size_t size = fread(rom, 1, sizeof(rom), file);
+            fclose(file);
+
+            const char *name = strrchr(argv[i], '/') != NULL ? strrchr(argv[i], '/') + 1 : argv[i];
+            failed |= checkRom(name, rom, size, quirks, engines[e], lanes, cycles, interval, sweep) != 0;
+        }
+    }
+
+    return failed;
+}
@@ -0,0 +1,353 @@
+// State-space explorer -- forks a ROM at every input decision and runs the
+// branches on a pool of worker threads, skipping states already seen.
+//
+//  usage: explore [-t threads] [-d depth] [-f frames] [-i ipf] [-k keys] [-n states]
+//                 [-s seed] [-Q quirks] rom
+//
+// A decision comes every `frames` frames (default 10). The state is forked
+// once with no key held and once for each key in `keys` (hex digits, default
+// all 16), every fork is stepped `frames` frames through cow.h, and it is
+// kept only if no state with the same hash was seen before. Branches go
+// `depth` decisions deep (default 6), or the search stops keeping new
+// states once `states` unique ones were found (default 1000000).
+// Workers share one stack of unexpanded states, so the search runs roughly
+// depth first and only the branches still waiting are held in memory.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include "chip8.h"
+#include "cow.h"
+#include "scheduler.h"
+
+#define SEEN_SHARDS 64 // power of two
+
+// hashes of every state kept so far -- open addressing, one lock per shard
+typedef struct SeenShard {
+    pthread_mutex_t lock;
+    uint64_t *slots; // 0 is an empty slot
+    size_t capacity; // power of two
+    size_t count;
+} SeenShard;
+
+typedef struct Branch {
+    CowState *state;
+    int depth;
+} Branch;
+
+// unexpanded states -- workers wait here while others may still add some
+typedef struct Frontier {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Branch *items;
+    size_t count;
+    size_t capacity;
+    int busy; // workers expanding a state they popped
+} Frontier;
+
+static SeenShard seen[SEEN_SHARDS];
+static Frontier frontier;
+
+static int choices[17]; // key held for each branch, -1 for none
+static int choiceCount;
+static int maxDepth = 6;
+static int framesPerDecision = 10;
+static int instructionsPerFrame = SCHEDULER_DEFAULT_IPF;
+static unsigned long long maxStates = 1000000;
+
+static atomic_ullong steps;
+static atomic_ullong unique;
+static atomic_ullong duplicates;
+static atomic_int deepest;
+static atomic_size_t peakBytes;
+static atomic_long peakStates;
+
+static void seenInit()
+{
+    for (int i = 0; i < SEEN_SHARDS; i++)
+    {
+        pthread_mutex_init(&seen[i].lock, NULL);
+        seen[i].capacity = 1024;
+        seen[i].slots = calloc(seen[i].capacity, sizeof(uint64_t));
+    }
+}
+
+static void seenPut(SeenShard *shard, uint64_t hash)
+{
+    size_t mask = shard->capacity - 1;
+    size_t slot = (hash / SEEN_SHARDS) & mask;
+
+    while (shard->slots[slot] != 0)
+        slot = (slot + 1) & mask;
+    shard->slots[slot] = hash;
+}
+
+// 1 if the hash is new, and records it
+static int seenInsert(uint64_t hash)
+{
+    if (hash == 0)
+        hash = 1;
+
+    SeenShard *shard = &seen[hash & (SEEN_SHARDS - 1)];
+    int inserted = 1;
+
+    pthread_mutex_lock(&shard->lock);
+
+    size_t mask = shard->capacity - 1;
+    for (size_t slot = (hash / SEEN_SHARDS) & mask; shard->slots[slot] != 0; slot = (slot + 1) & mask)
+    {
+        if (shard->slots[slot] == hash)
+        {
+            inserted = 0;
+            break;
+        }
+    }
+
+    if (inserted)
+    {
+        // keep it at most half full
+        if ((shard->count + 1) * 2 > shard->capacity)
+        {
+            uint64_t *old = shard->slots;
+            size_t oldCapacity = shard->capacity;
+
+            shard->capacity *= 2;
+            shard->slots = calloc(shard->capacity, sizeof(uint64_t));
+            for (size_t i = 0; i < oldCapacity; i++)
+            {
+                if (old[i] != 0)
+                    seenPut(shard, old[i]);
+            }
+            free(old);
+        }
+
+        seenPut(shard, hash);
+        shard->count++;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    return inserted;
+}
+
+static void frontierPush(CowState *state, int depth)
+{
+    pthread_mutex_lock(&frontier.lock);
+    if (frontier.count == frontier.capacity)
+    {
+        frontier.capacity = frontier.capacity ? frontier.capacity * 2 : 256;
+        frontier.items = realloc(frontier.items, sizeof(Branch) * frontier.capacity);
+    }
+    frontier.items[frontier.count].state = state;
+    frontier.items[frontier.count].depth = depth;
+    frontier.count++;
+    pthread_cond_signal(&frontier.ready);
+    pthread_mutex_unlock(&frontier.lock);
+}
+
+// returns 0 once the frontier is empty with nobody left to add to it
+static int frontierPop(Branch *branch)
+{
+    int popped = 0;
+
+    pthread_mutex_lock(&frontier.lock);
+    while (frontier.count == 0 && frontier.busy > 0)
+        pthread_cond_wait(&frontier.ready, &frontier.lock);
+
+    if (frontier.count > 0)
+    {
+        *branch = frontier.items[--frontier.count];
+        frontier.busy++;
+        popped = 1;
+    }
+    else
+    {
+        // wake the other waiters so they see it too
+        pthread_cond_broadcast(&frontier.ready);
+    }
+    pthread_mutex_unlock(&frontier.lock);
+
+    return popped;
+}
+
+// a worker is done expanding what it popped
+static void frontierFinish()
+{
+    pthread_mutex_lock(&frontier.lock);
+    frontier.busy--;
+    if (frontier.busy == 0 && frontier.count == 0)
+        pthread_cond_broadcast(&frontier.ready);
+    pthread_mutex_unlock(&frontier.lock);
+}
+
+static void notePeak()
+{
+    size_t bytes = cowLiveBytes();
+    size_t peak = atomic_load(&peakBytes);
+    while (bytes > peak && !atomic_compare_exchange_weak(&peakBytes, &peak, bytes))
+        ;
+
+    long states = atomic_load(&cowLiveStates);
+    long peakCount = atomic_load(&peakStates);
+    while (states > peakCount && !atomic_compare_exchange_weak(&peakStates, &peakCount, states))
+        ;
+}
+
+static void *workerThread(void *unused)
+{
+    CowMachine *machine = cowMachineCreate();
+    Branch branch;
+
+    while (frontierPop(&branch))
+    {
+        for (int c = 0; c < choiceCount && branch.depth < maxDepth; c++)
+        {
+            unsigned char keys[16] = { 0 };
+            if (choices[c] >= 0)
+                keys[choices[c]] = 1;
+
+            CowState *child = cowFork(branch.state);
+            cowStep(machine, child, keys, framesPerDecision, instructionsPerFrame);
+            atomic_fetch_add(&steps, 1);
+
+            if (atomic_load(&unique) >= maxStates)
+            {
+                cowDiscard(child);
+            }
+            else if (seenInsert(child->hash))
+            {
+                atomic_fetch_add(&unique, 1);
+                int depth = atomic_load(&deepest);
+                while (branch.depth + 1 > depth && !atomic_compare_exchange_weak(&deepest, &depth, branch.depth + 1))
+                    ;
+                frontierPush(child, branch.depth + 1);
+            }
+            else
+            {
+                atomic_fetch_add(&duplicates, 1);
+                cowDiscard(child);
+            }
+        }
+
+        notePeak();
+        cowDiscard(branch.state);
+        frontierFinish();
+    }
+
+    cowMachineDestroy(machine);
+    return NULL;
+}
+
+static void usage()
+{
+    printf("usage: explore [-t threads] [-d depth] [-f frames] [-i ipf] [-k keys] [-n states]\n"
+           "               [-s seed] [-Q quirks] rom\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int workerCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *keys = "0123456789ABCDEF";
+    uint32_t seed = CHIP8_DEFAULT_SEED;
+    int quirks = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:d:f:i:k:n:s:Q:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                workerCount = atoi(optarg);
+                break;
+            case 'd':
+                maxDepth = atoi(optarg);
+                break;
+            case 'f':
+                framesPerDecision = atoi(optarg);
+                break;
+            case 'i':
+                instructionsPerFrame = atoi(optarg);
+                break;
+            case 'k':
+                keys = optarg;
+                break;
+            case 'n':
+                maxStates = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            case 'Q':
+                quirks = quirksParse(optarg);
+                if (quirks < 0)
+                {
+                    printf("Unknown quirks: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            default:
+                usage();
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    if (optind != argc - 1 || workerCount < 1 || maxDepth < 0 || framesPerDecision < 1 || instructionsPerFrame < 1)
+    {
+        usage();
+        return -1;
+    }
+
+    choices[choiceCount++] = -1;
+    for (const char *c = keys; *c != '\0'; c++)
+    {
+        if (!isxdigit((unsigned char)*c) || choiceCount == 17)
+        {
+            printf("Keys are up to 16 hex digits: %s\n", keys);
+            return -1;
+        }
+        choices[choiceCount++] = isdigit((unsigned char)*c) ? *c - '0' : toupper((unsigned char)*c) - 'A' + 10;
+    }
+
+    Chip8 chip8 = initialize();
+    seedRandom(&chip8, seed);
+    int result = loadGame(&chip8, argv[optind]);
+    if (result != ROM_OK)
+    {
+        printf("Could not load ROM %s: %s\n", argv[optind], romErrorString(result));
+        return -1;
+    }
+    chip8.quirks = quirks;
+
+    seenInit();
+    pthread_mutex_init(&frontier.lock, NULL);
+    pthread_cond_init(&frontier.ready, NULL);
+
+    CowState *root = cowCapture(&chip8);
+    seenInsert(root->hash);
+    atomic_store(&unique, 1);
+    frontierPush(root, 0);
+
+    pthread_t *threads = malloc(sizeof(pthread_t) * workerCount);
+    uint64_t start = schedulerNow();
+
+    for (int i = 0; i < workerCount; i++)
+        pthread_create(&threads[i], NULL, workerThread, NULL);
+    for (int i = 0; i < workerCount; i++)
+        pthread_join(threads[i], NULL);
+
+    double seconds = (schedulerNow() - start) / 1e9;
+    unsigned long long stepped = atomic_load(&steps);
+    long states = atomic_load(&peakStates);
+    size_t bytes = atomic_load(&peakBytes);
+
+    printf("%llu branches stepped in %.3fs on %d threads: %.0f states/s\n", stepped, seconds, workerCount, stepped / seconds);
+    printf("%llu unique states, %llu duplicates, %d decisions deep\n",
+        (unsigned long long)atomic_load(&unique), (unsigned long long)atomic_load(&duplicates), atomic_load(&deepest));
+    printf("peak: %ld states in %.2f MB copy-on-write, %.0f bytes each (%.2f MB as %zu byte copies)\n",
+        states, bytes / 1e6, states ? (double)bytes / states : 0, (double)states * CHIP8_STATE_SIZE / 1e6, CHIP8_STATE_SIZE);
+
+    return 0;
+}
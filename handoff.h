@@ -0,0 +1,233 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+
+/* Lock-free handoff between the CPU thread and the render/input thread
+
+    Frames go CPU -> renderer through a triple buffer: the producer always owns
+    one buffer, the consumer owns another, and the third sits in the middle
+    with a flag saying whether it holds a frame the consumer hasn't seen.
+    Either side swaps its buffer with the middle one in a single atomic
+    exchange, so neither ever waits and a frame is only visible once it has
+    been copied in completely.
+
+    Keys go renderer -> CPU through a single-producer single-consumer ring of
+    timestamped events. The CPU thread drains it between instruction batches,
+    so key changes always land on a cycle boundary it chooses.
+
+    Debugger commands go console -> CPU as text lines through the same kind
+    of ring, and are run by the CPU thread between frames.
+
+    A wall of machines (wall.c) hands over all of their displays at once
+    through a triple buffer of the same kind, where every buffer also says
+    which displays changed since the consumer last saw one. While the last
+    buffer handed over is still unread, its changes are carried into the
+    one that replaces it, so none are lost however many frames are
+    skipped.
+*/
+
+#define FRAME_FRESH 0x4
+
+typedef struct FrameTripleBuffer {
+    uint64_t rows[3][32];
+    // middle buffer index, | FRAME_FRESH when it holds an unseen frame
+    atomic_uint middle;
+    // owned by the producer / consumer respectively
+    unsigned int writeIndex;
+    unsigned int readIndex;
+} FrameTripleBuffer;
+
+void frameBufferInit(FrameTripleBuffer *frames)
+{
+    memset(frames->rows, 0, sizeof(frames->rows));
+    frames->writeIndex = 0;
+    atomic_init(&frames->middle, 1);
+    frames->readIndex = 2;
+}
+
+// producer -- copies a finished display into the buffer and hands it over
+void framePublish(FrameTripleBuffer *frames, const uint64_t *gfx)
+{
+    memcpy(frames->rows[frames->writeIndex], gfx, sizeof(frames->rows[0]));
+    frames->writeIndex = atomic_exchange_explicit(&frames->middle, frames->writeIndex | FRAME_FRESH, memory_order_acq_rel) & 0x3;
+}
+
+// consumer -- returns the newest frame, or NULL when nothing new was published
+const uint64_t *frameAcquire(FrameTripleBuffer *frames)
+{
+    if ((atomic_load_explicit(&frames->middle, memory_order_relaxed) & FRAME_FRESH) == 0)
+        return NULL;
+
+    frames->readIndex = atomic_exchange_explicit(&frames->middle, frames->readIndex, memory_order_acq_rel) & 0x3;
+    return frames->rows[frames->readIndex];
+}
+
+typedef struct WallFrames {
+    int tiles;
+    uint64_t *rows[3];  // tiles displays of 32 rows each
+    uint64_t *dirty[3]; // one bit per display changed since the consumer's last frame
+    uint64_t *carry;    // producer only: the dirty bits it handed over last
+    atomic_uint middle;
+    unsigned int writeIndex;
+    unsigned int readIndex;
+} WallFrames;
+
+#define WALL_DIRTY_WORDS(tiles) (((tiles) + 63) / 64)
+
+void wallFramesInit(WallFrames *frames, int tiles)
+{
+    frames->tiles = tiles;
+    for (int i = 0; i < 3; i++)
+    {
+        frames->rows[i] = calloc((size_t)tiles * 32, sizeof(uint64_t));
+        frames->dirty[i] = calloc(WALL_DIRTY_WORDS(tiles), sizeof(uint64_t));
+    }
+    frames->carry = calloc(WALL_DIRTY_WORDS(tiles), sizeof(uint64_t));
+    frames->writeIndex = 0;
+    atomic_init(&frames->middle, 1);
+    frames->readIndex = 2;
+}
+
+void wallFramesDestroy(WallFrames *frames)
+{
+    for (int i = 0; i < 3; i++)
+    {
+        free(frames->rows[i]);
+        free(frames->dirty[i]);
+    }
+    free(frames->carry);
+}
+
+// producer -- every tile is set before each publish, since the buffer it
+// writes may be two frames old; only changed ones are marked dirty
+void wallFrameSet(WallFrames *frames, int tile, const uint64_t *gfx, int changed)
+{
+    memcpy(frames->rows[frames->writeIndex] + tile * 32, gfx, 32 * sizeof(uint64_t));
+    if (changed)
+        frames->dirty[frames->writeIndex][tile / 64] |= 1ULL << (tile % 64);
+}
+
+// producer -- hands the buffer over, with the dirty bits of the last one
+// if the consumer hasn't taken that yet. It can't take it again once it
+// has, so at worst it grabs it in between and redraws a few tiles twice.
+// The buffer that comes back starts clean either way.
+void wallFramePublish(WallFrames *frames)
+{
+    size_t words = WALL_DIRTY_WORDS(frames->tiles);
+    uint64_t *dirty = frames->dirty[frames->writeIndex];
+
+    if (atomic_load_explicit(&frames->middle, memory_order_relaxed) & FRAME_FRESH)
+    {
+        for (size_t i = 0; i < words; i++)
+            dirty[i] |= frames->carry[i];
+    }
+    memcpy(frames->carry, dirty, words * sizeof(uint64_t));
+
+    unsigned int old = atomic_exchange_explicit(&frames->middle, frames->writeIndex | FRAME_FRESH, memory_order_acq_rel);
+    frames->writeIndex = old & 0x3;
+    memset(frames->dirty[frames->writeIndex], 0, words * sizeof(uint64_t));
+}
+
+// consumer -- returns the index of the newest buffer for rows[] and
+// dirty[], or -1 when nothing new was published
+int wallFrameAcquire(WallFrames *frames)
+{
+    if ((atomic_load_explicit(&frames->middle, memory_order_relaxed) & FRAME_FRESH) == 0)
+        return -1;
+
+    frames->readIndex = atomic_exchange_explicit(&frames->middle, frames->readIndex, memory_order_acq_rel) & 0x3;
+    return (int)frames->readIndex;
+}
+
+#define KEY_QUEUE_SIZE 256 // power of two
+
+typedef struct KeyEvent {
+    uint32_t timestamp; // host milliseconds when the key changed
+    unsigned char key;
+    unsigned char pressed;
+} KeyEvent;
+
+typedef struct KeyQueue {
+    KeyEvent events[KEY_QUEUE_SIZE];
+    atomic_uint head; // next slot to write, producer only
+    atomic_uint tail; // next slot to read, consumer only
+} KeyQueue;
+
+void keyQueueInit(KeyQueue *queue)
+{
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+}
+
+// producer -- returns 0 if the queue is full and the event was dropped
+int keyQueuePush(KeyQueue *queue, KeyEvent event)
+{
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&queue->tail, memory_order_acquire) == KEY_QUEUE_SIZE)
+        return 0;
+
+    queue->events[head & (KEY_QUEUE_SIZE - 1)] = event;
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return 1;
+}
+
+// consumer -- returns 0 when there is nothing to read
+int keyQueuePop(KeyQueue *queue, KeyEvent *event)
+{
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    if (tail == atomic_load_explicit(&queue->head, memory_order_acquire))
+        return 0;
+
+    *event = queue->events[tail & (KEY_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+#define COMMAND_QUEUE_SIZE 16 // power of two
+#define COMMAND_LENGTH 128
+
+typedef struct CommandQueue {
+    char lines[COMMAND_QUEUE_SIZE][COMMAND_LENGTH];
+    atomic_uint head; // next slot to write, producer only
+    atomic_uint tail; // next slot to read, consumer only
+} CommandQueue;
+
+void commandQueueInit(CommandQueue *queue)
+{
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+}
+
+// producer -- returns 0 if the queue is full and the line was dropped; long lines are cut short
+int commandQueuePush(CommandQueue *queue, const char *line)
+{
+    unsigned int head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&queue->tail, memory_order_acquire) == COMMAND_QUEUE_SIZE)
+        return 0;
+
+    snprintf(queue->lines[head & (COMMAND_QUEUE_SIZE - 1)], COMMAND_LENGTH, "%s", line);
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return 1;
+}
+
+// consumer -- copies the oldest line into line (COMMAND_LENGTH bytes), returns 0 when there is none
+int commandQueuePop(CommandQueue *queue, char *line)
+{
+    unsigned int tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+
+    if (tail == atomic_load_explicit(&queue->head, memory_order_acquire))
+        return 0;
+
+    memcpy(line, queue->lines[tail & (COMMAND_QUEUE_SIZE - 1)], COMMAND_LENGTH);
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,570 @@
+#ifndef JIT_H
+#define JIT_H
+#include <stddef.h>
+#include <string.h>
+#include "chip8.h"
+
+/* x86-64 basic-block recompiler
+
+    A block is a straight-line run of ALU / load-immediate / I opcodes starting
+    at some pc, optionally closed by one 1NNN, 3XNN, 4XNN, 5XY0 or 9XY0 that
+    decides the next pc. Inside a block every V register it touches and I live
+    in host registers and pc is a constant; state is written back on exit.
+    Anything else (calls, draws, keys, timers, memory access, ...) is left to
+    emulateCycle().
+
+    Host registers: rdi = Chip8 *, rax = scratch, r11 = I, the V registers
+    get rcx, rdx, rsi, r8 - r10, then the callee saved rbx, rbp, r12 - r15.
+
+    FX33 and FX55 are always interpreted, so after running one we know exactly
+    which bytes were written and drop any block that covers them.
+
+    Blocks are compiled for the quirks the machine has at the time, so a
+    machine whose chip8->quirks change needs a fresh Chip8Jit.
+*/
+
+#define JIT_CODE_SIZE (1 << 20)
+#define JIT_MAX_BLOCK 64
+
+enum {
+    JIT_UNTRANSLATED = 0,
+    JIT_COMPILED,
+    JIT_INTERPRET // first opcode can't be compiled -- emulateCycle() it
+};
+
+typedef int (*JitBlockFn)(Chip8 *chip8);
+
+typedef struct JitBlock {
+    JitBlockFn fn;
+    unsigned short length; // instructions executed per call
+    unsigned short bytes;  // memory covered, terminator included
+    unsigned char state;
+} JitBlock;
+
+typedef struct Chip8Jit {
+    unsigned char *code;
+    size_t codeUsed;
+    JitBlock blocks[4096];
+    // number of blocks reading each byte of memory
+    unsigned char covered[4096];
+    unsigned long long compiled;
+    unsigned long long invalidated;
+} Chip8Jit;
+
+#if defined(__x86_64__) && defined(__unix__)
+#define CHIP8_JIT_AVAILABLE
+#include <sys/mman.h>
+
+static const unsigned char jitHostRegs[12] = { 1, 2, 6, 8, 9, 10, 3, 5, 12, 13, 14, 15 };
+
+typedef struct JitEmitter {
+    unsigned char *out;
+    size_t used;
+    size_t limit;
+} JitEmitter;
+
+static void jitEmit8(JitEmitter *e, unsigned char byte)
+{
+    if (e->used < e->limit)
+        e->out[e->used] = byte;
+    e->used++;
+}
+
+static void jitEmit32(JitEmitter *e, unsigned int value)
+{
+    for (int i = 0; i < 4; i++)
+        jitEmit8(e, (value >> (i * 8)) & 0xFF);
+}
+
+// a REX prefix is always emitted on byte ops so host regs 4 - 7 mean spl/bpl/sil/dil
+static void jitRex(JitEmitter *e, int reg, int rm)
+{
+    jitEmit8(e, 0x40 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+// movzx host32, byte [rdi + disp]
+static void jitLoadByte(JitEmitter *e, int host, int disp)
+{
+    jitRex(e, host, 0);
+    jitEmit8(e, 0x0F);
+    jitEmit8(e, 0xB6);
+    jitEmit8(e, 0x80 | ((host & 7) << 3) | 7);
+    jitEmit32(e, disp);
+}
+
+// mov byte [rdi + disp], host8
+static void jitStoreByte(JitEmitter *e, int host, int disp)
+{
+    jitRex(e, host, 0);
+    jitEmit8(e, 0x88);
+    jitEmit8(e, 0x80 | ((host & 7) << 3) | 7);
+    jitEmit32(e, disp);
+}
+
+// <op> dst8, src8 -- op is the r/m8, r8 form (mov 0x88, or 0x08, and 0x20, ...)
+static void jitAlu(JitEmitter *e, unsigned char op, int dst, int src)
+{
+    jitRex(e, src, dst);
+    jitEmit8(e, op);
+    jitEmit8(e, 0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+// group opcode with a /digit on a byte register (add/cmp imm8, shl/shr by 1, setcc)
+static void jitGroup(JitEmitter *e, unsigned char op, int digit, int host)
+{
+    jitRex(e, 0, host);
+    if (op >= 0x90 && op <= 0x9F)
+        jitEmit8(e, 0x0F);
+    jitEmit8(e, op);
+    jitEmit8(e, 0xC0 | (digit << 3) | (host & 7));
+}
+
+static void jitPush(JitEmitter *e, int host, int pop)
+{
+    if (host >= 8)
+        jitEmit8(e, 0x41);
+    jitEmit8(e, (pop ? 0x58 : 0x50) + (host & 7));
+}
+
+// only the opcodes the emitter below knows -- 0 no, 1 straight-line, 2 block terminator
+static int jitClassify(unsigned short opcode, unsigned char quirks)
+{
+    int x = (opcode & 0x0F00) >> 8;
+    int y = (opcode & 0x00F0) >> 4;
+
+    switch (opcode & 0xF000)
+    {
+        case 0x1000:
+        case 0x3000:
+        case 0x4000:
+        case 0x5000:
+        case 0x9000:
+            return 2;
+        case 0x6000:
+        case 0x7000:
+        case 0xA000:
+            return 1;
+        case 0x8000:
+            switch (opcode & 0x000F)
+            {
+                case 0x0:
+                case 0x1:
+                case 0x2:
+                case 0x3:
+                    return 1;
+                // flag writers -- only when neither operand is VF itself
+                case 0x4:
+                case 0x5:
+                case 0x7:
+                    return x != 0xF && y != 0xF;
+                // the emitter only shifts VX in place
+                case 0x6:
+                case 0xE:
+                    return x != 0xF && y != 0xF && !(quirks & QUIRK_SHIFT_VY);
+            }
+            return 0;
+        case 0xF000:
+            return (opcode & 0x00FF) == 0x1E;
+    }
+
+    return 0;
+}
+
+// V registers an opcode touches, as a bitmask (VF for the flag writers)
+static unsigned int jitRegsUsed(unsigned short opcode)
+{
+    int x = (opcode & 0x0F00) >> 8;
+    int y = (opcode & 0x00F0) >> 4;
+
+    switch (opcode & 0xF000)
+    {
+        case 0x3000:
+        case 0x4000:
+        case 0x6000:
+        case 0x7000:
+        case 0xF000:
+            return 1u << x;
+        case 0x5000:
+        case 0x9000:
+            return (1u << x) | (1u << y);
+        case 0x8000:
+            if ((opcode & 0x000F) >= 0x4)
+                return (1u << x) | (1u << y) | (1u << 0xF);
+            return (1u << x) | (1u << y);
+    }
+
+    return 0;
+}
+
+Chip8Jit *jitCreate()
+{
+    Chip8Jit *jit = calloc(1, sizeof(Chip8Jit));
+    if (jit == NULL)
+        return NULL;
+
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED)
+    {
+        free(jit);
+        return NULL;
+    }
+
+    return jit;
+}
+
+void jitDestroy(Chip8Jit *jit)
+{
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit);
+}
+
+// forgets every block -- used when the code buffer fills up
+static void jitFlush(Chip8Jit *jit)
+{
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->covered, 0, sizeof(jit->covered));
+    jit->codeUsed = 0;
+}
+
+static void jitMark(Chip8Jit *jit, unsigned short start, int bytes, int delta)
+{
+    for (int i = 0; i < bytes; i++)
+        jit->covered[(start + i) & 0xFFF] += delta;
+}
+
+// drops every block reading any byte of memory[addr, addr + length)
+void jitInvalidate(Chip8Jit *jit, unsigned short addr, int length)
+{
+    for (int i = 0; i < length; i++)
+    {
+        int written = (addr + i) & 0xFFF;
+        if (jit->covered[written] == 0)
+            continue;
+
+        // blocks are at most 2 * JIT_MAX_BLOCK bytes long so only look that far back
+        for (int back = 0; back < 2 * JIT_MAX_BLOCK && jit->covered[written] > 0; back++)
+        {
+            int start = written - back;
+            if (start < 0)
+                break;
+
+            JitBlock *block = &jit->blocks[start];
+            if (block->state != JIT_UNTRANSLATED && start + block->bytes > written)
+            {
+                jitMark(jit, start, block->bytes, -1);
+                block->state = JIT_UNTRANSLATED;
+                jit->invalidated++;
+            }
+        }
+    }
+}
+
+static void jitCompile(Chip8Jit *jit, Chip8 *chip8, unsigned short start)
+{
+    unsigned short opcodes[JIT_MAX_BLOCK];
+    int length = 0;
+    int terminated = 0;
+    unsigned int used = 0;
+
+    // find the block: stop before anything unsupported, at a terminator, or
+    // when it would need more V registers than there are host registers
+    while (length < JIT_MAX_BLOCK && start + length * 2 + 1 <= 0xFFF)
+    {
+        unsigned short pc = start + length * 2;
+        unsigned short opcode = chip8->memory[pc] << 8 | chip8->memory[pc + 1];
+        int kind = jitClassify(opcode, chip8->quirks);
+
+        if (kind == 0 || __builtin_popcount(used | jitRegsUsed(opcode)) > 12)
+            break;
+
+        used |= jitRegsUsed(opcode);
+        opcodes[length++] = opcode;
+
+        if (kind == 2)
+        {
+            terminated = 1;
+            break;
+        }
+    }
+
+    JitBlock *block = &jit->blocks[start];
+
+    if (length == 0)
+    {
+        block->state = JIT_INTERPRET;
+        block->bytes = 2;
+        jitMark(jit, start, 2, 1);
+        return;
+    }
+
+    // assign host registers in V order
+    signed char host[16];
+    int allocated = 0;
+    for (int i = 0; i < 16; i++)
+        host[i] = (used & (1u << i)) ? jitHostRegs[allocated++] : -1;
+
+    JitEmitter e = { jit->code + jit->codeUsed, 0, JIT_CODE_SIZE - jit->codeUsed };
+    int offsetV = offsetof(Chip8, V);
+    int offsetI = offsetof(Chip8, I);
+    int offsetPc = offsetof(Chip8, pc);
+    unsigned int dirty = 0;
+    int usesI = 0, dirtyI = 0;
+
+    for (int i = 0; i < length; i++)
+    {
+        if ((opcodes[i] & 0xF0FF) == 0xF01E)
+            usesI = 1;
+        if ((opcodes[i] & 0xF000) == 0xA000)
+            break;
+    }
+
+    // prologue
+    for (int i = 6; i < allocated; i++)
+        jitPush(&e, jitHostRegs[i], 0);
+    for (int i = 0; i < 16; i++)
+    {
+        if (host[i] != -1)
+            jitLoadByte(&e, host[i], offsetV + i);
+    }
+    if (usesI)
+    {
+        // movzx r11d, word [rdi + I]
+        jitEmit8(&e, 0x44);
+        jitEmit8(&e, 0x0F);
+        jitEmit8(&e, 0xB7);
+        jitEmit8(&e, 0x80 | (3 << 3) | 7);
+        jitEmit32(&e, offsetI);
+    }
+
+    int body = terminated ? length - 1 : length;
+    for (int i = 0; i < body; i++)
+    {
+        unsigned short opcode = opcodes[i];
+        int x = (opcode & 0x0F00) >> 8;
+        int y = (opcode & 0x00F0) >> 4;
+        int vx = host[x], vy = host[y], vf = host[0xF];
+
+        switch (opcode & 0xF000)
+        {
+            case 0x6000: // mov vx8, imm8
+                jitRex(&e, 0, vx);
+                jitEmit8(&e, 0xB0 + (vx & 7));
+                jitEmit8(&e, opcode & 0xFF);
+                dirty |= 1u << x;
+                break;
+            case 0x7000: // add vx8, imm8
+                jitGroup(&e, 0x80, 0, vx);
+                jitEmit8(&e, opcode & 0xFF);
+                dirty |= 1u << x;
+                break;
+            case 0xA000: // mov r11d, imm32
+                jitEmit8(&e, 0x41);
+                jitEmit8(&e, 0xBB);
+                jitEmit32(&e, opcode & 0x0FFF);
+                dirtyI = 1;
+                break;
+            case 0xF000: // movzx eax, vx8 / add r11d, eax
+                jitRex(&e, 0, vx);
+                jitEmit8(&e, 0x0F);
+                jitEmit8(&e, 0xB6);
+                jitEmit8(&e, 0xC0 | (vx & 7));
+                jitEmit8(&e, 0x41);
+                jitEmit8(&e, 0x01);
+                jitEmit8(&e, 0xC0 | 3);
+                dirtyI = 1;
+                break;
+            case 0x8000:
+                dirty |= 1u << x;
+                switch (opcode & 0x000F)
+                {
+                    case 0x0: jitAlu(&e, 0x88, vx, vy); break;
+                    case 0x1: jitAlu(&e, 0x08, vx, vy); break;
+                    case 0x2: jitAlu(&e, 0x20, vx, vy); break;
+                    case 0x3: jitAlu(&e, 0x30, vx, vy); break;
+                    case 0x4: // add / setc
+                        jitAlu(&e, 0x00, vx, vy);
+                        jitGroup(&e, 0x92, 0, vf);
+                        break;
+                    case 0x5: // sub / setnc
+                        jitAlu(&e, 0x28, vx, vy);
+                        jitGroup(&e, 0x93, 0, vf);
+                        break;
+                    case 0x6: // shr 1 / setc
+                        jitGroup(&e, 0xD0, 5, vx);
+                        jitGroup(&e, 0x92, 0, vf);
+                        break;
+                    case 0x7: // al = vy - vx / setnc / vx = al
+                        jitAlu(&e, 0x88, 0, vy);
+                        jitAlu(&e, 0x28, 0, vx);
+                        jitGroup(&e, 0x93, 0, vf);
+                        jitAlu(&e, 0x88, vx, 0);
+                        break;
+                    case 0xE: // shl 1 / setc
+                        jitGroup(&e, 0xD0, 4, vx);
+                        jitGroup(&e, 0x92, 0, vf);
+                        break;
+                }
+                if ((opcode & 0x000F) >= 0x4)
+                    dirty |= 1u << 0xF;
+                break;
+        }
+    }
+
+    // write back -- stores leave the flags and host registers alone
+    for (int i = 0; i < 16; i++)
+    {
+        if (dirty & (1u << i))
+            jitStoreByte(&e, host[i], offsetV + i);
+    }
+    if (dirtyI)
+    {
+        // mov word [rdi + I], r11w
+        jitEmit8(&e, 0x66);
+        jitEmit8(&e, 0x44);
+        jitEmit8(&e, 0x89);
+        jitEmit8(&e, 0x80 | (3 << 3) | 7);
+        jitEmit32(&e, offsetI);
+    }
+
+    unsigned short lastPc = start + (length - 1) * 2;
+    unsigned short last = opcodes[length - 1];
+
+    if (terminated && (last & 0xF000) != 0x1000)
+    {
+        int x = (last & 0x0F00) >> 8;
+        int y = (last & 0x00F0) >> 4;
+        unsigned char cmov;
+
+        if ((last & 0xF000) == 0x3000 || (last & 0xF000) == 0x4000)
+        {
+            // cmp vx8, imm8
+            jitGroup(&e, 0x80, 7, host[x]);
+            jitEmit8(&e, last & 0xFF);
+        }
+        else
+        {
+            // cmp vx8, vy8
+            jitAlu(&e, 0x38, host[x], host[y]);
+        }
+        cmov = ((last & 0xF000) == 0x3000 || (last & 0xF000) == 0x5000) ? 0x44 : 0x45;
+
+        // mov eax, not taken / mov r11d, taken / cmovcc eax, r11d / mov word [rdi + pc], ax
+        jitEmit8(&e, 0xB8);
+        jitEmit32(&e, lastPc + 2);
+        jitEmit8(&e, 0x41);
+        jitEmit8(&e, 0xBB);
+        jitEmit32(&e, lastPc + 4);
+        jitEmit8(&e, 0x41);
+        jitEmit8(&e, 0x0F);
+        jitEmit8(&e, cmov);
+        jitEmit8(&e, 0xC0 | 3);
+        jitEmit8(&e, 0x66);
+        jitEmit8(&e, 0x89);
+        jitEmit8(&e, 0x80 | 7);
+        jitEmit32(&e, offsetPc);
+    }
+    else
+    {
+        // mov word [rdi + pc], imm16
+        unsigned short next = terminated ? (last & 0x0FFF) : lastPc + 2;
+        jitEmit8(&e, 0x66);
+        jitEmit8(&e, 0xC7);
+        jitEmit8(&e, 0x80 | 7);
+        jitEmit32(&e, offsetPc);
+        jitEmit8(&e, next & 0xFF);
+        jitEmit8(&e, next >> 8);
+    }
+
+    // epilogue -- return the instruction count
+    for (int i = allocated - 1; i >= 6; i--)
+        jitPush(&e, jitHostRegs[i], 1);
+    jitEmit8(&e, 0xB8);
+    jitEmit32(&e, length);
+    jitEmit8(&e, 0xC3);
+
+    if (e.used > e.limit)
+    {
+        // out of code space -- start over and retry into the empty buffer
+        jitFlush(jit);
+        jitCompile(jit, chip8, start);
+        return;
+    }
+
+    block->fn = (JitBlockFn)(void *)(jit->code + jit->codeUsed);
+    block->length = length;
+    block->bytes = length * 2;
+    block->state = JIT_COMPILED;
+    jit->codeUsed += (e.used + 15) & ~(size_t)15;
+    jit->compiled++;
+    jitMark(jit, start, block->bytes, 1);
+}
+
+// Runs exactly `cycles` instructions -- compiled blocks where possible,
+// emulateCycle() for the rest -- and returns how many were executed.
+unsigned long runCyclesJit(Chip8Jit *jit, Chip8 *chip8, unsigned long cycles)
+{
+    unsigned long done = 0;
+
+    while (done < cycles)
+    {
+        unsigned short pc = chip8->pc;
+        JitBlock *block = &jit->blocks[pc & 0xFFF];
+
+        if (pc < 0x1000 && block->state == JIT_UNTRANSLATED)
+            jitCompile(jit, chip8, pc);
+
+        if (pc < 0x1000 && block->state == JIT_COMPILED && block->length <= cycles - done)
+        {
+            unsigned long length = block->fn(chip8);
+            done += length;
+            chip8->cycles += length;
+        }
+        else if (waitingForKey(chip8))
+        {
+            // blocked on FX0A for the rest of the call, see runCycles()
+            chip8->cycles += cycles - done;
+            chip8->idleCycles += cycles - done;
+            done = cycles;
+        }
+        else
+        {
+            unsigned short I = chip8->I;
+            emulateCycle(chip8);
+            done++;
+
+            // self-modifying code -- the only memory writers are never compiled
+            if ((chip8->opcode & 0xF0FF) == 0xF033)
+                jitInvalidate(jit, I, 3);
+            else if ((chip8->opcode & 0xF0FF) == 0xF055)
+                jitInvalidate(jit, I, ((chip8->opcode & 0x0F00) >> 8) + 1);
+        }
+    }
+
+    return done;
+}
+
+#else
+
+// no recompiler on this host -- same API on top of the interpreter
+Chip8Jit *jitCreate()
+{
+    return calloc(1, sizeof(Chip8Jit));
+}
+
+void jitDestroy(Chip8Jit *jit)
+{
+    free(jit);
+}
+
+void jitInvalidate(Chip8Jit *jit, unsigned short addr, int length)
+{
+}
+
+unsigned long runCyclesJit(Chip8Jit *jit, Chip8 *chip8, unsigned long cycles)
+{
+    return runCycles(chip8, cycles);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,706 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "chip8.h"
+
+/* Structure-of-arrays lockstep engine
+
+    Runs many copies of a machine side by side -- typically one ROM with a
+    different input stream per lane. Every field is an array across lanes
+    (V[reg * lanes + lane], pc[lane], ...) so one decoded opcode can be
+    applied to all lanes sitting on the same pc at once, with the ALU work
+    done BATCH_WIDTH lanes per instruction (AVX2: 32, SSE2: 16, scalar: 1).
+
+    Each cycle lanes are grouped by pc: the first unstepped lane's opcode is
+    decoded, every lane on the same pc joins its group through a 0x00 / 0xFF
+    byte mask, and the group executes. Lanes only need their own opcode
+    fetched when some lane has written to that address (FX33 / FX55), since
+    until then all lanes share the same code. After BATCH_MAX_GROUPS groups
+    the stragglers are stepped one at a time.
+
+    Semantics follow emulateCycle(); see batchGetLane() / batchSetLane() to
+    move lanes in and out of plain Chip8 structs. Quirks are per batch, not
+    per lane -- set batch->quirks, or load lanes from machines that agree.
+*/
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BATCH_WIDTH 32
+typedef __m256i BatchVec;
+static inline BatchVec vecLoad(const unsigned char *p) { return _mm256_loadu_si256((const __m256i *)p); }
+static inline void vecStore(unsigned char *p, BatchVec v) { _mm256_storeu_si256((__m256i *)p, v); }
+static inline BatchVec vecSet1(unsigned char value) { return _mm256_set1_epi8((char)value); }
+static inline BatchVec vecAdd(BatchVec a, BatchVec b) { return _mm256_add_epi8(a, b); }
+static inline BatchVec vecSub(BatchVec a, BatchVec b) { return _mm256_sub_epi8(a, b); }
+static inline BatchVec vecOr(BatchVec a, BatchVec b) { return _mm256_or_si256(a, b); }
+static inline BatchVec vecAnd(BatchVec a, BatchVec b) { return _mm256_and_si256(a, b); }
+static inline BatchVec vecXor(BatchVec a, BatchVec b) { return _mm256_xor_si256(a, b); }
+static inline BatchVec vecMax(BatchVec a, BatchVec b) { return _mm256_max_epu8(a, b); }
+static inline BatchVec vecEq(BatchVec a, BatchVec b) { return _mm256_cmpeq_epi8(a, b); }
+static inline BatchVec vecShr1(BatchVec a) { return _mm256_and_si256(_mm256_srli_epi16(a, 1), _mm256_set1_epi8(0x7F)); }
+static inline BatchVec vecShr7(BatchVec a) { return _mm256_and_si256(_mm256_srli_epi16(a, 7), _mm256_set1_epi8(0x01)); }
+// picks b where mask is 0xFF, a where it is 0x00
+static inline BatchVec vecBlend(BatchVec a, BatchVec b, BatchVec mask) { return _mm256_blendv_epi8(a, b, mask); }
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define BATCH_WIDTH 16
+typedef __m128i BatchVec;
+static inline BatchVec vecLoad(const unsigned char *p) { return _mm_loadu_si128((const __m128i *)p); }
+static inline void vecStore(unsigned char *p, BatchVec v) { _mm_storeu_si128((__m128i *)p, v); }
+static inline BatchVec vecSet1(unsigned char value) { return _mm_set1_epi8((char)value); }
+static inline BatchVec vecAdd(BatchVec a, BatchVec b) { return _mm_add_epi8(a, b); }
+static inline BatchVec vecSub(BatchVec a, BatchVec b) { return _mm_sub_epi8(a, b); }
+static inline BatchVec vecOr(BatchVec a, BatchVec b) { return _mm_or_si128(a, b); }
+static inline BatchVec vecAnd(BatchVec a, BatchVec b) { return _mm_and_si128(a, b); }
+static inline BatchVec vecXor(BatchVec a, BatchVec b) { return _mm_xor_si128(a, b); }
+static inline BatchVec vecMax(BatchVec a, BatchVec b) { return _mm_max_epu8(a, b); }
+static inline BatchVec vecEq(BatchVec a, BatchVec b) { return _mm_cmpeq_epi8(a, b); }
+static inline BatchVec vecShr1(BatchVec a) { return _mm_and_si128(_mm_srli_epi16(a, 1), _mm_set1_epi8(0x7F)); }
+static inline BatchVec vecShr7(BatchVec a) { return _mm_and_si128(_mm_srli_epi16(a, 7), _mm_set1_epi8(0x01)); }
+static inline BatchVec vecBlend(BatchVec a, BatchVec b, BatchVec mask) { return _mm_or_si128(_mm_and_si128(mask, b), _mm_andnot_si128(mask, a)); }
+#else
+#define BATCH_WIDTH 1
+typedef unsigned char BatchVec;
+static inline BatchVec vecLoad(const unsigned char *p) { return *p; }
+static inline void vecStore(unsigned char *p, BatchVec v) { *p = v; }
+static inline BatchVec vecSet1(unsigned char value) { return value; }
+static inline BatchVec vecAdd(BatchVec a, BatchVec b) { return a + b; }
+static inline BatchVec vecSub(BatchVec a, BatchVec b) { return a - b; }
+static inline BatchVec vecOr(BatchVec a, BatchVec b) { return a | b; }
+static inline BatchVec vecAnd(BatchVec a, BatchVec b) { return a & b; }
+static inline BatchVec vecXor(BatchVec a, BatchVec b) { return a ^ b; }
+static inline BatchVec vecMax(BatchVec a, BatchVec b) { return a > b ? a : b; }
+static inline BatchVec vecEq(BatchVec a, BatchVec b) { return a == b ? 0xFF : 0x00; }
+static inline BatchVec vecShr1(BatchVec a) { return a >> 1; }
+static inline BatchVec vecShr7(BatchVec a) { return a >> 7; }
+static inline BatchVec vecBlend(BatchVec a, BatchVec b, BatchVec mask) { return (mask & b) | (~mask & a); }
+#endif
+
+// the masked lane loops below are written for the auto-vectorizer; GCC only
+// runs it with a cost model that accepts them from -O3, so ask for it here
+#if defined(__GNUC__) && !defined(__clang__)
+#define BATCH_VECTORIZE __attribute__((optimize("tree-vectorize", "vect-cost-model=dynamic")))
+#else
+#define BATCH_VECTORIZE
+#endif
+
+// lane arrays are padded to this so vector loops never need a tail
+#define BATCH_ALIGN 32
+#define BATCH_MAX_GROUPS 4
+
+typedef struct Chip8Batch {
+    int count; // live lanes
+    int lanes; // count rounded up to BATCH_ALIGN -- the stride of every array
+
+    unsigned char *V;           // V[reg * lanes + lane]
+    unsigned short *I;
+    unsigned short *pc;
+    unsigned short *sp;
+    unsigned short *stack;      // stack[level * lanes + lane]
+    unsigned char *delayTimer;
+    unsigned char *soundTimer;
+    unsigned char *drawFlag;
+    unsigned short *keys;       // bit k set when key k is down
+    unsigned short *savedKeys;  // FX0A snapshot
+    unsigned char *inputBlocking;
+    uint64_t *cycles;
+    uint32_t *rngState;
+    unsigned char *memory;      // memory[lane * 4096 + addr]
+    uint64_t *gfx;              // gfx[lane * 32 + row]
+    unsigned char quirks;       // QUIRK_* bits, the same for every lane
+
+    // addresses some lane has written -- only there can opcodes differ between lanes
+    unsigned char written[4096];
+
+    // per cycle scratch
+    unsigned char *mask;
+    unsigned char *stepped;
+
+    unsigned long long groups;  // vector groups executed
+    unsigned long long singles; // lanes stepped one at a time after BATCH_MAX_GROUPS
+} Chip8Batch;
+
+void batchDestroy(Chip8Batch *batch)
+{
+    free(batch->V);
+    free(batch->I);
+    free(batch->pc);
+    free(batch->sp);
+    free(batch->stack);
+    free(batch->delayTimer);
+    free(batch->soundTimer);
+    free(batch->drawFlag);
+    free(batch->keys);
+    free(batch->savedKeys);
+    free(batch->inputBlocking);
+    free(batch->cycles);
+    free(batch->rngState);
+    free(batch->memory);
+    free(batch->gfx);
+    free(batch->mask);
+    free(batch->stepped);
+    free(batch);
+}
+
+// every lane starts as a freshly initialize()d machine -- returns NULL on allocation failure
+Chip8Batch *batchCreate(int count)
+{
+    Chip8Batch *batch = calloc(1, sizeof(Chip8Batch));
+    if (batch == NULL)
+        return NULL;
+
+    int lanes = (count + BATCH_ALIGN - 1) / BATCH_ALIGN * BATCH_ALIGN;
+    batch->count = count;
+    batch->lanes = lanes;
+    batch->V = calloc((size_t)lanes * 16, 1);
+    batch->I = calloc(lanes, sizeof(unsigned short));
+    batch->pc = calloc(lanes, sizeof(unsigned short));
+    batch->sp = calloc(lanes, sizeof(unsigned short));
+    batch->stack = calloc((size_t)lanes * 16, sizeof(unsigned short));
+    batch->delayTimer = calloc(lanes, 1);
+    batch->soundTimer = calloc(lanes, 1);
+    batch->drawFlag = calloc(lanes, 1);
+    batch->keys = calloc(lanes, sizeof(unsigned short));
+    batch->savedKeys = calloc(lanes, sizeof(unsigned short));
+    batch->inputBlocking = calloc(lanes, 1);
+    batch->cycles = calloc(lanes, sizeof(uint64_t));
+    batch->rngState = calloc(lanes, sizeof(uint32_t));
+    batch->memory = calloc((size_t)lanes * 4096, 1);
+    batch->gfx = calloc((size_t)lanes * 32, sizeof(uint64_t));
+    batch->mask = calloc(lanes, 1);
+    batch->stepped = calloc(lanes, 1);
+
+    if (!batch->V || !batch->I || !batch->pc || !batch->sp || !batch->stack || !batch->delayTimer
+        || !batch->soundTimer || !batch->drawFlag || !batch->keys || !batch->savedKeys
+        || !batch->inputBlocking || !batch->cycles || !batch->rngState || !batch->memory || !batch->gfx || !batch->mask || !batch->stepped)
+    {
+        batchDestroy(batch);
+        return NULL;
+    }
+
+    for (int lane = 0; lane < lanes; lane++)
+    {
+        batch->pc[lane] = 0x200;
+        batch->rngState[lane] = CHIP8_DEFAULT_SEED;
+        memcpy(batch->memory + (size_t)lane * 4096, chip8_fontset, sizeof(chip8_fontset));
+    }
+
+    return batch;
+}
+
+// loads the same ROM into every lane
+void batchLoadRom(Chip8Batch *batch, const unsigned char *rom, size_t size)
+{
+    if (size > 4096 - 512)
+        size = 4096 - 512;
+
+    for (int lane = 0; lane < batch->lanes; lane++)
+        memcpy(batch->memory + (size_t)lane * 4096 + 512, rom, size);
+}
+
+// see seedRandom()
+void batchSeedRandom(Chip8Batch *batch, int lane, uint32_t seed)
+{
+    batch->rngState[lane] = seed != 0 ? seed : CHIP8_DEFAULT_SEED;
+}
+
+void batchSetKeys(Chip8Batch *batch, int lane, unsigned short keys)
+{
+    batch->keys[lane] = keys;
+}
+
+// copies a lane's state out into a plain Chip8, leaving its decode cache alone --
+// for looking at a lane, not running it
+void batchGetLaneState(const Chip8Batch *batch, int lane, Chip8 *chip8)
+{
+    int lanes = batch->lanes;
+
+    for (int i = 0; i < 16; i++)
+    {
+        chip8->V[i] = batch->V[i * lanes + lane];
+        chip8->stack[i] = batch->stack[i * lanes + lane];
+        chip8->key[i] = (batch->keys[lane] >> i) & 1;
+        chip8->savedKeyState[i] = (batch->savedKeys[lane] >> i) & 1;
+    }
+    chip8->I = batch->I[lane];
+    chip8->pc = batch->pc[lane];
+    chip8->sp = batch->sp[lane];
+    chip8->delay_timer = batch->delayTimer[lane];
+    chip8->sound_timer = batch->soundTimer[lane];
+    chip8->drawFlag = batch->drawFlag[lane];
+    chip8->inputBlockingFlag = batch->inputBlocking[lane];
+    chip8->cycles = batch->cycles[lane];
+    chip8->rngState = batch->rngState[lane];
+    chip8->quirks = batch->quirks;
+    memcpy(chip8->memory, batch->memory + (size_t)lane * 4096, 4096);
+    memcpy(chip8->gfx, batch->gfx + (size_t)lane * 32, sizeof(chip8->gfx));
+}
+
+// copies a lane out into a plain Chip8 (decode cache cleared)
+void batchGetLane(const Chip8Batch *batch, int lane, Chip8 *chip8)
+{
+    batchGetLaneState(batch, lane, chip8);
+    memset(chip8->decoded, 0, sizeof(chip8->decoded));
+}
+
+void batchSetLane(Chip8Batch *batch, int lane, const Chip8 *chip8)
+{
+    int lanes = batch->lanes;
+
+    batch->keys[lane] = 0;
+    batch->savedKeys[lane] = 0;
+    for (int i = 0; i < 16; i++)
+    {
+        batch->V[i * lanes + lane] = chip8->V[i];
+        batch->stack[i * lanes + lane] = chip8->stack[i];
+        batch->keys[lane] |= (chip8->key[i] != 0) << i;
+        batch->savedKeys[lane] |= (chip8->savedKeyState[i] != 0) << i;
+    }
+    batch->I[lane] = chip8->I;
+    batch->pc[lane] = chip8->pc;
+    batch->sp[lane] = chip8->sp;
+    batch->delayTimer[lane] = chip8->delay_timer;
+    batch->soundTimer[lane] = chip8->sound_timer;
+    batch->drawFlag[lane] = chip8->drawFlag;
+    batch->inputBlocking[lane] = chip8->inputBlockingFlag;
+    batch->cycles[lane] = chip8->cycles;
+    batch->rngState[lane] = chip8->rngState;
+    batch->quirks = chip8->quirks; // shared, so the last lane set decides
+    memcpy(batch->memory + (size_t)lane * 4096, chip8->memory, 4096);
+    memcpy(batch->gfx + (size_t)lane * 32, chip8->gfx, sizeof(chip8->gfx));
+
+    // this lane's memory may differ anywhere now
+    memset(batch->written, 1, sizeof(batch->written));
+}
+
+static unsigned short batchFetch(const Chip8Batch *batch, int lane, unsigned short pc)
+{
+    const unsigned char *memory = batch->memory + (size_t)lane * 4096;
+    return memory[pc & 0xFFF] << 8 | memory[(pc + 1) & 0xFFF];
+}
+
+// one lane, one instruction -- everything that isn't plain register ALU work
+static void batchStepLane(Chip8Batch *batch, int lane, unsigned short opcode)
+{
+    int lanes = batch->lanes;
+    unsigned char *V = batch->V + lane;
+    unsigned char *memory = batch->memory + (size_t)lane * 4096;
+    unsigned short *pc = &batch->pc[lane];
+    unsigned short *I = &batch->I[lane];
+    unsigned short *sp = &batch->sp[lane];
+    int x = (opcode & 0x0F00) >> 8;
+    int y = (opcode & 0x00F0) >> 4;
+    unsigned char nn = opcode & 0x00FF;
+    unsigned short nnn = opcode & 0x0FFF;
+#define VX V[x * lanes]
+#define VY V[y * lanes]
+#define VF V[0xF * lanes]
+
+    switch (opcode & 0xF000)
+    {
+        case 0x0000:
+            if (opcode == 0x00E0)
+            {
+                memset(batch->gfx + (size_t)lane * 32, 0, 32 * sizeof(uint64_t));
+                *pc += 2;
+            }
+            else if (opcode == 0x00EE)
+            {
+                *sp = (*sp - 1) & 0xF;
+                *pc = batch->stack[*sp * lanes + lane] + 2;
+            }
+            else
+            {
+                *pc += 2;
+            }
+            break;
+        case 0x1000:
+            *pc = nnn;
+            break;
+        case 0x2000:
+            batch->stack[*sp * lanes + lane] = *pc;
+            *sp = (*sp + 1) & 0xF;
+            *pc = nnn;
+            break;
+        case 0x3000:
+            *pc += VX == nn ? 4 : 2;
+            break;
+        case 0x4000:
+            *pc += VX != nn ? 4 : 2;
+            break;
+        case 0x5000:
+            *pc += VX == VY ? 4 : 2;
+            break;
+        case 0x6000:
+            VX = nn;
+            *pc += 2;
+            break;
+        case 0x7000:
+            VX += nn;
+            *pc += 2;
+            break;
+        case 0x8000:
+        {
+            unsigned char vx = VX, vy = VY;
+            switch (opcode & 0x000F)
+            {
+                case 0x0: VX = vy; break;
+                case 0x1: VX = vx | vy; break;
+                case 0x2: VX = vx & vy; break;
+                case 0x3: VX = vx ^ vy; break;
+                case 0x4: VX = vx + vy; VF = vx + vy > 0xFF; break;
+                case 0x5: VX = vx - vy; VF = vx >= vy; break;
+                case 0x6: vx = batch->quirks & QUIRK_SHIFT_VY ? vy : vx; VX = vx >> 1; VF = vx & 0x1; break;
+                case 0x7: VX = vy - vx; VF = vy >= vx; break;
+                case 0xE: vx = batch->quirks & QUIRK_SHIFT_VY ? vy : vx; VX = vx << 1; VF = vx >> 7; break;
+            }
+            *pc += 2;
+            break;
+        }
+        case 0x9000:
+            *pc += VX != VY ? 4 : 2;
+            break;
+        case 0xA000:
+            *I = nnn;
+            *pc += 2;
+            break;
+        case 0xB000:
+            *pc = (batch->quirks & QUIRK_JUMP_VX ? VX : V[0]) + nnn;
+            break;
+        case 0xC000:
+            batch->rngState[lane] = xorshift32(batch->rngState[lane]);
+            VX = nn & (batch->rngState[lane] >> 24);
+            *pc += 2;
+            break;
+        case 0xD000:
+            if (batch->quirks & QUIRK_CLIP)
+                VF = drawSpriteRowsClipped(batch->gfx + (size_t)lane * 32, memory, *I, VX, VY, opcode & 0x000F);
+            else
+                VF = drawSpriteRows(batch->gfx + (size_t)lane * 32, memory, *I, VX, VY, opcode & 0x000F);
+            batch->drawFlag[lane] = 1;
+            *pc += 2;
+            break;
+        case 0xE000:
+            if (nn == 0x9E)
+                *pc += (batch->keys[lane] >> (VX & 0xF)) & 1 ? 4 : 2;
+            else if (nn == 0xA1)
+                *pc += (batch->keys[lane] >> (VX & 0xF)) & 1 ? 2 : 4;
+            else
+                *pc += 2;
+            break;
+        case 0xF000:
+            switch (nn)
+            {
+                case 0x07:
+                    VX = batch->delayTimer[lane];
+                    break;
+                case 0x0A:
+                    if (batch->inputBlocking[lane] == 0)
+                    {
+                        batch->inputBlocking[lane] = 1;
+                        batch->savedKeys[lane] = batch->keys[lane];
+                    }
+                    else if (batch->keys[lane] != batch->savedKeys[lane])
+                    {
+                        // lowest changed key, same as uCharArrayDifference()
+                        VX = __builtin_ctz(batch->keys[lane] ^ batch->savedKeys[lane]);
+                        batch->inputBlocking[lane] = 0;
+                    }
+                    if (batch->inputBlocking[lane])
+                        return;
+                    break;
+                case 0x15:
+                    batch->delayTimer[lane] = VX;
+                    break;
+                case 0x18:
+                    batch->soundTimer[lane] = VX;
+                    break;
+                case 0x1E:
+                    *I += VX;
+                    break;
+                case 0x29:
+                    *I = VX * 5;
+                    break;
+                case 0x33:
+                    memory[*I & 0xFFF] = VX / 100;
+                    memory[(*I + 1) & 0xFFF] = VX / 10 % 10;
+                    memory[(*I + 2) & 0xFFF] = VX % 10;
+                    for (int i = 0; i < 3; i++)
+                        batch->written[(*I + i) & 0xFFF] = 1;
+                    break;
+                case 0x55:
+                    for (int i = 0; i <= x; i++)
+                    {
+                        memory[(*I + i) & 0xFFF] = V[i * lanes];
+                        batch->written[(*I + i) & 0xFFF] = 1;
+                    }
+                    if (batch->quirks & QUIRK_LOAD_STORE_I)
+                        *I += x + 1;
+                    break;
+                case 0x65:
+                    for (int i = 0; i <= x; i++)
+                        V[i * lanes] = memory[(*I + i) & 0xFFF];
+                    if (batch->quirks & QUIRK_LOAD_STORE_I)
+                        *I += x + 1;
+                    break;
+            }
+            *pc += 2;
+            break;
+    }
+
+#undef VX
+#undef VY
+#undef VF
+}
+
+// register ALU opcodes across every lane of the group, BATCH_WIDTH at a time --
+// returns 0 if the opcode has no vector form
+BATCH_VECTORIZE static int batchStepVector(Chip8Batch *batch, unsigned short opcode)
+{
+    int lanes = batch->lanes;
+    int x = (opcode & 0x0F00) >> 8;
+    int y = (opcode & 0x00F0) >> 4;
+    unsigned char *vxRow = batch->V + x * lanes;
+    unsigned char *vyRow = batch->V + y * lanes;
+    unsigned char *vfRow = batch->V + 0xF * lanes;
+    int kind = (opcode & 0xF000) == 0x8000 ? 0x80 | (opcode & 0x000F) : (opcode & 0xF000) >> 12;
+
+    switch (kind)
+    {
+        case 0x6: case 0x7:
+        case 0x80: case 0x81: case 0x82: case 0x83: case 0x84:
+        case 0x85: case 0x86: case 0x87: case 0x8E:
+            break;
+        default:
+            return 0;
+    }
+
+    BatchVec nn = vecSet1(opcode & 0x00FF);
+    BatchVec one = vecSet1(1);
+    int shiftVy = batch->quirks & QUIRK_SHIFT_VY;
+
+    for (int lane = 0; lane < lanes; lane += BATCH_WIDTH)
+    {
+        BatchVec mask = vecLoad(batch->mask + lane);
+        BatchVec vx = vecLoad(vxRow + lane);
+        BatchVec vy = vecLoad(vyRow + lane);
+        BatchVec shifted = shiftVy ? vy : vx;
+        BatchVec result, flag;
+        int writesFlag = 1;
+
+        switch (kind)
+        {
+            case 0x6: result = nn; writesFlag = 0; break;
+            case 0x7: result = vecAdd(vx, nn); writesFlag = 0; break;
+            case 0x80: result = vy; writesFlag = 0; break;
+            case 0x81: result = vecOr(vx, vy); writesFlag = 0; break;
+            case 0x82: result = vecAnd(vx, vy); writesFlag = 0; break;
+            case 0x83: result = vecXor(vx, vy); writesFlag = 0; break;
+            case 0x84:
+                // carry when the wrapped sum is below VX
+                result = vecAdd(vx, vy);
+                flag = vecSub(one, vecAnd(vecEq(vecMax(vx, result), result), one));
+                break;
+            case 0x85:
+                result = vecSub(vx, vy);
+                flag = vecAnd(vecEq(vecMax(vx, vy), vx), one);
+                break;
+            case 0x86:
+                result = vecShr1(shifted);
+                flag = vecAnd(shifted, one);
+                break;
+            case 0x87:
+                result = vecSub(vy, vx);
+                flag = vecAnd(vecEq(vecMax(vx, vy), vy), one);
+                break;
+            default: // 0x8E
+                result = vecAdd(shifted, shifted);
+                flag = vecShr7(shifted);
+                break;
+        }
+
+        // VF last, so a flag op on VF itself leaves the flag
+        vecStore(vxRow + lane, vecBlend(vx, result, mask));
+        if (writesFlag)
+            vecStore(vfRow + lane, vecBlend(vecLoad(vfRow + lane), flag, mask));
+    }
+
+    unsigned short *restrict pc = batch->pc;
+    const unsigned char *restrict stepping = batch->mask;
+    for (int lane = 0; lane < lanes; lane++)
+        pc[lane] += 2 & (unsigned short)(signed char)stepping[lane];
+
+    return 1;
+}
+
+// jumps, skips, I and timer opcodes as branch-free masked loops the compiler
+// vectorizes -- returns 0 if the opcode has no masked form
+BATCH_VECTORIZE static int batchStepMasked(Chip8Batch *batch, unsigned short opcode)
+{
+    // restrict so the loops vectorize without runtime alias checks
+    int lanes = batch->lanes;
+    const unsigned char *restrict mask = batch->mask;
+    unsigned short *restrict pc = batch->pc;
+    unsigned short *restrict I = batch->I;
+    unsigned char *restrict delayTimer = batch->delayTimer;
+    unsigned char *restrict soundTimer = batch->soundTimer;
+    unsigned char *restrict vx = batch->V + ((opcode & 0x0F00) >> 8) * lanes;
+    const unsigned char *restrict vy = batch->V + ((opcode & 0x00F0) >> 4) * lanes;
+    unsigned char nn = opcode & 0x00FF;
+    unsigned short nnn = opcode & 0x0FFF;
+
+// all-ones in the lanes being stepped, as a 16-bit mask
+#define WIDE(lane) ((unsigned short)(signed char)mask[lane])
+
+    switch (opcode & 0xF000)
+    {
+        case 0x1000:
+            for (int lane = 0; lane < lanes; lane++)
+                pc[lane] = (nnn & WIDE(lane)) | (pc[lane] & ~WIDE(lane));
+            return 1;
+        case 0x3000:
+            for (int lane = 0; lane < lanes; lane++)
+                pc[lane] += (2 + 2 * (vx[lane] == nn)) & WIDE(lane);
+            return 1;
+        case 0x4000:
+            for (int lane = 0; lane < lanes; lane++)
+                pc[lane] += (2 + 2 * (vx[lane] != nn)) & WIDE(lane);
+            return 1;
+        case 0x5000:
+            for (int lane = 0; lane < lanes; lane++)
+                pc[lane] += (2 + 2 * (vx[lane] == vy[lane])) & WIDE(lane);
+            return 1;
+        case 0x9000:
+            for (int lane = 0; lane < lanes; lane++)
+                pc[lane] += (2 + 2 * (vx[lane] != vy[lane])) & WIDE(lane);
+            return 1;
+        case 0xA000:
+            for (int lane = 0; lane < lanes; lane++)
+            {
+                I[lane] = (nnn & WIDE(lane)) | (I[lane] & ~WIDE(lane));
+                pc[lane] += 2 & WIDE(lane);
+            }
+            return 1;
+        case 0xF000:
+            switch (nn)
+            {
+                case 0x07:
+                    for (int lane = 0; lane < lanes; lane++)
+                        vx[lane] = (delayTimer[lane] & mask[lane]) | (vx[lane] & ~mask[lane]);
+                    break;
+                case 0x15:
+                    for (int lane = 0; lane < lanes; lane++)
+                        delayTimer[lane] = (vx[lane] & mask[lane]) | (delayTimer[lane] & ~mask[lane]);
+                    break;
+                case 0x18:
+                    for (int lane = 0; lane < lanes; lane++)
+                        soundTimer[lane] = (vx[lane] & mask[lane]) | (soundTimer[lane] & ~mask[lane]);
+                    break;
+                case 0x1E:
+                    for (int lane = 0; lane < lanes; lane++)
+                        I[lane] += vx[lane] & WIDE(lane);
+                    break;
+                default:
+                    return 0;
+            }
+            for (int lane = 0; lane < lanes; lane++)
+                pc[lane] += 2 & WIDE(lane);
+            return 1;
+    }
+
+#undef WIDE
+
+    return 0;
+}
+
+// runs `cycles` instructions on every lane
+BATCH_VECTORIZE void stepBatch(Chip8Batch *batch, unsigned long cycles)
+{
+    int lanes = batch->lanes;
+    const unsigned short *restrict pcs = batch->pc;
+    unsigned char *restrict mask = batch->mask;
+    unsigned char *restrict stepped = batch->stepped;
+
+    for (unsigned long cycle = 0; cycle < cycles; cycle++)
+    {
+        // padding lanes never step
+        memset(stepped, 0, batch->count);
+        memset(stepped + batch->count, 1, lanes - batch->count);
+
+        int next = 0;
+        int groups = 0;
+
+        while (next < batch->count)
+        {
+            const unsigned char *unstepped = memchr(stepped + next, 0, batch->count - next);
+            if (unstepped == NULL)
+                break;
+            next = unstepped - stepped;
+
+            unsigned short pc = batch->pc[next];
+            unsigned short opcode = batchFetch(batch, next, pc);
+
+            if (groups == BATCH_MAX_GROUPS)
+            {
+                // too divergent for masks to pay off -- finish lane by lane
+                batchStepLane(batch, next, opcode);
+                stepped[next] = 1;
+                batch->singles++;
+                continue;
+            }
+
+            // gather the group: unstepped lanes on this pc, and with the same
+            // opcode there if any lane has ever written to it
+            for (int lane = 0; lane < lanes; lane++)
+                mask[lane] = -((pcs[lane] == pc) & (stepped[lane] == 0));
+
+            if (batch->written[pc & 0xFFF] || batch->written[(pc + 1) & 0xFFF])
+            {
+                for (int lane = next; lane < batch->count; lane++)
+                {
+                    if (mask[lane] && batchFetch(batch, lane, pc) != opcode)
+                        mask[lane] = 0;
+                }
+            }
+
+            if (!batchStepVector(batch, opcode) && !batchStepMasked(batch, opcode))
+            {
+                for (int lane = next; lane < batch->count; lane++)
+                {
+                    if (mask[lane])
+                        batchStepLane(batch, lane, opcode);
+                }
+            }
+
+            for (int lane = 0; lane < lanes; lane++)
+                stepped[lane] |= mask[lane];
+
+            groups++;
+            batch->groups++;
+        }
+    }
+
+    for (int lane = 0; lane < lanes; lane++)
+        batch->cycles[lane] += cycles;
+}
+
+// the 60Hz timer tick on every lane, see updateTimers()
+BATCH_VECTORIZE void batchUpdateTimers(Chip8Batch *batch)
+{
+    for (int lane = 0; lane < batch->lanes; lane++)
+    {
+        batch->delayTimer[lane] -= batch->delayTimer[lane] != 0;
+        batch->soundTimer[lane] -= batch->soundTimer[lane] != 0;
+    }
+}
+
+// one 60Hz frame on every lane, see runFrame()
+BATCH_VECTORIZE void batchRunFrame(Chip8Batch *batch, int instructionsPerFrame)
+{
+    stepBatch(batch, instructionsPerFrame);
+    batchUpdateTimers(batch);
+}
+
+#endif
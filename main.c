@@ -5,18 +5,183 @@
 #include <time.h>
 #include <SDL2/SDL.h>
 #include "chip8.h"
+#include "handoff.h"
+#include "audio.h"
+#include "scheduler.h"
+#include "savestate.h"
+#include "replay.h"
+#include "runahead.h"
 #ifdef _WIN32
 #include <Windows.h>
 #else
 #include <unistd.h>
 #endif
+#ifdef CHIP8_DEBUGGER
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+static atomic_int quit = 0;
+
+// everything the two threads share -- the Chip8 itself is only touched by the CPU thread
+typedef struct Session {
+    Chip8 chip8;
+    Chip8Scheduler scheduler;
+    FrameTripleBuffer frames;
+    KeyQueue keys;
+    // SDL event the CPU thread pushes to wake the main thread for a new frame,
+    // at most one in flight
+    Uint32 frameEvent;
+    atomic_int frameSignalled;
+
+    // one snapshot per frame, ~5 minutes in 4MB -- held backspace rewinds
+    RewindBuffer *rewind;
+    atomic_int rewinding;
+    // F5 / F9 save and load the state file
+    atomic_int saveRequested;
+    atomic_int loadRequested;
+    char statePath[1024];
+
+    // -r records input from the keyboard, -p plays a recording back instead
+    Replay *recording;
+    Replay *playback;
+
+    // -R shows the display this many frames ahead of the machine, see runahead.h
+    RunAhead *runAhead;
 
-static int quit = 0;
+    // -P writes a profile here on exit and on SIGUSR1 (CHIP8_PROFILE builds only)
+    char *profilePath;
 
-int cpuThread(void *chip8Data);
+    // one block of samples per frame, to the audio device when there is one
+    // and to the -a WAV file
+    AudioSynth synth;
+    AudioRing audio;
+    SDL_AudioDeviceID audioDevice;
+    WavWriter *wav;
+
+#ifdef CHIP8_DEBUGGER
+    // -d takes debugger commands from stdin, -D from a local TCP port, with
+    // replies written to debugOut -- a pipe the console thread forwards in that case
+    Chip8Debug *debug;
+    CommandQueue commands;
+    FILE *debugOut;
+    int debugPort;
+    int debugPipe;
+    // where the frame a stop or step cut short ends, 0 between frames
+    uint64_t frameEnd;
+#endif
+} Session;
+
+int cpuThread(void *sessionData);
+int keyIndex(SDL_Keycode sym);
+void audioCallback(void *ring, Uint8 *stream, int length);
+#ifdef CHIP8_DEBUGGER
+int debugThread(void *sessionData);
+#endif
 
 int main(int argc, char *argv[])
 {
+    // chip8 [-i instructions per frame] [-s speed, 0 = uncapped] [-f presents per second, 0 = vsync]
+    //       [-Q quirks] [-r record file | -p playback file] [-P profile file] [-a WAV file]
+    //       [-R run-ahead frames] [-d | -D debugger port] [rom]
+    int instructionsPerFrame = SCHEDULER_DEFAULT_IPF;
+    double speed = 1.0;
+    int presentRate = 0;
+    char *romPath = "roms/pong.rom";
+    char *recordPath = NULL;
+    char *playbackPath = NULL;
+    char *profilePath = NULL;
+    char *wavPath = NULL;
+    int runAheadFrames = 0;
+    int debugConsole = 0;
+    int debugPort = 0;
+    int quirks = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:s:f:Q:r:p:P:a:R:dD:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'i':
+                instructionsPerFrame = atoi(optarg);
+                break;
+            case 's':
+                speed = atof(optarg);
+                break;
+            case 'f':
+                presentRate = atoi(optarg);
+                break;
+            case 'r':
+                recordPath = optarg;
+                break;
+            case 'p':
+                playbackPath = optarg;
+                break;
+            case 'P':
+                profilePath = optarg;
+                break;
+            case 'a':
+                wavPath = optarg;
+                break;
+            case 'R':
+                runAheadFrames = atoi(optarg);
+                if (runAheadFrames < 0 || runAheadFrames > RUNAHEAD_MAX_FRAMES)
+                {
+                    printf("Run-ahead is 0 - %d frames\n", RUNAHEAD_MAX_FRAMES);
+                    return -1;
+                }
+                break;
+            case 'd':
+                debugConsole = 1;
+                break;
+            case 'D':
+                debugPort = atoi(optarg);
+                break;
+            case 'Q':
+                quirks = quirksParse(optarg);
+                if (quirks < 0)
+                {
+                    printf("Unknown quirks: %s (default, cosmac, schip or a number of QUIRK_* bits)\n", optarg);
+                    return -1;
+                }
+                break;
+            default:
+                printf("usage: chip8 [-i instructions per frame] [-s speed] [-f presents per second] [-Q quirks] [-r file | -p file] [-P file] [-a file] [-R frames] [-d | -D port] [rom]\n");
+                return -1;
+        }
+    }
+    if (optind < argc)
+        romPath = argv[optind];
+
+#ifndef CHIP8_PROFILE
+    if (profilePath != NULL)
+    {
+        printf("-P needs a build with -DCHIP8_PROFILE\n");
+        return -1;
+    }
+#endif
+#ifndef CHIP8_DEBUGGER
+    if (debugConsole || debugPort != 0)
+    {
+        printf("-d and -D need a build with -DCHIP8_DEBUGGER\n");
+        return -1;
+    }
+#endif
+
+    static Session session;
+
+    // a recording carries its own starting state, ROM included
+    if (playbackPath != NULL)
+    {
+        session.playback = replayLoad(playbackPath);
+        if (session.playback == NULL)
+        {
+            printf("Could not load recording: %s\n", playbackPath);
+            return -1;
+        }
+        instructionsPerFrame = session.playback->instructionsPerFrame;
+    }
 
     SDL_Window *window = NULL;
     SDL_Renderer *renderer = NULL;
@@ -28,189 +193,537 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    // no sound is no reason not to play
+    audioRingInit(&session.audio);
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) == 0)
+    {
+        SDL_AudioSpec want;
+        memset(&want, 0, sizeof(want));
+        want.freq = AUDIO_RATE;
+        want.format = AUDIO_S16SYS;
+        want.channels = 1;
+        want.samples = 512;
+        want.callback = audioCallback;
+        want.userdata = &session.audio;
+        // SDL converts to whatever the device really wants
+        session.audioDevice = SDL_OpenAudioDevice(NULL, 0, &want, NULL, 0);
+    }
+    if (session.audioDevice == 0)
+        printf("No audio: %s\n", SDL_GetError());
+    if (wavPath != NULL && (session.wav = wavOpen(wavPath)) == NULL)
+    {
+        printf("Could not create %s\n", wavPath);
+        return -1;
+    }
+
     int scale = 10;
 
-    SDL_CreateWindowAndRenderer(64*scale, 32*scale, 0, &window, &renderer);
-    SDL_RenderSetScale(renderer, scale, scale);
+    window = SDL_CreateWindow("chip8", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 64*scale, 32*scale, 0);
+    renderer = SDL_CreateRenderer(window, -1, presentRate > 0 ? 0 : SDL_RENDERER_PRESENTVSYNC);
+
+    // presents are paced by vsync when we got it, by our own deadline otherwise
+    SDL_RendererInfo rendererInfo;
+    if (presentRate <= 0 && (SDL_GetRendererInfo(renderer, &rendererInfo) != 0 || (rendererInfo.flags & SDL_RENDERER_PRESENTVSYNC) == 0))
+        presentRate = 60;
+    Uint32 presentInterval = presentRate > 0 ? 1000 / presentRate : 0;
+
+    // the whole display is one streaming texture, stretched over the window on copy
+    SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 64, 32);
+    int redraw = 0;
     
-    Chip8 chip8 = initialize();
-    loadGame(&chip8, "roms/pong.rom");
+    session.chip8 = initialize();
+    seedRandom(&session.chip8, (uint32_t)time(NULL));
+    session.chip8.quirks = quirks;
+    int romResult = loadGame(&session.chip8, romPath);
+    if (romResult != ROM_OK)
+    {
+        printf("Could not load ROM %s: %s\n", romPath, romErrorString(romResult));
+        return -1;
+    }
+    schedulerInit(&session.scheduler, instructionsPerFrame, speed);
 
-    SDL_Thread *threadID = SDL_CreateThread(cpuThread, "CPU Thread", (void *)&chip8);
+    // rewinding would cut a recording's input history, so it is live play only
+    if (session.playback != NULL)
+    {
+        replayStart(session.playback, &session.chip8);
+    }
+    else if (recordPath != NULL)
+    {
+        session.recording = replayCreate();
+        recordStart(session.recording, &session.chip8, session.scheduler.instructionsPerFrame, 60);
+    }
+    else
+    {
+        session.rewind = rewindCreate(4 << 20, 60 * 60 * 5, 60);
+    }
 
-    while (!quit)
+    if (runAheadFrames > 0)
     {
-        // user input
+        session.runAhead = malloc(sizeof(RunAhead));
+        runAheadInit(session.runAhead, runAheadFrames, &session.chip8);
+    }
 
-        while (SDL_PollEvent(&e) != 0)
+#ifdef CHIP8_PROFILE
+    if (profilePath != NULL)
+    {
+        session.chip8.profile = profileCreate();
+        session.profilePath = profilePath;
+        profileDumpOnSignal(SIGUSR1);
+    }
+#endif
+#ifdef CHIP8_DEBUGGER
+    if (debugConsole || debugPort != 0)
+    {
+        int fds[2];
+        session.debugOut = stdout;
+        session.debugPort = debugPort;
+        if (debugPort != 0)
         {
-            if (e.type == SDL_QUIT)
+            if (pipe(fds) != 0)
             {
-                quit = 1;
+                printf("Could not start the debugger\n");
+                return -1;
             }
-            else if (e.type == SDL_KEYDOWN)
+            session.debugPipe = fds[0];
+            session.debugOut = fdopen(fds[1], "w");
+        }
+        commandQueueInit(&session.commands);
+        session.debug = debugCreate();
+        session.chip8.debug = session.debug;
+        SDL_DetachThread(SDL_CreateThread(debugThread, "Debugger", (void *)&session));
+    }
+#endif
+    snprintf(session.statePath, sizeof(session.statePath), "%s.state", romPath);
+    frameBufferInit(&session.frames);
+    keyQueueInit(&session.keys);
+    session.frameEvent = SDL_RegisterEvents(1);
+
+    // upload the blank display once
+    framePublish(&session.frames, session.chip8.gfx);
+    int frameReady = 1;
+    Uint32 nextPresent = SDL_GetTicks();
+
+    SDL_Thread *threadID = SDL_CreateThread(cpuThread, "CPU Thread", (void *)&session);
+    if (session.audioDevice != 0)
+        SDL_PauseAudioDevice(session.audioDevice, 0);
+
+    while (!quit)
+    {
+        // sleep until there's input, a new frame or a present due for one we're holding back
+        int timeout = 1000;
+        if (frameReady || redraw)
+        {
+            Uint32 now = SDL_GetTicks();
+            timeout = SDL_TICKS_PASSED(now, nextPresent) ? 0 : (int)(nextPresent - now);
+        }
+
+        // user input -- the wait returns 0 on timeout
+
+        if (SDL_WaitEventTimeout(&e, timeout) != 0)
+        {
+            do
             {
-                switch (e.key.keysym.sym)
+                if (e.type == session.frameEvent)
                 {
-                    case SDLK_1:
-                        chip8.key[0] = 1;
-                        break;
-                    case SDLK_2:
-                        chip8.key[1] = 1;
-                        break;
-                    case SDLK_3:
-                        chip8.key[2] = 1;
-                        break;
-                    case SDLK_4:
-                        chip8.key[3] = 1;
-                        break;
-                    case SDLK_q:
-                        chip8.key[4] = 1;
-                        break;
-                    case SDLK_w:
-                        chip8.key[5] = 1;
-                        break;
-                    case SDLK_e:
-                        chip8.key[6] = 1;
-                        break;
-                    case SDLK_r:
-                        chip8.key[7] = 1;
-                        break;
-                    case SDLK_a:
-                        chip8.key[8] = 1;
-                        break;
-                    case SDLK_s:
-                        chip8.key[9] = 1;
-                    case SDLK_d:
-                        chip8.key[10] = 1;
-                    case SDLK_f:
-                        chip8.key[11] = 1;
-                        break;
-                    case SDLK_z:
-                        chip8.key[12] = 1;
-                        break;
-                    case SDLK_x:
-                        chip8.key[13] = 1;
-                        break;
-                    case SDLK_c:
-                        chip8.key[14] = 1;
-                        break;
-                    case SDLK_v:
-                        chip8.key[15] = 1;
-                        break;
-                    default:
-                        break;
+                    session.frameSignalled = 0;
+                    frameReady = 1;
                 }
-            }
-            else if (e.type == SDL_KEYUP)
-            {
-                switch (e.key.keysym.sym)
+                else if (e.type == SDL_QUIT)
                 {
-                    case SDLK_1:
-                        chip8.key[0] = 0;
-                        break;
-                    case SDLK_2:
-                        chip8.key[1] = 0;
-                        break;
-                    case SDLK_3:
-                        chip8.key[2] = 0;
-                        break;
-                    case SDLK_4:
-                        chip8.key[3] = 0;
-                        break;
-                    case SDLK_q:
-                        chip8.key[4] = 0;
-                        break;
-                    case SDLK_w:
-                        chip8.key[5] = 0;
-                        break;
-                    case SDLK_e:
-                        chip8.key[6] = 0;
-                        break;
-                    case SDLK_r:
-                        chip8.key[7] = 0;
-                        break;
-                    case SDLK_a:
-                        chip8.key[8] = 0;
-                        break;
-                    case SDLK_s:
-                        chip8.key[9] = 0;
-                    case SDLK_d:
-                        chip8.key[10] = 0;
-                    case SDLK_f:
-                        chip8.key[11] = 0;
-                        break;
-                    case SDLK_z:
-                        chip8.key[12] = 0;
-                        break;
-                    case SDLK_x:
-                        chip8.key[13] = 0;
-                        break;
-                    case SDLK_c:
-                        chip8.key[14] = 0;
-                        break;
-                    case SDLK_v:
-                        chip8.key[15] = 0;
-                        break;
-                    default:
-                        break;
+                    quit = 1;
                 }
-            }
+                else if (e.type == SDL_WINDOWEVENT && e.window.event == SDL_WINDOWEVENT_EXPOSED)
+                {
+                    redraw = 1;
+                }
+                else if ((e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) && e.key.keysym.sym == SDLK_BACKSPACE)
+                {
+                    session.rewinding = e.type == SDL_KEYDOWN;
+                }
+                else if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_F5)
+                {
+                    session.saveRequested = 1;
+                }
+                else if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_F9)
+                {
+                    session.loadRequested = 1;
+                }
+                else if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP)
+                {
+                    int key = keyIndex(e.key.keysym.sym);
+                    if (key != -1)
+                    {
+                        KeyEvent event = { e.key.timestamp, key, e.type == SDL_KEYDOWN };
+                        keyQueuePush(&session.keys, event);
+                    }
+                }
+            } while (SDL_PollEvent(&e) != 0);
         }
 
-        // drawing
-
-        SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0xFF, 0xFF);
-        SDL_RenderClear(renderer);
-        SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0xFF);
+        // drawing -- once a present is due, upload the newest frame published so far and show it
 
-        for (int i = 0; i < 32; i++)
+        if ((frameReady || redraw) && SDL_TICKS_PASSED(SDL_GetTicks(), nextPresent))
         {
-            for (int j = 0; j < 64; j++)
+            const uint64_t *frame = frameAcquire(&session.frames);
+            if (frame != NULL)
             {
-                if (chip8.gfx[(i*32) + j] == 1)
-                {
-                    SDL_RenderDrawPoint(renderer, i, j);
-                }
+                void *pixels;
+                int pitch;
+
+                SDL_LockTexture(texture, NULL, &pixels, &pitch);
+                gfxToPixels(frame, pixels, pitch / 4, 0xFF000000, 0xFFFFFFFF);
+                SDL_UnlockTexture(texture);
             }
-        }
 
-        SDL_RenderPresent(renderer);
+            // blocks until vblank with vsync on
+            SDL_RenderCopy(renderer, texture, NULL, NULL);
+            SDL_RenderPresent(renderer);
+            frameReady = 0;
+            redraw = 0;
+
+            // slots are fixed so the rate holds, unless we've fallen a whole slot behind
+            Uint32 now = SDL_GetTicks();
+            nextPresent += presentInterval;
+            if (SDL_TICKS_PASSED(now, nextPresent))
+                nextPresent = now;
+        }
     }
     printf("QUITTING\n");
     SDL_WaitThread( threadID, NULL );
 
+    if (session.audioDevice != 0)
+        SDL_CloseAudioDevice(session.audioDevice);
+    if (session.wav != NULL && wavClose(session.wav) != 0)
+        printf("Could not write %s\n", wavPath);
+
+    if (session.rewind != NULL)
+        rewindDestroy(session.rewind);
+    if (session.runAhead != NULL)
+    {
+        runAheadReport(session.runAhead, stdout);
+        free(session.runAhead);
+    }
+    if (session.recording != NULL)
+    {
+        if (replaySave(session.recording, recordPath) != 0)
+            printf("Could not save recording to %s\n", recordPath);
+        replayDestroy(session.recording);
+    }
+    if (session.playback != NULL)
+        replayDestroy(session.playback);
+#ifdef CHIP8_PROFILE
+    if (session.chip8.profile != NULL)
+    {
+        if (profileDump(session.chip8.profile, session.profilePath) != 0)
+            printf("Could not write profile to %s\n", session.profilePath);
+        profileDestroy(session.chip8.profile);
+    }
+#endif
+
     
 
+    SDL_DestroyTexture(texture);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
 
     return 0;
 }
 
-int cpuThread(void *chip8Data)
+int cpuThread(void *sessionData)
 {
-    Chip8 *chip8 = chip8Data;
-    int frame = 0;
-    int frame_start_ticks = SDL_GetTicks();
+    Session *session = sessionData;
+    Chip8 *chip8 = &session->chip8;
+    Chip8Scheduler *scheduler = &session->scheduler;
+    KeyEvent event;
+
+    schedulerSetSpeed(scheduler, scheduler->speed);
 
     while (!quit)
     { 
-        emulateCycle(chip8);
+#ifdef CHIP8_DEBUGGER
+        // commands run between frames, and a stopped machine runs none
+        if (session->debug != NULL)
+        {
+            char line[COMMAND_LENGTH];
+            while (commandQueuePop(&session->commands, line))
+                debugCommand(session->debug, chip8, line, session->debugOut);
+
+            if (session->debug->stopped)
+            {
+                debugReport(session->debug, chip8, session->debugOut);
+                SDL_Delay(10);
+                continue;
+            }
+        }
+#endif
 
-        frame++;
-        // naive 60Hz limit - should try to even out delay in future
-        if (frame >= 60)
+        // key changes only ever land on frame boundaries -- a playback brings its own
+        while (keyQueuePop(&session->keys, &event))
         {
-            int pollingDelay = 1000 - (SDL_GetTicks() - frame_start_ticks);
+            if (session->recording != NULL)
+                recordKey(session->recording, chip8, event.key, event.pressed);
+            else if (session->playback == NULL)
+                chip8->key[event.key] = event.pressed;
+
+            if (event.pressed && session->runAhead != NULL && session->playback == NULL)
+                runAheadKeyPressed(session->runAhead);
+        }
 
-            if (pollingDelay > 0)
-                SDL_Delay(pollingDelay);
+        if (atomic_exchange(&session->saveRequested, 0) && saveStateFile(chip8, session->statePath) != 0)
+            printf("Could not save state to %s\n", session->statePath);
+        if (atomic_exchange(&session->loadRequested, 0))
+        {
+            if (session->recording != NULL || session->playback != NULL)
+                printf("States can't be loaded while recording or playing back\n");
+            else if (loadStateFile(chip8, session->statePath) == 0)
+            {
+                chip8->drawFlag = 1;
+#ifdef CHIP8_DEBUGGER
+                session->frameEnd = 0;
+#endif
+            }
+            else
+                printf("Could not load state from %s\n", session->statePath);
+        }
 
-            frame = 0;
-            frame_start_ticks = SDL_GetTicks();
+        if (session->rewinding && session->rewind != NULL)
+        {
+            // step back one frame, keeping the keys the player is holding right now
+            unsigned char keys[16];
+            memcpy(keys, chip8->key, sizeof(keys));
+            if (rewindPop(session->rewind, chip8))
+                chip8->drawFlag = 1;
+            memcpy(chip8->key, keys, sizeof(keys));
+#ifdef CHIP8_DEBUGGER
+            session->frameEnd = 0;
+#endif
         }
+        else if (session->playback != NULL)
+        {
+            // once the recording runs out (or stops matching) play carries on live
+            int result = replayFrame(session->playback, chip8);
+            if (result <= 0)
+            {
+                if (result == 0)
+                    printf("Playback finished after %llu frames\n", (unsigned long long)session->playback->frames);
+                else
+                    printf("Playback diverged from the recording by frame %llu\n", (unsigned long long)session->playback->frames);
+                replayDestroy(session->playback);
+                session->playback = NULL;
+            }
+        }
+        else
+        {
+            int frameDone = 1;
+#ifdef CHIP8_DEBUGGER
+            // a stop or step can end the instructions early -- the frame, and with
+            // it the timer tick, the recording and the rewind buffer, waits for the rest
+            if (session->debug != NULL)
+            {
+                if (session->frameEnd == 0)
+                    session->frameEnd = chip8->cycles + scheduler->instructionsPerFrame;
+                runCycles(chip8, session->frameEnd - chip8->cycles);
+                frameDone = chip8->cycles >= session->frameEnd;
+                if (frameDone)
+                {
+                    session->frameEnd = 0;
+                    updateTimers(chip8);
+                }
+            }
+            else
+#endif
+                runFrame(chip8, scheduler->instructionsPerFrame);
+
+            if (frameDone && session->recording != NULL)
+                recordFrame(session->recording, chip8);
+            if (frameDone && session->rewind != NULL)
+                rewindPush(session->rewind, chip8);
+        }
+
+        // hand over the display once the frame is done so it is never half drawn --
+        // with run-ahead, the one from a few frames on, except while rewinding or
+        // debugging, where the real machine is what the player is looking at
+        int ahead = session->runAhead != NULL && !session->rewinding;
+#ifdef CHIP8_DEBUGGER
+        if (session->debug != NULL && session->debug->armed)
+            ahead = 0;
+#endif
+        const uint64_t *display = NULL;
+        if (ahead)
+            display = runAheadFrame(session->runAhead, chip8, scheduler->instructionsPerFrame);
+        else if (chip8->drawFlag)
+            display = chip8->gfx;
+        chip8->drawFlag = 0;
+
+        // so run-ahead picks up from what was actually shown
+        if (!ahead && display != NULL && session->runAhead != NULL)
+            memcpy(session->runAhead->shown, display, sizeof(session->runAhead->shown));
+
+        if (display != NULL)
+        {
+            framePublish(&session->frames, display);
+
+            // wake the main thread, unless the last wakeup is still waiting in its queue
+            if (!atomic_exchange(&session->frameSignalled, 1))
+            {
+                SDL_Event wake;
+                memset(&wake, 0, sizeof(wake));
+                wake.type = session->frameEvent;
+                SDL_PushEvent(&wake);
+            }
+        }
+
+        // this frame's sound -- dropped rather than waited on if the device is behind
+        if (session->audioDevice != 0 || session->wav != NULL)
+        {
+            AudioBlock block;
+            audioSynthesize(&session->synth, chip8, &block);
+            if (session->audioDevice != 0)
+                audioPush(&session->audio, &block);
+            if (session->wav != NULL)
+                wavWrite(session->wav, &block);
+        }
+
+#ifdef CHIP8_PROFILE
+        if (chip8->profile != NULL && profileDumpPending() && profileDump(chip8->profile, session->profilePath) != 0)
+            printf("Could not write profile to %s\n", session->profilePath);
+#endif
+
+        // stuck on FX0A with nothing counting down, so frames change nothing until a
+        // key arrives -- uncapped, sleep rather than spin on them
+        if (scheduler->period == 0 && waitingForKey(chip8) && chip8->delay_timer == 0 && chip8->sound_timer == 0)
+            SDL_Delay(1);
+
+        schedulerWait(scheduler);
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+// SDL's audio thread -- plays whatever the CPU thread has queued
+void audioCallback(void *ring, Uint8 *stream, int length)
+{
+    audioPull(ring, (int16_t *)stream, length / (int)sizeof(int16_t));
+}
+
+#ifdef CHIP8_DEBUGGER
+// the debugger console -- hands command lines from stdin, or from one client
+// at a time on a local TCP port, to the CPU thread. With a port the replies
+// come back through debugPipe and are passed on to the client, or dropped
+// while there is none.
+int debugThread(void *sessionData)
+{
+    Session *session = sessionData;
+    char line[COMMAND_LENGTH];
+
+    if (session->debugPort == 0)
+    {
+        while (fgets(line, sizeof(line), stdin) != NULL)
+        {
+            while (!commandQueuePush(&session->commands, line))
+                SDL_Delay(1);
+        }
+        return 0;
+    }
+
+    struct sockaddr_in address;
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int reuse = 1;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(session->debugPort);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listener < 0)
+    {
+        printf("Debugger could not listen on port %d\n", session->debugPort);
+        return -1;
+    }
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 1) != 0)
+    {
+        printf("Debugger could not listen on port %d\n", session->debugPort);
+        close(listener);
+        return -1;
+    }
+    printf("Debugger listening on 127.0.0.1:%d\n", session->debugPort);
+
+    int client = -1;
+    size_t buffered = 0;
+
+    for (;;)
+    {
+        struct pollfd fds[2] = {
+            { client >= 0 ? client : listener, POLLIN, 0 },
+            { session->debugPipe, POLLIN, 0 }
+        };
+        if (poll(fds, 2, -1) < 0)
+            continue;
+
+        if (fds[1].revents & POLLIN)
+        {
+            char reply[1024];
+            ssize_t length = read(session->debugPipe, reply, sizeof(reply));
+            if (length > 0 && client >= 0)
+                send(client, reply, length, MSG_NOSIGNAL);
+        }
+
+        if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+            continue;
+
+        if (client < 0)
+        {
+            client = accept(listener, NULL, NULL);
+            buffered = 0;
+            continue;
+        }
+
+        ssize_t length = recv(client, line + buffered, sizeof(line) - 1 - buffered, 0);
+        if (length <= 0)
+        {
+            close(client);
+            client = -1;
+            continue;
+        }
+        buffered += length;
+
+        // hand over every complete line -- one too long for the queue is thrown away
+        char *end;
+        while ((end = memchr(line, '\n', buffered)) != NULL)
+        {
+            *end = '\0';
+            while (!commandQueuePush(&session->commands, line))
+                SDL_Delay(1);
+            buffered -= end + 1 - line;
+            memmove(line, end + 1, buffered);
+        }
+        if (buffered == sizeof(line) - 1)
+            buffered = 0;
+    }
+}
+#endif
+
+// maps the left side of a QWERTY keyboard onto the 16 key hex keypad, -1 for any other key
+int keyIndex(SDL_Keycode sym)
+{
+    switch (sym)
+    {
+        case SDLK_1: return 0;
+        case SDLK_2: return 1;
+        case SDLK_3: return 2;
+        case SDLK_4: return 3;
+        case SDLK_q: return 4;
+        case SDLK_w: return 5;
+        case SDLK_e: return 6;
+        case SDLK_r: return 7;
+        case SDLK_a: return 8;
+        case SDLK_s: return 9;
+        case SDLK_d: return 10;
+        case SDLK_f: return 11;
+        case SDLK_z: return 12;
+        case SDLK_x: return 13;
+        case SDLK_c: return 14;
+        case SDLK_v: return 15;
+        default: return -1;
+    }
+}
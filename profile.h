@@ -0,0 +1,298 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* Hot path profiler
+
+    Only compiled in with -DCHIP8_PROFILE, and then only used by machines
+    that have a profile attached (chip8->profile = profileCreate()), so a
+    build without the flag is exactly the normal build and an unprofiled
+    machine in a profiling build pays one branch per runCycles() call.
+
+    The profiled core counts every executed instruction per handler and per
+    pc. Timing is sampled: every PROFILE_SAMPLE_INTERVAL-th instruction is
+    timed from its handler starting to the next one starting -- rdtsc on
+    x86, the monotonic clock elsewhere -- minus the cost of reading the
+    clock, which is measured on reset. Reading the clock on every
+    instruction would cost more than most instructions do. Per-class time
+    is the sampled average times the exact count; ticks are converted to
+    nanoseconds at dump time against the wall time the profile has been
+    running. OP_DECODE counts are decode cache misses. Frames come from
+    runFrame(); draws are the DXYN count.
+
+    Included by chip8.h, which has to define the OP_* handlers first.
+*/
+
+// prime, so loops of any power of two length still get every instruction sampled
+#define PROFILE_SAMPLE_INTERVAL 61
+
+typedef struct Chip8Profile {
+    uint64_t count[OP_COUNT];
+    uint64_t sampled[OP_COUNT];
+    uint64_t ticks[OP_COUNT];  // over the sampled executions only
+    uint64_t pcCount[4096];
+    uint64_t frames;
+
+    // sampler state
+    int countdown;
+    int sampling;              // handler being timed, -1 when none
+    uint64_t sampleStart;
+    uint64_t clockCost;        // ticks one profileTicks() call adds to a measurement
+
+    // for converting ticks to nanoseconds
+    uint64_t startTicks;
+    uint64_t startNanoseconds;
+} Chip8Profile;
+
+static const char *profileNames[OP_COUNT] = {
+    "decode", "00E0", "00EE", "0NNN", "1NNN", "2NNN", "3XNN", "4XNN", "5XY0",
+    "6XNN", "7XNN", "8XY0", "8XY1", "8XY2", "8XY3", "8XY4", "8XY5", "8XY6",
+    "8XY7", "8XYE", "9XY0", "ANNN", "BNNN", "CXNN", "DXYN", "EX9E", "EXA1",
+    "FX07", "FX0A", "FX15", "FX18", "FX1E", "FX29", "FX33", "FX55", "FX65",
+    "unknown"
+};
+
+static uint64_t profileNanoseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t profileTicks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return profileNanoseconds();
+#endif
+}
+
+void profileReset(Chip8Profile *profile)
+{
+    memset(profile, 0, sizeof(Chip8Profile));
+    profile->countdown = PROFILE_SAMPLE_INTERVAL;
+    profile->sampling = -1;
+
+    profile->clockCost = ~0ULL;
+    for (int i = 0; i < 1000; i++)
+    {
+        uint64_t first = profileTicks();
+        uint64_t cost = profileTicks() - first;
+        if (cost < profile->clockCost)
+            profile->clockCost = cost;
+    }
+
+    profile->startTicks = profileTicks();
+    profile->startNanoseconds = profileNanoseconds();
+}
+
+// closes the running sample, if any
+static inline void profileLeave(Chip8Profile *profile)
+{
+    if (profile->sampling < 0)
+        return;
+
+    uint64_t elapsed = profileTicks() - profile->sampleStart;
+    profile->ticks[profile->sampling] += elapsed > profile->clockCost ? elapsed - profile->clockCost : 0;
+    profile->sampling = -1;
+}
+
+// called by the profiled core as each handler starts
+static inline void profileEnter(Chip8Profile *profile, int handler, unsigned short pc)
+{
+    profileLeave(profile);
+
+    profile->count[handler]++;
+    if (handler != OP_DECODE)
+        profile->pcCount[pc & 0xFFF]++;
+
+    if (--profile->countdown == 0)
+    {
+        profile->countdown = PROFILE_SAMPLE_INTERVAL;
+        profile->sampled[handler]++;
+        profile->sampling = handler;
+        profile->sampleStart = profileTicks();
+    }
+}
+
+// returns NULL if it couldn't be allocated
+Chip8Profile *profileCreate()
+{
+    Chip8Profile *profile = malloc(sizeof(Chip8Profile));
+    if (profile != NULL)
+        profileReset(profile);
+    return profile;
+}
+
+void profileDestroy(Chip8Profile *profile)
+{
+    free(profile);
+}
+
+// adds src's counters into dst, e.g. to report many instances as one
+void profileMerge(Chip8Profile *dst, const Chip8Profile *src)
+{
+    for (int i = 0; i < OP_COUNT; i++)
+    {
+        dst->count[i] += src->count[i];
+        dst->sampled[i] += src->sampled[i];
+        dst->ticks[i] += src->ticks[i];
+    }
+    for (int i = 0; i < 4096; i++)
+        dst->pcCount[i] += src->pcCount[i];
+    dst->frames += src->frames;
+
+    // keep the longest span so the tick rate stays accurate
+    if (src->startTicks < dst->startTicks)
+    {
+        dst->startTicks = src->startTicks;
+        dst->startNanoseconds = src->startNanoseconds;
+    }
+}
+
+static double profileNanosecondsPerTick(const Chip8Profile *profile)
+{
+    uint64_t ticks = profileTicks() - profile->startTicks;
+    uint64_t nanoseconds = profileNanoseconds() - profile->startNanoseconds;
+    return ticks != 0 ? (double)nanoseconds / ticks : 0;
+}
+
+// average nanoseconds per execution of a handler, from its samples
+static double profileNanosecondsPerOp(const Chip8Profile *profile, int handler, double nsPerTick)
+{
+    if (profile->sampled[handler] == 0)
+        return 0;
+    return profile->ticks[handler] * nsPerTick / profile->sampled[handler];
+}
+
+#define PROFILE_HOT_PCS 32
+
+// the `limit` most executed pcs into pcs[], most executed first -- returns how many were found
+static int profileHotPcs(const Chip8Profile *profile, int *pcs, int limit)
+{
+    int found = 0;
+
+    for (int pc = 0; pc < 4096; pc++)
+    {
+        if (profile->pcCount[pc] == 0)
+            continue;
+
+        // insertion into the short sorted list
+        int at = found < limit ? found++ : limit;
+        while (at > 0 && profile->pcCount[pcs[at - 1]] < profile->pcCount[pc])
+        {
+            if (at < limit)
+                pcs[at] = pcs[at - 1];
+            at--;
+        }
+        if (at < limit)
+            pcs[at] = pc;
+    }
+
+    return found;
+}
+
+void profileWriteJson(const Chip8Profile *profile, FILE *file)
+{
+    double nsPerTick = profileNanosecondsPerTick(profile);
+    uint64_t instructions = 0;
+    int pcs[PROFILE_HOT_PCS];
+    int hot = profileHotPcs(profile, pcs, PROFILE_HOT_PCS);
+
+    for (int i = 1; i < OP_COUNT; i++)
+        instructions += profile->count[i];
+
+    fprintf(file, "{\n  \"instructions\": %llu,\n  \"frames\": %llu,\n  \"draws\": %llu,\n  \"decodes\": %llu,\n",
+        (unsigned long long)instructions, (unsigned long long)profile->frames,
+        (unsigned long long)profile->count[OP_DRW], (unsigned long long)profile->count[OP_DECODE]);
+
+    fprintf(file, "  \"opcodes\": [\n");
+    for (int i = 0; i < OP_COUNT; i++)
+    {
+        double perOp = profileNanosecondsPerOp(profile, i, nsPerTick);
+        fprintf(file, "    { \"opcode\": \"%s\", \"count\": %llu, \"samples\": %llu, \"ns\": %.0f, \"nsPerOp\": %.2f }%s\n",
+            profileNames[i], (unsigned long long)profile->count[i], (unsigned long long)profile->sampled[i],
+            perOp * profile->count[i], perOp, i + 1 < OP_COUNT ? "," : "");
+    }
+
+    fprintf(file, "  ],\n  \"hotPcs\": [\n");
+    for (int i = 0; i < hot; i++)
+    {
+        fprintf(file, "    { \"pc\": \"0x%03X\", \"count\": %llu }%s\n",
+            pcs[i], (unsigned long long)profile->pcCount[pcs[i]], i + 1 < hot ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+}
+
+// one row per opcode family, then one per executed pc
+void profileWriteCsv(const Chip8Profile *profile, FILE *file)
+{
+    double nsPerTick = profileNanosecondsPerTick(profile);
+
+    fprintf(file, "kind,name,count,ns\n");
+    fprintf(file, "total,frames,%llu,\n", (unsigned long long)profile->frames);
+    for (int i = 0; i < OP_COUNT; i++)
+    {
+        fprintf(file, "opcode,%s,%llu,%.0f\n", profileNames[i], (unsigned long long)profile->count[i],
+            profileNanosecondsPerOp(profile, i, nsPerTick) * profile->count[i]);
+    }
+    for (int pc = 0; pc < 4096; pc++)
+    {
+        if (profile->pcCount[pc] != 0)
+            fprintf(file, "pc,0x%03X,%llu,\n", pc, (unsigned long long)profile->pcCount[pc]);
+    }
+}
+
+// CSV when path ends in .csv, JSON otherwise -- returns 0 on success, -1 if the file couldn't be written
+int profileDump(const Chip8Profile *profile, const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return -1;
+
+    size_t length = strlen(path);
+    if (length >= 4 && strcmp(path + length - 4, ".csv") == 0)
+        profileWriteCsv(profile, file);
+    else
+        profileWriteJson(profile, file);
+
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+// set from the signal handler, polled by whoever owns the profile
+static volatile sig_atomic_t profileDumpRequested = 0;
+
+static void profileSignalHandler(int signal)
+{
+    profileDumpRequested = 1;
+}
+
+// makes `signal` (e.g. SIGUSR1) request a dump -- see profileDumpPending()
+void profileDumpOnSignal(int signal)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profileSignalHandler;
+    sigemptyset(&action.sa_mask);
+    sigaction(signal, &action, NULL);
+}
+
+// returns 1 once per received signal
+int profileDumpPending()
+{
+    if (!profileDumpRequested)
+        return 0;
+    profileDumpRequested = 0;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,303 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "chip8.h"
+#include "savestate.h"
+
+/* Input recording and bit-exact replay
+
+    A machine is a pure function of its starting state and the key changes
+    fed to it: CXNN draws from the per-machine generator (see seedRandom())
+    and timers tick once per frame of instructionsPerFrame instructions.
+    So a recording is just the starting savestate, the frame length, and
+    every key change stamped with chip8->cycles at the moment it was applied.
+
+    While recording, a hash of the state is stored every hashInterval frames.
+    Playback checks each one as it gets there, so a divergence is caught
+    within hashInterval frames of where it happened rather than only as a
+    wrong final picture. Matching hashes also make it safe to cache the
+    state at any checked frame and resume from there instead of replaying
+    the prefix again.
+*/
+
+#define REPLAY_MAGIC 0x50523843 // "C8RP"
+#define REPLAY_VERSION 1
+
+typedef struct ReplayEvent {
+    uint64_t cycle;
+    uint32_t key;
+    uint32_t pressed;
+} ReplayEvent;
+
+typedef struct ReplayCheck {
+    uint64_t cycle;
+    uint64_t hash;
+} ReplayCheck;
+
+typedef struct ReplayHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t stateSize;
+    uint32_t instructionsPerFrame;
+    uint64_t eventCount;
+    uint64_t checkCount;
+    uint64_t endCycle;
+} ReplayHeader;
+
+typedef struct Replay {
+    int instructionsPerFrame;
+    int hashInterval;                        // frames between state hashes
+    unsigned char start[CHIP8_STATE_SIZE];   // savestate the recording starts from
+    uint64_t endCycle;                       // chip8->cycles after the last recorded frame
+
+    ReplayEvent *events;
+    size_t eventCount;
+    size_t eventCapacity;
+
+    ReplayCheck *checks;
+    size_t checkCount;
+    size_t checkCapacity;
+
+    // recording / playback position
+    uint64_t frames;
+    size_t nextEvent;
+    size_t nextCheck;
+    uint64_t frameEnd; // playback: where a frame cut short ends, 0 between frames
+} Replay;
+
+static uint64_t fnvBytes(uint64_t hash, const void *data, size_t length)
+{
+    const unsigned char *bytes = data;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+// FNV-1a over the machine state field by field, so struct padding never counts --
+// drawFlag is left out since frontends clear it whenever they please
+uint64_t stateHash(const Chip8 *chip8)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    hash = fnvBytes(hash, chip8->memory, sizeof(chip8->memory));
+    hash = fnvBytes(hash, chip8->V, sizeof(chip8->V));
+    hash = fnvBytes(hash, &chip8->I, sizeof(chip8->I));
+    hash = fnvBytes(hash, &chip8->pc, sizeof(chip8->pc));
+    hash = fnvBytes(hash, chip8->gfx, sizeof(chip8->gfx));
+    hash = fnvBytes(hash, &chip8->delay_timer, sizeof(chip8->delay_timer));
+    hash = fnvBytes(hash, &chip8->sound_timer, sizeof(chip8->sound_timer));
+    hash = fnvBytes(hash, chip8->stack, sizeof(chip8->stack));
+    hash = fnvBytes(hash, &chip8->sp, sizeof(chip8->sp));
+    hash = fnvBytes(hash, chip8->key, sizeof(chip8->key));
+    hash = fnvBytes(hash, chip8->savedKeyState, sizeof(chip8->savedKeyState));
+    hash = fnvBytes(hash, &chip8->inputBlockingFlag, sizeof(chip8->inputBlockingFlag));
+    hash = fnvBytes(hash, &chip8->cycles, sizeof(chip8->cycles));
+    hash = fnvBytes(hash, &chip8->rngState, sizeof(chip8->rngState));
+    hash = fnvBytes(hash, &chip8->quirks, sizeof(chip8->quirks));
+
+    return hash;
+}
+
+Replay *replayCreate()
+{
+    return calloc(1, sizeof(Replay));
+}
+
+void replayDestroy(Replay *replay)
+{
+    free(replay->events);
+    free(replay->checks);
+    free(replay);
+}
+
+// doubles *capacity until index fits -- returns 0 if the allocation failed
+static int replayReserve(void **items, size_t *capacity, size_t index, size_t itemSize)
+{
+    if (index < *capacity)
+        return 1;
+
+    size_t grown = *capacity != 0 ? *capacity : 256;
+    while (grown <= index)
+        grown *= 2;
+    void *resized = realloc(*items, grown * itemSize);
+    if (resized == NULL)
+        return 0;
+
+    *items = resized;
+    *capacity = grown;
+    return 1;
+}
+
+// starts a new recording from the current state, dropping anything recorded before
+void recordStart(Replay *replay, const Chip8 *chip8, int instructionsPerFrame, int hashInterval)
+{
+    saveState(chip8, replay->start);
+    replay->instructionsPerFrame = instructionsPerFrame;
+    replay->hashInterval = hashInterval > 0 ? hashInterval : 1;
+    replay->endCycle = chip8->cycles;
+    replay->eventCount = 0;
+    replay->checkCount = 0;
+    replay->frames = 0;
+}
+
+// applies a key change and records it -- returns 0 if it couldn't be recorded
+int recordKey(Replay *replay, Chip8 *chip8, unsigned char key, unsigned char pressed)
+{
+    chip8->key[key & 0xF] = pressed;
+
+    if (!replayReserve((void **)&replay->events, &replay->eventCapacity, replay->eventCount, sizeof(ReplayEvent)))
+        return 0;
+
+    ReplayEvent *event = &replay->events[replay->eventCount++];
+    event->cycle = chip8->cycles;
+    event->key = key & 0xF;
+    event->pressed = pressed;
+    return 1;
+}
+
+// call after every frame that was recorded -- returns 0 if a hash couldn't be stored
+int recordFrame(Replay *replay, const Chip8 *chip8)
+{
+    replay->endCycle = chip8->cycles;
+
+    if (++replay->frames % replay->hashInterval != 0)
+        return 1;
+
+    if (!replayReserve((void **)&replay->checks, &replay->checkCapacity, replay->checkCount, sizeof(ReplayCheck)))
+        return 0;
+
+    replay->checks[replay->checkCount].cycle = chip8->cycles;
+    replay->checks[replay->checkCount].hash = stateHash(chip8);
+    replay->checkCount++;
+    return 1;
+}
+
+// rewinds playback to the start of the recording
+void replayStart(Replay *replay, Chip8 *chip8)
+{
+    loadState(chip8, replay->start);
+    replay->frames = 0;
+    replay->nextEvent = 0;
+    replay->nextCheck = 0;
+    replay->frameEnd = 0;
+}
+
+// plays one frame, applying each recorded key change on the cycle it was made --
+// returns 1 while the recording lasts, 0 once it has ended and -1 on a hash mismatch.
+// If runCycles() comes back short (a debugger stop) it returns 1 straight away
+// and the next call carries on with the rest of the frame.
+int replayFrame(Replay *replay, Chip8 *chip8)
+{
+    if (replay->frameEnd == 0)
+    {
+        if (chip8->cycles >= replay->endCycle)
+            return 0;
+        replay->frameEnd = chip8->cycles + replay->instructionsPerFrame;
+    }
+    uint64_t frameEnd = replay->frameEnd;
+
+    while (chip8->cycles < frameEnd)
+    {
+        while (replay->nextEvent < replay->eventCount && replay->events[replay->nextEvent].cycle <= chip8->cycles)
+        {
+            ReplayEvent *event = &replay->events[replay->nextEvent++];
+            chip8->key[event->key] = event->pressed;
+        }
+
+        uint64_t until = frameEnd;
+        if (replay->nextEvent < replay->eventCount && replay->events[replay->nextEvent].cycle < until)
+            until = replay->events[replay->nextEvent].cycle;
+
+        unsigned long wanted = until - chip8->cycles;
+        if (runCycles(chip8, wanted) < wanted)
+            return 1;
+    }
+    replay->frameEnd = 0;
+    updateTimers(chip8);
+    replay->frames++;
+
+    // checks sit on frame boundaries, so any we've passed were for this frame
+    while (replay->nextCheck < replay->checkCount && replay->checks[replay->nextCheck].cycle <= chip8->cycles)
+    {
+        ReplayCheck *check = &replay->checks[replay->nextCheck++];
+        if (check->cycle != chip8->cycles || check->hash != stateHash(chip8))
+            return -1;
+    }
+
+    return 1;
+}
+
+// returns 0 on success, -1 if the file couldn't be written
+int replaySave(const Replay *replay, const char *path)
+{
+    ReplayHeader header = {
+        REPLAY_MAGIC, REPLAY_VERSION, CHIP8_STATE_SIZE, replay->instructionsPerFrame,
+        replay->eventCount, replay->checkCount, replay->endCycle
+    };
+    FILE *file = fopen(path, "wb");
+
+    if (file == NULL)
+        return -1;
+
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(replay->start, CHIP8_STATE_SIZE, 1, file) == 1
+        && fwrite(replay->events, sizeof(ReplayEvent), replay->eventCount, file) == replay->eventCount
+        && fwrite(replay->checks, sizeof(ReplayCheck), replay->checkCount, file) == replay->checkCount;
+
+    if (fclose(file) != 0 || !ok)
+        return -1;
+    return 0;
+}
+
+// returns NULL if the file is missing, short or from another layout
+Replay *replayLoad(const char *path)
+{
+    ReplayHeader header;
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL)
+        return NULL;
+
+    Replay *replay = replayCreate();
+    int ok = replay != NULL
+        && fread(&header, sizeof(header), 1, file) == 1
+        && header.magic == REPLAY_MAGIC
+        && header.version == REPLAY_VERSION
+        && header.stateSize == CHIP8_STATE_SIZE
+        && header.instructionsPerFrame > 0
+        && fread(replay->start, CHIP8_STATE_SIZE, 1, file) == 1;
+
+    if (ok)
+    {
+        replay->instructionsPerFrame = header.instructionsPerFrame;
+        replay->hashInterval = 1;
+        replay->endCycle = header.endCycle;
+        ok = replayReserve((void **)&replay->events, &replay->eventCapacity, header.eventCount, sizeof(ReplayEvent))
+            && replayReserve((void **)&replay->checks, &replay->checkCapacity, header.checkCount, sizeof(ReplayCheck))
+            && fread(replay->events, sizeof(ReplayEvent), header.eventCount, file) == header.eventCount
+            && fread(replay->checks, sizeof(ReplayCheck), header.checkCount, file) == header.checkCount;
+        replay->eventCount = header.eventCount;
+        replay->checkCount = header.checkCount;
+    }
+
+    fclose(file);
+
+    if (!ok)
+    {
+        if (replay != NULL)
+            replayDestroy(replay);
+        return NULL;
+    }
+
+    return replay;
+}
+
+#endif
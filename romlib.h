@@ -0,0 +1,448 @@
+#ifndef ROMLIB_H
+#define ROMLIB_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "chip8.h"
+
+/* ROM library
+
+    Maps ROMs into memory once and hands them out by name or by content hash,
+    for runs that start many machines from the same few ROMs. A library is
+    filled from single files, directories of ROMs or pack files. A pack is
+    one file holding a header, a table of entries and then the ROMs back to
+    back (see romLibraryWritePack()). A pack is a single mapping and needs no
+    directory scan, so it is the quickest way to open thousands of ROMs.
+
+    ROMs are never read() into a buffer: a file or pack is mmap'd read-only
+    and romLoad() copies the bytes from the mapping straight into the
+    machine's memory. The mapped pages are shared with every other process
+    mapping the same file. Every ROM is indexed by the FNV-1a 64 hash of its
+    contents; ROMs with the same contents under different names share one
+    mapping. Sizes are checked as ROMs are added: empty ROMs and ROMs larger
+    than program space are refused.
+*/
+
+#define ROMPACK_MAGIC 0x4B503843 // "C8PK"
+#define ROMPACK_VERSION 1
+#define ROM_NAME_SIZE 48
+
+typedef struct RomPackHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t reserved;
+} RomPackHeader;
+
+// ROM bytes live at offset from the start of the pack
+typedef struct RomPackEntry {
+    uint64_t hash;
+    uint32_t offset;
+    uint32_t size;
+    char name[ROM_NAME_SIZE];
+} RomPackEntry;
+
+typedef struct RomEntry {
+    char name[ROM_NAME_SIZE];  // file name without the directory
+    const unsigned char *data; // inside one of the library's mappings
+    uint32_t size;
+    uint64_t hash;
+} RomEntry;
+
+typedef struct RomMapping {
+    void *address;
+    size_t length;
+} RomMapping;
+
+typedef struct RomLibrary {
+    RomEntry *entries;
+    int count;
+    int capacity;
+
+    // open addressed on the content hash, entry index + 1 per slot, 0 when empty --
+    // holds the first entry with each content only
+    int *index;
+    int indexSize; // power of two, kept at least twice count
+
+    RomMapping *mappings;
+    int mappingCount;
+    int mappingCapacity;
+} RomLibrary;
+
+uint64_t romHash(const unsigned char *data, size_t size)
+{
+    uint64_t hash = 0xCBF29CE484222325ULL;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+RomLibrary *romLibraryCreate()
+{
+    return calloc(1, sizeof(RomLibrary));
+}
+
+void romLibraryDestroy(RomLibrary *library)
+{
+    for (int i = 0; i < library->mappingCount; i++)
+        munmap(library->mappings[i].address, library->mappings[i].length);
+    free(library->mappings);
+    free(library->entries);
+    free(library->index);
+    free(library);
+}
+
+// the first entry with these contents, or NULL
+const RomEntry *romFind(const RomLibrary *library, uint64_t hash, const unsigned char *data, uint32_t size)
+{
+    if (library->indexSize == 0)
+        return NULL;
+
+    for (int slot = hash & (library->indexSize - 1); library->index[slot] != 0; slot = (slot + 1) & (library->indexSize - 1))
+    {
+        const RomEntry *entry = &library->entries[library->index[slot] - 1];
+        if (entry->hash == hash && (data == NULL || (entry->size == size && memcmp(entry->data, data, size) == 0)))
+            return entry;
+    }
+
+    return NULL;
+}
+
+// any ROM with this content hash, or NULL
+const RomEntry *romFindHash(const RomLibrary *library, uint64_t hash)
+{
+    return romFind(library, hash, NULL, 0);
+}
+
+const RomEntry *romFindName(const RomLibrary *library, const char *name)
+{
+    for (int i = 0; i < library->count; i++)
+    {
+        if (strcmp(library->entries[i].name, name) == 0)
+            return &library->entries[i];
+    }
+
+    return NULL;
+}
+
+// returns 0 if the allocation failed
+static int romIndexGrow(RomLibrary *library)
+{
+    int size = library->indexSize != 0 ? library->indexSize * 2 : 64;
+    int *index = calloc(size, sizeof(int));
+    if (index == NULL)
+        return 0;
+
+    free(library->index);
+    library->index = index;
+    library->indexSize = size;
+
+    for (int i = 0; i < library->count; i++)
+    {
+        RomEntry *entry = &library->entries[i];
+        if (romFind(library, entry->hash, entry->data, entry->size) != NULL)
+            continue;
+
+        int slot = entry->hash & (size - 1);
+        while (index[slot] != 0)
+            slot = (slot + 1) & (size - 1);
+        index[slot] = i + 1;
+    }
+
+    return 1;
+}
+
+// validates and indexes a mapped ROM -- returns its entry, or one of the ROM_* errors
+static int romAdd(RomLibrary *library, const char *name, const unsigned char *data, size_t size, uint64_t hash)
+{
+    if (size == 0)
+        return ROM_EMPTY;
+    if (size > CHIP8_MAX_ROM)
+        return ROM_TOO_LARGE;
+
+    if (library->count == library->capacity)
+    {
+        int capacity = library->capacity != 0 ? library->capacity * 2 : 64;
+        RomEntry *entries = realloc(library->entries, capacity * sizeof(RomEntry));
+        if (entries == NULL)
+            return ROM_UNREADABLE;
+        library->entries = entries;
+        library->capacity = capacity;
+    }
+    if ((library->count + 1) * 2 > library->indexSize && !romIndexGrow(library))
+        return ROM_UNREADABLE;
+
+    // a duplicate shares the first copy's bytes, the caller drops its own mapping
+    const RomEntry *same = romFind(library, hash, data, size);
+    RomEntry *entry = &library->entries[library->count];
+
+    const char *base = strrchr(name, '/');
+    snprintf(entry->name, sizeof(entry->name), "%s", base != NULL ? base + 1 : name);
+    entry->data = same != NULL ? same->data : data;
+    entry->size = size;
+    entry->hash = hash;
+
+    if (same == NULL)
+    {
+        int slot = hash & (library->indexSize - 1);
+        while (library->index[slot] != 0)
+            slot = (slot + 1) & (library->indexSize - 1);
+        library->index[slot] = library->count + 1;
+    }
+
+    return library->count++;
+}
+
+// keeps a mapping alive until the library is destroyed -- returns 0 if the allocation failed
+static int romKeepMapping(RomLibrary *library, void *address, size_t length)
+{
+    if (library->mappingCount == library->mappingCapacity)
+    {
+        int capacity = library->mappingCapacity != 0 ? library->mappingCapacity * 2 : 16;
+        RomMapping *mappings = realloc(library->mappings, capacity * sizeof(RomMapping));
+        if (mappings == NULL)
+            return 0;
+        library->mappings = mappings;
+        library->mappingCapacity = capacity;
+    }
+
+    library->mappings[library->mappingCount].address = address;
+    library->mappings[library->mappingCount].length = length;
+    library->mappingCount++;
+    return 1;
+}
+
+// maps a whole file read-only -- returns NULL on error, with *result set to why
+static void *romMapFile(const char *path, size_t *length, int *result)
+{
+    struct stat info;
+    int fd = open(path, O_RDONLY);
+
+    *result = ROM_UNREADABLE;
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        close(fd);
+        return NULL;
+    }
+    if (info.st_size == 0)
+    {
+        *result = ROM_EMPTY;
+        close(fd);
+        return NULL;
+    }
+
+    void *address = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED)
+        return NULL;
+
+    *length = info.st_size;
+    *result = ROM_OK;
+    return address;
+}
+
+// adds one ROM file -- returns its entry index, or one of the ROM_* errors
+int romLibraryAddFile(RomLibrary *library, const char *path)
+{
+    size_t length;
+    int result;
+    unsigned char *data = romMapFile(path, &length, &result);
+
+    if (data == NULL)
+        return result;
+    if (length > CHIP8_MAX_ROM)
+    {
+        munmap(data, length);
+        return ROM_TOO_LARGE;
+    }
+
+    if (!romKeepMapping(library, data, length))
+    {
+        munmap(data, length);
+        return ROM_UNREADABLE;
+    }
+
+    result = romAdd(library, path, data, length, romHash(data, length));
+    if (result < 0 || library->entries[result].data != data)
+    {
+        // refused, or a duplicate sharing an earlier mapping -- nothing points into this one
+        library->mappingCount--;
+        munmap(data, length);
+    }
+
+    return result;
+}
+
+// adds every ROM-sized regular file in a directory, skipping the rest --
+// returns how many were added, or ROM_UNREADABLE if the directory couldn't be read
+int romLibraryAddDirectory(RomLibrary *library, const char *path)
+{
+    DIR *directory = opendir(path);
+    struct dirent *file;
+    char filePath[4096];
+    int added = 0;
+
+    if (directory == NULL)
+        return ROM_UNREADABLE;
+
+    while ((file = readdir(directory)) != NULL)
+    {
+        if (file->d_name[0] == '.')
+            continue;
+
+        snprintf(filePath, sizeof(filePath), "%s/%s", path, file->d_name);
+        if (romLibraryAddFile(library, filePath) >= 0)
+            added++;
+    }
+
+    closedir(directory);
+    return added;
+}
+
+// adds every ROM in a pack -- returns how many, ROM_UNREADABLE if the file is
+// missing or isn't a pack, or another ROM_* error for a pack entry that is out of bounds
+int romLibraryAddPack(RomLibrary *library, const char *path)
+{
+    size_t length;
+    int result;
+    unsigned char *pack = romMapFile(path, &length, &result);
+
+    if (pack == NULL)
+        return result;
+
+    const RomPackHeader *header = (const RomPackHeader *)pack;
+    const RomPackEntry *table = (const RomPackEntry *)(pack + sizeof(RomPackHeader));
+
+    if (length < sizeof(RomPackHeader)
+        || header->magic != ROMPACK_MAGIC
+        || header->version != ROMPACK_VERSION
+        || header->count > (length - sizeof(RomPackHeader)) / sizeof(RomPackEntry))
+    {
+        munmap(pack, length);
+        return ROM_UNREADABLE;
+    }
+
+    // validate the whole table before adding anything
+    for (uint32_t i = 0; i < header->count; i++)
+    {
+        if (table[i].offset > length || table[i].size > length - table[i].offset)
+        {
+            munmap(pack, length);
+            return ROM_UNREADABLE;
+        }
+        if (table[i].size == 0 || table[i].size > CHIP8_MAX_ROM)
+        {
+            munmap(pack, length);
+            return table[i].size == 0 ? ROM_EMPTY : ROM_TOO_LARGE;
+        }
+    }
+
+    if (!romKeepMapping(library, pack, length))
+    {
+        munmap(pack, length);
+        return ROM_UNREADABLE;
+    }
+
+    // the stored hashes are trusted, so opening a pack never touches the ROM bytes
+    int added = 0;
+    for (uint32_t i = 0; i < header->count; i++)
+    {
+        char name[ROM_NAME_SIZE + 1];
+        memcpy(name, table[i].name, ROM_NAME_SIZE);
+        name[ROM_NAME_SIZE] = '\0';
+
+        if (romAdd(library, name, pack + table[i].offset, table[i].size, table[i].hash) >= 0)
+            added++;
+    }
+
+    return added;
+}
+
+// a pack, a directory or a single ROM, by what path turns out to be -- returns NULL on error
+RomLibrary *romLibraryOpen(const char *path)
+{
+    struct stat info;
+    RomLibrary *library = romLibraryCreate();
+    int result;
+
+    if (library == NULL || stat(path, &info) != 0)
+        result = ROM_UNREADABLE;
+    else if (S_ISDIR(info.st_mode))
+        result = romLibraryAddDirectory(library, path);
+    else if ((result = romLibraryAddPack(library, path)) == ROM_UNREADABLE)
+        result = romLibraryAddFile(library, path);
+
+    if (result < 0)
+    {
+        if (library != NULL)
+            romLibraryDestroy(library);
+        return NULL;
+    }
+
+    return library;
+}
+
+// writes the library out as a pack, one copy of each distinct ROM -- returns 0 on success, -1 on error
+int romLibraryWritePack(const RomLibrary *library, const char *path)
+{
+    RomPackHeader header = { ROMPACK_MAGIC, ROMPACK_VERSION, library->count, 0 };
+    RomPackEntry *table = calloc(library->count > 0 ? library->count : 1, sizeof(RomPackEntry));
+    FILE *file = fopen(path, "wb");
+    uint32_t offset = sizeof(RomPackHeader) + library->count * sizeof(RomPackEntry);
+    int ok = table != NULL && file != NULL;
+
+    // duplicates point at the first copy's bytes
+    for (int i = 0; ok && i < library->count; i++)
+    {
+        const RomEntry *entry = &library->entries[i];
+        const RomEntry *first = romFind(library, entry->hash, entry->data, entry->size);
+
+        table[i].hash = entry->hash;
+        table[i].size = entry->size;
+        memcpy(table[i].name, entry->name, ROM_NAME_SIZE);
+        if (first == entry)
+        {
+            table[i].offset = offset;
+            offset += entry->size;
+        }
+        else
+        {
+            table[i].offset = table[first - library->entries].offset;
+        }
+    }
+
+    ok = ok && fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(table, sizeof(RomPackEntry), library->count, file) == (size_t)library->count;
+    for (int i = 0; ok && i < library->count; i++)
+    {
+        const RomEntry *entry = &library->entries[i];
+        if (romFind(library, entry->hash, entry->data, entry->size) == entry)
+            ok = fwrite(entry->data, 1, entry->size, file) == entry->size;
+    }
+
+    free(table);
+    if (file != NULL && fclose(file) != 0)
+        ok = 0;
+    return ok ? 0 : -1;
+}
+
+// loads a library ROM into program space -- one copy, straight out of the mapping
+void romLoad(Chip8 *chip8, const RomEntry *rom)
+{
+    loadGameFromMemory(chip8, rom->data, rom->size);
+}
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef RUNAHEAD_H
+#define RUNAHEAD_H
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "chip8.h"
+#include "savestate.h"
+
+/* Run-ahead -- showing the frame the game will draw `frames` frames from now
+
+    Games poll the keys and take a frame or more to draw the reaction. With
+    run-ahead the real machine runs as usual, then every host frame it is
+    saved, run `frames` more frames with the keys currently held, the
+    display it ends up with is what gets shown, and the saved state is put
+    back with restoreState(). If the keys don't change, the frames run ahead
+    are exactly the frames the machine will run next, so the picture is just
+    earlier; when they do, the reaction is on screen up to `frames` frames
+    sooner.
+
+    Only the display comes from the future -- sound, recordings and rewind
+    all follow the real machine.
+
+    The saving is measured rather than assumed: after a key press, the
+    number of frames until the shown display changes and until the real
+    machine's display changes are counted, and runAheadReport() prints the
+    averages. Presses nothing on screen reacts to within
+    RUNAHEAD_MAX_LATENCY frames aren't counted.
+*/
+
+#define RUNAHEAD_MAX_FRAMES 8
+#define RUNAHEAD_MAX_LATENCY 60
+
+typedef struct RunAhead {
+    int frames;
+    unsigned char saved[CHIP8_STATE_SIZE];
+    uint64_t shown[32]; // display last handed out to be shown
+    uint64_t real[32];  // display the real machine had after the last frame
+
+    // latency of the key press being measured, in frames, 0 while still waiting
+    int measuring;
+    int waited;
+    int shownLatency;
+    int realLatency;
+
+    unsigned long long presses;     // measured
+    unsigned long long unanswered;  // nothing changed on screen in time
+    unsigned long long shownFrames; // summed latencies
+    unsigned long long realFrames;
+} RunAhead;
+
+void runAheadInit(RunAhead *ahead, int frames, const Chip8 *chip8)
+{
+    memset(ahead, 0, sizeof(RunAhead));
+    ahead->frames = frames;
+    memcpy(ahead->shown, chip8->gfx, sizeof(ahead->shown));
+    memcpy(ahead->real, chip8->gfx, sizeof(ahead->real));
+}
+
+// a key was pressed before this frame -- starts timing it unless one already is
+void runAheadKeyPressed(RunAhead *ahead)
+{
+    if (ahead->measuring)
+        return;
+
+    ahead->measuring = 1;
+    ahead->waited = 0;
+    ahead->shownLatency = 0;
+    ahead->realLatency = 0;
+}
+
+static void runAheadMeasure(RunAhead *ahead, int shownChanged, int realChanged)
+{
+    if (!ahead->measuring)
+        return;
+
+    ahead->waited++;
+    if (shownChanged && ahead->shownLatency == 0)
+        ahead->shownLatency = ahead->waited;
+    if (realChanged && ahead->realLatency == 0)
+        ahead->realLatency = ahead->waited;
+
+    if (ahead->shownLatency != 0 && ahead->realLatency != 0)
+    {
+        ahead->presses++;
+        ahead->shownFrames += ahead->shownLatency;
+        ahead->realFrames += ahead->realLatency;
+        ahead->measuring = 0;
+    }
+    else if (ahead->waited == RUNAHEAD_MAX_LATENCY)
+    {
+        ahead->unanswered++;
+        ahead->measuring = 0;
+    }
+}
+
+// Call after the real machine has run its frame. Runs ahead and puts the
+// machine back, clearing drawFlag -- returns the display to show, or NULL
+// if it is the same as last time.
+const uint64_t *runAheadFrame(RunAhead *ahead, Chip8 *chip8, int instructionsPerFrame)
+{
+    int realChanged = memcmp(chip8->gfx, ahead->real, sizeof(ahead->real)) != 0;
+    memcpy(ahead->real, chip8->gfx, sizeof(ahead->real));
+
+    // the frames run ahead are never really run -- they stay out of the
+    // profile, the debugger and the trace, and out of the idle count
+    uint64_t idleCycles = chip8->idleCycles;
+#ifdef CHIP8_PROFILE
+    Chip8Profile *profile = chip8->profile;
+    chip8->profile = NULL;
+#endif
+#ifdef CHIP8_DEBUGGER
+    struct Chip8Debug *debug = chip8->debug;
+    chip8->debug = NULL;
+#endif
+#ifdef CHIP8_TRACE
+    struct Chip8Trace *trace = chip8->trace;
+    chip8->trace = NULL;
+#endif
+
+    saveState(chip8, ahead->saved);
+    runFrames(chip8, ahead->frames, instructionsPerFrame);
+    int shownChanged = memcmp(chip8->gfx, ahead->shown, sizeof(ahead->shown)) != 0;
+    if (shownChanged)
+        memcpy(ahead->shown, chip8->gfx, sizeof(ahead->shown));
+    restoreState(chip8, ahead->saved);
+    chip8->drawFlag = 0;
+
+    chip8->idleCycles = idleCycles;
+#ifdef CHIP8_PROFILE
+    chip8->profile = profile;
+#endif
+#ifdef CHIP8_DEBUGGER
+    chip8->debug = debug;
+#endif
+#ifdef CHIP8_TRACE
+    chip8->trace = trace;
+#endif
+
+    runAheadMeasure(ahead, shownChanged, realChanged);
+    return shownChanged ? ahead->shown : NULL;
+}
+
+// prints the measured latencies as "name value" lines, like bench
+void runAheadReport(const RunAhead *ahead, FILE *out)
+{
+    double shown = ahead->presses ? (double)ahead->shownFrames / ahead->presses : 0;
+    double real = ahead->presses ? (double)ahead->realFrames / ahead->presses : 0;
+
+    fprintf(out, "runahead.frames %d\n", ahead->frames);
+    fprintf(out, "runahead.presses %llu\n", ahead->presses);
+    fprintf(out, "runahead.unanswered %llu\n", ahead->unanswered);
+    fprintf(out, "runahead.latency.frames %.2f\n", shown);
+    fprintf(out, "runahead.baseline.frames %.2f\n", real);
+    fprintf(out, "runahead.saved.ms %.1f\n", (real - shown) * 1000.0 / 60);
+}
+
+#endif
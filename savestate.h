@@ -0,0 +1,350 @@
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "chip8.h"
+
+/* Savestates and rewind
+
+    The machine state is everything in Chip8 before the decode cache, so a
+    savestate is a single memcpy of that prefix and loading one is a memcpy
+    plus dropping the decode cache. State files add a small header so a file
+    written by a build with a different Chip8 layout is refused.
+
+    The rewind buffer keeps one snapshot per frame in a fixed-size byte arena.
+    Every keyframeInterval frames a keyframe is stored; the frames in between
+    store the XOR of the state against their keyframe, run-length encoded on
+    the zero runs -- usually a few dozen bytes since a frame only touches a
+    handful of registers, stack slots, display rows and RAM bytes. When the
+    arena or slot ring fills up the oldest snapshots are dropped, always back
+    to a keyframe so every remaining delta can still be decoded.
+*/
+
+#define CHIP8_STATE_SIZE offsetof(Chip8, decoded)
+#define SAVESTATE_MAGIC 0x54533843 // "C8ST"
+#define SAVESTATE_VERSION 3
+
+typedef struct SaveStateHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+} SaveStateHeader;
+
+// copies the machine state into buffer (CHIP8_STATE_SIZE bytes)
+void saveState(const Chip8 *chip8, void *buffer)
+{
+    memcpy(buffer, chip8, CHIP8_STATE_SIZE);
+}
+
+void loadState(Chip8 *chip8, const void *buffer)
+{
+    memcpy(chip8, buffer, CHIP8_STATE_SIZE);
+    memset(chip8->decoded, 0, sizeof(chip8->decoded));
+}
+
+// loadState() for a state this same machine was saved in a moment ago: only
+// memory that changed since is copied back and dropped from the decode
+// cache, so going back a few frames costs a compare instead of a cache wipe
+void restoreState(Chip8 *chip8, const void *buffer)
+{
+    const unsigned char *saved = buffer;
+    const unsigned char *memory = saved + offsetof(Chip8, memory);
+    size_t afterMemory = offsetof(Chip8, memory) + sizeof(chip8->memory);
+
+    for (int i = 0; i < (int)sizeof(chip8->memory); i += 64)
+    {
+        if (memcmp(chip8->memory + i, memory + i, 64) != 0)
+        {
+            memcpy(chip8->memory + i, memory + i, 64);
+            invalidateDecoded(chip8, i, 64);
+        }
+    }
+
+    memcpy(chip8, saved, offsetof(Chip8, memory));
+    memcpy((unsigned char *)chip8 + afterMemory, saved + afterMemory, CHIP8_STATE_SIZE - afterMemory);
+}
+
+// returns 0 on success, -1 if the file couldn't be written
+int saveStateFile(const Chip8 *chip8, const char *path)
+{
+    SaveStateHeader header = { SAVESTATE_MAGIC, SAVESTATE_VERSION, CHIP8_STATE_SIZE };
+    FILE *file = fopen(path, "wb");
+
+    if (file == NULL)
+        return -1;
+
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(chip8, CHIP8_STATE_SIZE, 1, file) == 1;
+
+    if (fclose(file) != 0 || !ok)
+        return -1;
+    return 0;
+}
+
+// returns 0 on success, -1 if the file is missing, short or from another layout
+int loadStateFile(Chip8 *chip8, const char *path)
+{
+    unsigned char buffer[CHIP8_STATE_SIZE];
+    SaveStateHeader header;
+    FILE *file = fopen(path, "rb");
+
+    if (file == NULL)
+        return -1;
+
+    int ok = fread(&header, sizeof(header), 1, file) == 1
+        && header.magic == SAVESTATE_MAGIC
+        && header.version == SAVESTATE_VERSION
+        && header.size == CHIP8_STATE_SIZE
+        && fread(buffer, CHIP8_STATE_SIZE, 1, file) == 1;
+
+    fclose(file);
+
+    if (!ok)
+        return -1;
+
+    loadState(chip8, buffer);
+    return 0;
+}
+
+static size_t rewindPutVarint(unsigned char *out, size_t value)
+{
+    size_t length = 0;
+
+    while (value >= 0x80)
+    {
+        out[length++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    out[length++] = value;
+
+    return length;
+}
+
+static size_t rewindGetVarint(const unsigned char *in, size_t *value)
+{
+    size_t length = 0;
+    int shift = 0;
+
+    *value = 0;
+    while (in[length] & 0x80)
+    {
+        *value |= (size_t)(in[length++] & 0x7F) << shift;
+        shift += 7;
+    }
+    *value |= (size_t)in[length++] << shift;
+
+    return length;
+}
+
+// worst case: every literal run interrupted by a single zero
+#define REWIND_MAX_ENCODED (CHIP8_STATE_SIZE + CHIP8_STATE_SIZE / 2 * 4 + 16)
+
+// encodes state XOR base as (zero run, literal run, literal bytes) triples
+static size_t rewindEncode(const unsigned char *state, const unsigned char *base, unsigned char *out)
+{
+    size_t length = 0;
+    size_t i = 0;
+
+    while (i < CHIP8_STATE_SIZE)
+    {
+        size_t zeros = 0;
+        while (i + zeros < CHIP8_STATE_SIZE && state[i + zeros] == base[i + zeros])
+            zeros++;
+        i += zeros;
+
+        // literals run until the next pair of unchanged bytes
+        size_t literals = 0;
+        while (i + literals < CHIP8_STATE_SIZE
+            && (state[i + literals] != base[i + literals]
+                || (i + literals + 1 < CHIP8_STATE_SIZE && state[i + literals + 1] != base[i + literals + 1])))
+            literals++;
+
+        length += rewindPutVarint(out + length, zeros);
+        length += rewindPutVarint(out + length, literals);
+        for (size_t j = 0; j < literals; j++)
+            out[length++] = state[i + j] ^ base[i + j];
+        i += literals;
+    }
+
+    return length;
+}
+
+// XORs an encoded delta into state (which holds the base on entry)
+static void rewindDecode(const unsigned char *in, size_t length, unsigned char *state)
+{
+    size_t read = 0;
+    size_t i = 0;
+
+    while (read < length)
+    {
+        size_t zeros, literals;
+        read += rewindGetVarint(in + read, &zeros);
+        read += rewindGetVarint(in + read, &literals);
+
+        i += zeros;
+        for (size_t j = 0; j < literals; j++)
+            state[i++] ^= in[read++];
+    }
+}
+
+typedef struct RewindSlot {
+    uint64_t start;   // virtual arena offset, physical = start % arenaSize
+    uint32_t length;
+    int keyframe;     // slot index of this snapshot's keyframe (itself for keyframes)
+} RewindSlot;
+
+typedef struct RewindBuffer {
+    unsigned char *arena;
+    size_t arenaSize;
+    uint64_t written; // virtual offset of the next entry
+
+    RewindSlot *slots;
+    int slotCount;
+    int oldest;       // index of the oldest live slot
+    int count;        // live slots
+
+    int keyframeInterval;
+    int sinceKeyframe;
+    int keyframeSlot;                       // -1 when the next snapshot must be a keyframe
+    unsigned char base[CHIP8_STATE_SIZE];   // decoded state of keyframeSlot
+    unsigned char scratch[REWIND_MAX_ENCODED];
+} RewindBuffer;
+
+// returns NULL if the buffers couldn't be allocated
+RewindBuffer *rewindCreate(size_t arenaSize, int slotCount, int keyframeInterval)
+{
+    RewindBuffer *rewind = calloc(1, sizeof(RewindBuffer));
+    if (rewind == NULL)
+        return NULL;
+
+    rewind->arena = malloc(arenaSize);
+    rewind->slots = calloc(slotCount, sizeof(RewindSlot));
+    if (rewind->arena == NULL || rewind->slots == NULL || arenaSize < REWIND_MAX_ENCODED)
+    {
+        free(rewind->arena);
+        free(rewind->slots);
+        free(rewind);
+        return NULL;
+    }
+
+    rewind->arenaSize = arenaSize;
+    rewind->slotCount = slotCount;
+    rewind->keyframeInterval = keyframeInterval;
+    rewind->keyframeSlot = -1;
+
+    return rewind;
+}
+
+void rewindDestroy(RewindBuffer *rewind)
+{
+    free(rewind->arena);
+    free(rewind->slots);
+    free(rewind);
+}
+
+static int rewindSlotIndex(const RewindBuffer *rewind, int age)
+{
+    return (rewind->oldest + age) % rewind->slotCount;
+}
+
+// drops the oldest snapshot, then any deltas left without their keyframe
+static void rewindDropOldest(RewindBuffer *rewind)
+{
+    do
+    {
+        if (rewind->oldest == rewind->keyframeSlot)
+            rewind->keyframeSlot = -1;
+        rewind->oldest = (rewind->oldest + 1) % rewind->slotCount;
+        rewind->count--;
+    }
+    while (rewind->count > 0 && rewind->slots[rewind->oldest].keyframe != rewind->oldest);
+}
+
+// records the current state as the newest snapshot
+void rewindPush(RewindBuffer *rewind, const Chip8 *chip8)
+{
+    static const unsigned char zero[CHIP8_STATE_SIZE];
+    const unsigned char *state = (const unsigned char *)chip8;
+    int keyframe = rewind->keyframeSlot == -1 || rewind->sinceKeyframe >= rewind->keyframeInterval;
+
+    // keyframes are deltas against all zeroes, which squeezes out empty RAM
+    size_t length = rewindEncode(state, keyframe ? zero : rewind->base, rewind->scratch);
+
+    // entries never straddle the end of the arena
+    uint64_t start = rewind->written;
+    if (start % rewind->arenaSize + length > rewind->arenaSize)
+        start += rewind->arenaSize - start % rewind->arenaSize;
+
+    while (rewind->count > 0
+        && (rewind->count == rewind->slotCount
+            || rewind->slots[rewind->oldest].start + rewind->arenaSize < start + length))
+        rewindDropOldest(rewind);
+
+    // the keyframe this delta needs may just have been dropped
+    if (!keyframe && rewind->keyframeSlot == -1)
+    {
+        rewindPush(rewind, chip8);
+        return;
+    }
+
+    int index = rewindSlotIndex(rewind, rewind->count);
+    memcpy(rewind->arena + start % rewind->arenaSize, rewind->scratch, length);
+    rewind->slots[index].start = start;
+    rewind->slots[index].length = length;
+    rewind->written = start + length;
+    rewind->count++;
+
+    if (keyframe)
+    {
+        rewind->slots[index].keyframe = index;
+        rewind->keyframeSlot = index;
+        rewind->sinceKeyframe = 0;
+        memcpy(rewind->base, state, CHIP8_STATE_SIZE);
+    }
+    else
+    {
+        rewind->slots[index].keyframe = rewind->keyframeSlot;
+    }
+    rewind->sinceKeyframe++;
+}
+
+// restores the newest snapshot and removes it -- returns 0 when there is nothing left
+int rewindPop(RewindBuffer *rewind, Chip8 *chip8)
+{
+    unsigned char *state = rewind->scratch;
+
+    if (rewind->count == 0)
+        return 0;
+
+    int index = rewindSlotIndex(rewind, rewind->count - 1);
+    RewindSlot *slot = &rewind->slots[index];
+
+    // make sure base holds this snapshot's keyframe
+    if (slot->keyframe != rewind->keyframeSlot)
+    {
+        RewindSlot *key = &rewind->slots[slot->keyframe];
+        memset(rewind->base, 0, CHIP8_STATE_SIZE);
+        rewindDecode(rewind->arena + key->start % rewind->arenaSize, key->length, rewind->base);
+        rewind->keyframeSlot = slot->keyframe;
+    }
+
+    memcpy(state, rewind->base, CHIP8_STATE_SIZE);
+    if (slot->keyframe != index)
+        rewindDecode(rewind->arena + slot->start % rewind->arenaSize, slot->length, state);
+
+    rewind->count--;
+    rewind->written = slot->start;
+
+    // new snapshots continue as deltas of this keyframe unless it was just popped
+    if (slot->keyframe == index)
+        rewind->keyframeSlot = -1;
+    else
+        rewind->sinceKeyframe = (index - slot->keyframe + rewind->slotCount) % rewind->slotCount;
+
+    loadState(chip8, state);
+    return 1;
+}
+
+#endif
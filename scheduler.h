@@ -0,0 +1,86 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+
+/* Frame pacing for interactive and headless runs
+
+    Work happens in 60Hz frames (see runFrame() in chip8.h): a configurable
+    number of instructions followed by exactly one timer tick. The scheduler
+    only decides when the next frame may start. Deadlines are absolute on the
+    monotonic clock and advance by one period per frame, so an oversleep is
+    paid back on the next frame instead of accumulating. After falling more
+    than SCHEDULER_MAX_LAG frames behind (debugger stop, suspended laptop)
+    it resynchronises rather than running a burst of catch-up frames.
+
+    speed scales the frame rate: 1 is real time, 4 is 4x fast-forward and 0
+    is uncapped, in which case schedulerWait() never sleeps.
+*/
+
+#define SCHEDULER_FRAME_NS 16666667ULL
+#define SCHEDULER_MAX_LAG 5
+#define SCHEDULER_DEFAULT_IPF 11 // ~660 instructions per second
+
+typedef struct Chip8Scheduler {
+    int instructionsPerFrame;
+    double speed;
+    uint64_t period;       // nanoseconds per frame at this speed, 0 when uncapped
+    uint64_t nextDeadline; // monotonic nanoseconds
+    uint64_t frames;
+    uint64_t resyncs;
+} Chip8Scheduler;
+
+uint64_t schedulerNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void schedulerSetSpeed(Chip8Scheduler *scheduler, double speed)
+{
+    scheduler->speed = speed;
+    scheduler->period = speed > 0 ? (uint64_t)(SCHEDULER_FRAME_NS / speed) : 0;
+    scheduler->nextDeadline = schedulerNow() + scheduler->period;
+}
+
+void schedulerInit(Chip8Scheduler *scheduler, int instructionsPerFrame, double speed)
+{
+    scheduler->instructionsPerFrame = instructionsPerFrame > 0 ? instructionsPerFrame : SCHEDULER_DEFAULT_IPF;
+    scheduler->frames = 0;
+    scheduler->resyncs = 0;
+    schedulerSetSpeed(scheduler, speed);
+}
+
+// blocks until the next frame is due
+void schedulerWait(Chip8Scheduler *scheduler)
+{
+    scheduler->frames++;
+
+    if (scheduler->period == 0)
+        return;
+
+    uint64_t now = schedulerNow();
+
+    if (now > scheduler->nextDeadline + SCHEDULER_MAX_LAG * scheduler->period)
+    {
+        scheduler->nextDeadline = now + scheduler->period;
+        scheduler->resyncs++;
+        return;
+    }
+
+    if (now < scheduler->nextDeadline)
+    {
+        struct timespec deadline;
+        deadline.tv_sec = scheduler->nextDeadline / 1000000000ULL;
+        deadline.tv_nsec = scheduler->nextDeadline % 1000000000ULL;
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+            ;
+    }
+
+    scheduler->nextDeadline += scheduler->period;
+}
+
+#endif
@@ -0,0 +1,670 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "chip8.h"
+#include "savestate.h"
+
+/* Execution trace -- every instruction a machine ran, compressed to a file
+
+    Only compiled in with -DCHIP8_TRACE, and even then a machine runs on the
+    normal cores until a Chip8Trace is attached: runCycles() then takes the
+    traced cores (core.inc with CORE_TRACE), which append an 8 byte
+    TraceRecord per instruction -- its pc and opcode, and VX, VF and I as it
+    left them -- to a ring that belongs to the machine, so whichever thread
+    runs it is the only writer. Records are handed to a background thread
+    at the end of a runCycles() call once TRACE_PUBLISH of them have piled
+    up -- so the two threads aren't passing the same cache lines back and
+    forth every frame -- or when the ring fills up, in which case the
+    machine waits for room rather than leave a hole in the trace.
+
+    Besides instructions the ring carries what the reader needs to run the
+    machine again: a keyframe (the whole saved state) at the start of a call
+    at least every TRACE_SEGMENT instructions, and whenever the state
+    changed behind the trace's back (a loaded state, a rewind); the keys and
+    timers at the start of a call when they changed since the last one --
+    just a tick when the only change is the timers counting down once, as
+    between frames; and the idle laps the core skipped rather than ran. A
+    skip comes just before the instruction that found the idle loop -- the
+    laps end in the state they started in, so that makes no difference to
+    a rerun.
+
+    The background thread compresses each keyframe's segment on its own: a
+    record is compared with the last one at the same pc -- VX and I moved on
+    by the step they moved the last two times, so counters are predicted
+    too -- and with the pc that followed the previous instruction last
+    time, and only the fields that differ are written behind a byte saying
+    which. A loop the predictions hold for costs a byte per 64
+    instructions, and a tick one byte. Segments go to the file as they are
+    finished, or in flight recorder mode are kept in memory with the oldest
+    dropped once the rest hold the last `keep` instructions, and written
+    out by traceClose().
+
+    traceread.c reads the file back. File layout: TraceFileHeader, then per
+    segment a TraceSegmentHeader, the keyframe and the compressed records.
+*/
+
+#define TRACE_RING_RECORDS (1 << 20) // power of two, 8MB
+#define TRACE_SEGMENT (1 << 16)      // instructions between keyframes, at least
+#define TRACE_PUBLISH (1 << 12)      // records handed over at a time
+#define TRACE_MAGIC 0x52543843       // "C8TR"
+#define TRACE_SEGMENT_MAGIC 0x4D474553 // "SEGM"
+#define TRACE_VERSION 1
+
+// record kinds, in the top four bits of pc
+enum {
+    TRACE_INSTRUCTION = 0,
+    TRACE_SKIP,     // payload: instructions skipped
+    TRACE_INPUT,    // payload: key bits, delay timer << 16, sound timer << 24
+    TRACE_KEYFRAME, // payload: cycles, then TRACE_STATE_RECORDS records of state
+    TRACE_TICK,     // no payload: both timers counted down once, as updateTimers() does
+    TRACE_KINDS
+};
+
+typedef struct TraceRecord {
+    uint16_t pc;
+    uint16_t opcode;
+    uint8_t vx; // V[X] of the opcode after it ran
+    uint8_t vf;
+    uint16_t I;
+} TraceRecord;
+
+#define TRACE_STATE_RECORDS ((CHIP8_STATE_SIZE + sizeof(TraceRecord) - 1) / sizeof(TraceRecord))
+
+typedef struct TraceFileHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t stateSize;
+} TraceFileHeader;
+
+typedef struct TraceSegmentHeader {
+    uint32_t magic;
+    uint32_t length;       // compressed bytes after the keyframe
+    uint64_t firstCycle;   // chip8->cycles of the keyframe
+    uint64_t instructions; // skipped ones included
+} TraceSegmentHeader;
+
+// prediction tables, the same on both sides of the compression
+typedef struct TraceCodec {
+    TraceRecord last[4096];  // last record at each pc
+    uint8_t vxStep[4096];    // how far VX and I moved between the last two there
+    uint16_t iStep[4096];
+    uint8_t steady[4096];    // 1 if VX, 2 if I moved by the same step the time before
+    uint16_t nextPc[4096];   // pc that followed each pc last time
+    uint16_t expectPc;
+    uint16_t prevPc;
+    int hasPrev;
+    unsigned int run;        // records matching their prediction, not yet written / read
+} TraceCodec;
+
+typedef struct TraceSegment {
+    struct TraceSegment *next;
+    TraceSegmentHeader header;
+    unsigned char state[CHIP8_STATE_SIZE];
+    unsigned char *bytes;
+    size_t capacity;
+} TraceSegment;
+
+typedef struct TraceStats {
+    unsigned long long instructions; // skipped ones included
+    unsigned long long records;
+    unsigned long long keyframes;
+    unsigned long long bytes;        // written to the file, headers included
+    unsigned long long dropped;      // segments flight recorder mode let go
+    unsigned long long stalls;       // times the machine waited for room in the ring
+} TraceStats;
+
+typedef struct Chip8Trace {
+    TraceRecord *ring;
+    FILE *file;
+    unsigned long long keep; // flight recorder: instructions to keep, 0 to write everything
+    pthread_t thread;
+    atomic_int closing;
+
+    // each side's fields on its own cache line, as in capture.h
+    _Alignas(64) atomic_ullong published; // records the consumer may read
+    unsigned long long head;  // next record to write, producer only
+    unsigned long long limit; // head may go up to here before looking at tail again
+    unsigned long long publishedHead;
+    uint64_t expectCycles;    // chip8->cycles when the last call ended
+    uint64_t keyframeCycles;
+    int started;
+    uint16_t keys;
+    uint8_t delayTimer;
+    uint8_t soundTimer;
+    unsigned long long stalls;
+
+    _Alignas(64) atomic_ullong tail; // next record to read, consumer only
+    TraceSegment *current;
+    TraceSegment *oldest; // flight recorder: finished segments, oldest first
+    TraceSegment *newest;
+    unsigned long long kept;
+    size_t stateLeft; // keyframe records still to come
+    unsigned char state[CHIP8_STATE_SIZE];
+    uint64_t stateCycles;
+    TraceCodec codec;
+    int failed;
+    TraceStats stats;
+} Chip8Trace;
+
+static inline TraceRecord traceEvent(int kind, uint64_t value)
+{
+    TraceRecord record;
+    record.pc = kind << 12;
+    record.opcode = value & 0xFFFF;
+    record.vx = (value >> 16) & 0xFF;
+    record.vf = (value >> 24) & 0xFF;
+    record.I = (value >> 32) & 0xFFFF;
+    return record;
+}
+
+static inline uint64_t traceValue(TraceRecord record)
+{
+    return record.opcode | (uint64_t)record.vx << 16 | (uint64_t)record.vf << 24 | (uint64_t)record.I << 32;
+}
+
+static inline TraceRecord traceInstruction(unsigned short pc, unsigned short opcode, const unsigned char *V, unsigned short I)
+{
+    TraceRecord record;
+    record.pc = pc & 0xFFF;
+    record.opcode = opcode;
+    record.vx = V[(opcode >> 8) & 0xF];
+    record.vf = V[15];
+    record.I = I;
+    return record;
+}
+
+static void tracePublish(Chip8Trace *trace)
+{
+    trace->publishedHead = trace->head;
+    atomic_store_explicit(&trace->published, trace->head, memory_order_release);
+}
+
+// producer, ring full -- everything written so far goes to the consumer first
+static void traceMakeRoom(Chip8Trace *trace)
+{
+    const struct timespec wait = { 0, 100000 };
+
+    tracePublish(trace);
+    for (;;)
+    {
+        trace->limit = atomic_load_explicit(&trace->tail, memory_order_acquire) + TRACE_RING_RECORDS;
+        if (trace->limit != trace->head)
+            return;
+        trace->stalls++;
+        nanosleep(&wait, NULL);
+    }
+}
+
+static inline void tracePut(Chip8Trace *trace, TraceRecord record)
+{
+    if (trace->head == trace->limit)
+        traceMakeRoom(trace);
+    trace->ring[trace->head & (TRACE_RING_RECORDS - 1)] = record;
+    trace->head++;
+}
+
+static uint16_t traceKeys(const Chip8 *chip8)
+{
+    uint16_t keys = 0;
+    for (int i = 0; i < 16; i++)
+        keys |= (chip8->key[i] != 0) << i;
+    return keys;
+}
+
+// runCycles(), before a traced call -- a keyframe or whatever changed outside the machine
+void traceBegin(Chip8Trace *trace, const Chip8 *chip8)
+{
+    uint16_t keys = traceKeys(chip8);
+
+    if (!trace->started || chip8->cycles != trace->expectCycles || chip8->cycles - trace->keyframeCycles >= TRACE_SEGMENT)
+    {
+        TraceRecord state[TRACE_STATE_RECORDS];
+        memset(state, 0, sizeof(state));
+        memcpy(state, chip8, CHIP8_STATE_SIZE);
+
+        tracePut(trace, traceEvent(TRACE_KEYFRAME, chip8->cycles));
+        for (size_t i = 0; i < TRACE_STATE_RECORDS; i++)
+            tracePut(trace, state[i]);
+        trace->keyframeCycles = chip8->cycles;
+        trace->started = 1;
+    }
+    else if (keys != trace->keys || chip8->delay_timer != trace->delayTimer || chip8->sound_timer != trace->soundTimer)
+    {
+        int ticked = chip8->delay_timer == trace->delayTimer - (trace->delayTimer > 0)
+            && chip8->sound_timer == trace->soundTimer - (trace->soundTimer > 0);
+
+        if (keys == trace->keys && ticked)
+            tracePut(trace, traceEvent(TRACE_TICK, 0));
+        else
+            tracePut(trace, traceEvent(TRACE_INPUT, keys | chip8->delay_timer << 16 | (uint64_t)chip8->sound_timer << 24));
+    }
+
+    trace->keys = keys;
+}
+
+// runCycles(), after a traced call
+void traceEnd(Chip8Trace *trace, const Chip8 *chip8)
+{
+    trace->expectCycles = chip8->cycles;
+    trace->delayTimer = chip8->delay_timer;
+    trace->soundTimer = chip8->sound_timer;
+    if (trace->head - trace->publishedHead >= TRACE_PUBLISH)
+        tracePublish(trace);
+}
+
+static void traceCodecReset(TraceCodec *codec, unsigned short pc)
+{
+    memset(codec->last, 0, sizeof(codec->last));
+    memset(codec->vxStep, 0, sizeof(codec->vxStep));
+    memset(codec->iStep, 0, sizeof(codec->iStep));
+    memset(codec->steady, 0, sizeof(codec->steady));
+    for (int pc = 0; pc < 4096; pc++)
+        codec->nextPc[pc] = (pc + 2) & 0xFFF;
+    codec->expectPc = pc & 0xFFF;
+    codec->prevPc = 0;
+    codec->hasPrev = 0;
+    codec->run = 0;
+}
+
+// the record the tables expect next -- a whole record, so a run can be replayed from it
+static TraceRecord tracePredict(const TraceCodec *codec)
+{
+    TraceRecord record = codec->last[codec->expectPc];
+    if (codec->steady[codec->expectPc] & 1)
+        record.vx += codec->vxStep[codec->expectPc];
+    if (codec->steady[codec->expectPc] & 2)
+        record.I += codec->iStep[codec->expectPc];
+    return record;
+}
+
+static void traceLearn(TraceCodec *codec, TraceRecord record)
+{
+    if (codec->hasPrev)
+        codec->nextPc[codec->prevPc] = record.pc;
+    codec->prevPc = record.pc;
+    codec->hasPrev = 1;
+    uint8_t vxStep = record.vx - codec->last[record.pc].vx;
+    uint16_t iStep = record.I - codec->last[record.pc].I;
+    codec->steady[record.pc] = (vxStep == codec->vxStep[record.pc]) | (iStep == codec->iStep[record.pc]) << 1;
+    codec->vxStep[record.pc] = vxStep;
+    codec->iStep[record.pc] = iStep;
+    codec->last[record.pc] = record;
+    codec->expectPc = codec->nextPc[record.pc];
+}
+
+static void traceAppend(Chip8Trace *trace, const void *bytes, size_t length)
+{
+    TraceSegment *segment = trace->current;
+    size_t used = segment->header.length;
+
+    if (used + length > segment->capacity)
+    {
+        segment->capacity = segment->capacity ? segment->capacity * 2 : 4096;
+        segment->bytes = realloc(segment->bytes, segment->capacity);
+    }
+    memcpy(segment->bytes + used, bytes, length);
+    segment->header.length += length;
+}
+
+static void traceFlushRun(Chip8Trace *trace)
+{
+    while (trace->codec.run > 0)
+    {
+        unsigned int run = trace->codec.run > 64 ? 64 : trace->codec.run;
+        unsigned char byte = 0x40 | (run - 1);
+        traceAppend(trace, &byte, 1);
+        trace->codec.run -= run;
+    }
+}
+
+// one byte of which fields differ from the prediction (0x01 pc, 0x02 opcode,
+// 0x04 VX, 0x08 VF, 0x10 I) and then those fields, little-endian; 0x40 | n - 1
+// for n records matching theirs; 0x80 | kind and the payload as a varint
+// (7 bits a byte, low first) for an event, no payload for a tick
+static void traceEncode(Chip8Trace *trace, TraceRecord record)
+{
+    TraceCodec *codec = &trace->codec;
+    int kind = record.pc >> 12;
+
+    if (kind != TRACE_INSTRUCTION)
+    {
+        unsigned char bytes[8];
+        uint64_t value = traceValue(record);
+        size_t length = 1;
+
+        traceFlushRun(trace);
+        bytes[0] = 0x80 | kind;
+        if (kind != TRACE_TICK)
+        {
+            while (value >= 0x80)
+            {
+                bytes[length++] = (value & 0x7F) | 0x80;
+                value >>= 7;
+            }
+            bytes[length++] = value;
+        }
+        traceAppend(trace, bytes, length);
+        return;
+    }
+
+    TraceRecord predicted = tracePredict(codec);
+    unsigned char bytes[9];
+    size_t length = 1;
+
+    bytes[0] = 0;
+    if (record.pc != codec->expectPc)
+    {
+        bytes[0] |= 0x01;
+        bytes[length++] = record.pc & 0xFF;
+        bytes[length++] = record.pc >> 8;
+    }
+    if (record.opcode != predicted.opcode)
+    {
+        bytes[0] |= 0x02;
+        bytes[length++] = record.opcode & 0xFF;
+        bytes[length++] = record.opcode >> 8;
+    }
+    if (record.vx != predicted.vx)
+    {
+        bytes[0] |= 0x04;
+        bytes[length++] = record.vx;
+    }
+    if (record.vf != predicted.vf)
+    {
+        bytes[0] |= 0x08;
+        bytes[length++] = record.vf;
+    }
+    if (record.I != predicted.I)
+    {
+        bytes[0] |= 0x10;
+        bytes[length++] = record.I & 0xFF;
+        bytes[length++] = record.I >> 8;
+    }
+
+    if (bytes[0] == 0)
+    {
+        codec->run++;
+    }
+    else
+    {
+        traceFlushRun(trace);
+        traceAppend(trace, bytes, length);
+    }
+    traceLearn(codec, record);
+}
+
+// reader -- the next record from a segment's compressed bytes: 1 with it in
+// record, 0 at the end, -1 if the bytes are cut short
+int traceDecode(TraceCodec *codec, const unsigned char *bytes, size_t length, size_t *position, TraceRecord *record)
+{
+    if (codec->run == 0)
+    {
+        if (*position >= length)
+            return 0;
+
+        unsigned char head = bytes[(*position)++];
+        if (head & 0x80)
+        {
+            uint64_t value = 0;
+            if ((head & 0x0F) != TRACE_TICK)
+            {
+                for (int shift = 0; ; shift += 7)
+                {
+                    if (*position >= length || shift > 42)
+                        return -1;
+                    unsigned char byte = bytes[(*position)++];
+                    value |= (uint64_t)(byte & 0x7F) << shift;
+                    if (!(byte & 0x80))
+                        break;
+                }
+            }
+            *record = traceEvent(head & 0x0F, value);
+            return 1;
+        }
+
+        if (head & 0x40)
+        {
+            codec->run = (head & 0x3F) + 1;
+        }
+        else
+        {
+            static const unsigned char sizes[5] = { 2, 2, 1, 1, 2 };
+            size_t needed = 0;
+            for (int i = 0; i < 5; i++)
+                needed += (head >> i & 1) * sizes[i];
+            if (length - *position < needed)
+                return -1;
+
+            const unsigned char *field = bytes + *position;
+            *record = tracePredict(codec);
+            record->pc = codec->expectPc;
+            if (head & 0x01)
+            {
+                record->pc = (field[0] | field[1] << 8) & 0xFFF;
+                field += 2;
+            }
+            if (head & 0x02)
+            {
+                record->opcode = field[0] | field[1] << 8;
+                field += 2;
+            }
+            if (head & 0x04)
+                record->vx = *field++;
+            if (head & 0x08)
+                record->vf = *field++;
+            if (head & 0x10)
+                record->I = field[0] | field[1] << 8;
+            *position += needed;
+
+            traceLearn(codec, *record);
+            return 1;
+        }
+    }
+
+    codec->run--;
+    *record = tracePredict(codec);
+    record->pc = codec->expectPc;
+    traceLearn(codec, *record);
+    return 1;
+}
+
+static void traceWriteSegment(Chip8Trace *trace, TraceSegment *segment)
+{
+    if (fwrite(&segment->header, sizeof(segment->header), 1, trace->file) != 1
+        || fwrite(segment->state, CHIP8_STATE_SIZE, 1, trace->file) != 1
+        || fwrite(segment->bytes, 1, segment->header.length, trace->file) != segment->header.length)
+        trace->failed = 1;
+    trace->stats.bytes += sizeof(segment->header) + CHIP8_STATE_SIZE + segment->header.length;
+}
+
+static void traceFreeSegment(TraceSegment *segment)
+{
+    free(segment->bytes);
+    free(segment);
+}
+
+// the current segment is done -- out to the file, or onto the flight recorder's list
+static void traceFinishSegment(Chip8Trace *trace)
+{
+    TraceSegment *segment = trace->current;
+    if (segment == NULL)
+        return;
+
+    traceFlushRun(trace);
+    trace->current = NULL;
+    trace->stats.instructions += segment->header.instructions;
+
+    if (trace->keep == 0)
+    {
+        traceWriteSegment(trace, segment);
+        traceFreeSegment(segment);
+        return;
+    }
+
+    if (trace->newest != NULL)
+        trace->newest->next = segment;
+    else
+        trace->oldest = segment;
+    trace->newest = segment;
+    trace->kept += segment->header.instructions;
+
+    while (trace->oldest != trace->newest && trace->kept - trace->oldest->header.instructions >= trace->keep)
+    {
+        TraceSegment *oldest = trace->oldest;
+        trace->oldest = oldest->next;
+        trace->kept -= oldest->header.instructions;
+        trace->stats.dropped++;
+        traceFreeSegment(oldest);
+    }
+}
+
+static void traceConsume(Chip8Trace *trace, TraceRecord record)
+{
+    // the rest of a keyframe, copied as it comes
+    if (trace->stateLeft > 0)
+    {
+        size_t index = TRACE_STATE_RECORDS - trace->stateLeft;
+        size_t offset = index * sizeof(TraceRecord);
+        size_t length = CHIP8_STATE_SIZE - offset < sizeof(TraceRecord) ? CHIP8_STATE_SIZE - offset : sizeof(TraceRecord);
+        memcpy(trace->state + offset, &record, length);
+
+        if (--trace->stateLeft == 0)
+        {
+            TraceSegment *segment = calloc(1, sizeof(TraceSegment));
+            segment->header.magic = TRACE_SEGMENT_MAGIC;
+            segment->header.firstCycle = trace->stateCycles;
+            memcpy(segment->state, trace->state, CHIP8_STATE_SIZE);
+            trace->current = segment;
+            unsigned short pc;
+            memcpy(&pc, trace->state + offsetof(Chip8, pc), sizeof(pc));
+            traceCodecReset(&trace->codec, pc);
+        }
+        return;
+    }
+
+    int kind = record.pc >> 12;
+    trace->stats.records++;
+
+    if (kind == TRACE_KEYFRAME)
+    {
+        traceFinishSegment(trace);
+        trace->stateCycles = traceValue(record);
+        trace->stateLeft = TRACE_STATE_RECORDS;
+        trace->stats.keyframes++;
+        return;
+    }
+
+    // nothing comes before the first keyframe
+    if (trace->current == NULL)
+        return;
+
+    if (kind == TRACE_INSTRUCTION)
+        trace->current->header.instructions++;
+    else if (kind == TRACE_SKIP)
+        trace->current->header.instructions += traceValue(record);
+    traceEncode(trace, record);
+}
+
+static void *traceThread(void *traceData)
+{
+    Chip8Trace *trace = traceData;
+    const struct timespec idle = { 0, 1000000 };
+
+    for (;;)
+    {
+        // closing first -- anything published before it is then visible
+        int closing = atomic_load(&trace->closing);
+        unsigned long long tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+        unsigned long long head = atomic_load_explicit(&trace->published, memory_order_acquire);
+
+        if (tail == head)
+        {
+            if (closing)
+                break;
+            nanosleep(&idle, NULL);
+            continue;
+        }
+
+        // handed back in slices, so a full ring frees up before the whole backlog is done
+        while (tail != head)
+        {
+            unsigned long long end = head - tail > 4096 ? tail + 4096 : head;
+            for (; tail != end; tail++)
+                traceConsume(trace, trace->ring[tail & (TRACE_RING_RECORDS - 1)]);
+            atomic_store_explicit(&trace->tail, tail, memory_order_release);
+        }
+    }
+
+    return NULL;
+}
+
+// keep is the flight recorder's length in instructions, 0 to write the
+// whole trace -- returns NULL if the file can't be created
+Chip8Trace *traceOpen(const char *path, unsigned long long keep)
+{
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+        return NULL;
+
+    TraceFileHeader header = { TRACE_MAGIC, TRACE_VERSION, CHIP8_STATE_SIZE };
+    Chip8Trace *trace = aligned_alloc(64, (sizeof(Chip8Trace) + 63) / 64 * 64);
+    memset(trace, 0, sizeof(Chip8Trace));
+    trace->ring = malloc(sizeof(TraceRecord) * TRACE_RING_RECORDS);
+    trace->file = file;
+    trace->keep = keep;
+    trace->limit = TRACE_RING_RECORDS;
+    atomic_init(&trace->published, 0);
+    atomic_init(&trace->tail, 0);
+    atomic_init(&trace->closing, 0);
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1 || pthread_create(&trace->thread, NULL, traceThread, trace) != 0)
+    {
+        fclose(file);
+        free(trace->ring);
+        free(trace);
+        return NULL;
+    }
+    trace->stats.bytes = sizeof(header);
+
+    return trace;
+}
+
+// the machine must not run again with the trace attached -- writes out
+// what is left and closes the file, returns 0 on success, -1 if writing
+// failed. stats, when not NULL, gets the final counts.
+int traceClose(Chip8Trace *trace, TraceStats *stats)
+{
+    tracePublish(trace);
+    atomic_store(&trace->closing, 1);
+    pthread_join(trace->thread, NULL);
+
+    traceFinishSegment(trace);
+    while (trace->oldest != NULL)
+    {
+        TraceSegment *segment = trace->oldest;
+        trace->oldest = segment->next;
+        traceWriteSegment(trace, segment);
+        traceFreeSegment(segment);
+    }
+
+    int result = trace->failed || ferror(trace->file) ? -1 : 0;
+    if (fclose(trace->file) != 0)
+        result = -1;
+
+    trace->stats.stalls = trace->stalls;
+    if (stats != NULL)
+        *stats = trace->stats;
+
+    free(trace->ring);
+    free(trace);
+    return result;
+}
+
+#endif
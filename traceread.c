@@ -0,0 +1,382 @@
+// Trace reader -- summarizes, lists and replays the execution traces trace.h
+// writes (batch -T).
+//
+//  usage: traceread [-v] [-l first-last] [-c cycle [-o state]] trace
+//
+// With no options it prints what the trace holds: its segments, the cycles
+// they cover and how well they compressed; -v adds a line per segment.
+// -l lists the records between two cycles (either may be left out), one
+// instruction per line with VX, VF and I as it left them, plus the key and
+// timer changes and the idle laps skipped.
+// -c rebuilds the machine as it was after `cycle` instructions: the state
+// from the last keyframe before it is loaded and run on through
+// emulateCycle(), with the recorded keys and timers applied as they come,
+// and every instruction on the way checked against its record -- so a
+// trace that doesn't replay says where. A cycle that ends a frame gives the
+// machine before that frame's timer tick. The registers, a hash of the state
+// (as replay.h takes it) and the display are printed, and -o writes the
+// state out as a savestate file main.c can load.
+// When cycles repeat, after a rewind or a loaded state, the last segment
+// holding the cycle is the one replayed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#define CHIP8_TRACE
+#include "chip8.h"
+#include "savestate.h"
+#include "replay.h"
+
+typedef struct Segment {
+    TraceSegmentHeader header;
+    const unsigned char *state;
+    const unsigned char *bytes;
+} Segment;
+
+typedef struct TraceFile {
+    unsigned char *data;
+    size_t size;
+    Segment *segments;
+    int count;
+} TraceFile;
+
+// reads the whole file and finds its segments -- returns 0, or -1 with a message printed
+static int traceFileLoad(TraceFile *file, const char *path)
+{
+    FILE *in = fopen(path, "rb");
+    if (in == NULL)
+    {
+        printf("Could not open %s\n", path);
+        return -1;
+    }
+
+    fseek(in, 0, SEEK_END);
+    file->size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    file->data = malloc(file->size ? file->size : 1);
+    int ok = fread(file->data, 1, file->size, in) == file->size;
+    fclose(in);
+
+    TraceFileHeader header;
+    if (!ok || file->size < sizeof(header))
+    {
+        printf("Could not read %s\n", path);
+        return -1;
+    }
+    memcpy(&header, file->data, sizeof(header));
+    if (header.magic != TRACE_MAGIC || header.version != TRACE_VERSION || header.stateSize != CHIP8_STATE_SIZE)
+    {
+        printf("%s is not a trace from this build\n", path);
+        return -1;
+    }
+
+    size_t position = sizeof(header);
+    int capacity = 0;
+    file->segments = NULL;
+    file->count = 0;
+
+    while (position < file->size)
+    {
+        Segment segment;
+        if (file->size - position < sizeof(segment.header) + CHIP8_STATE_SIZE)
+            break;
+        memcpy(&segment.header, file->data + position, sizeof(segment.header));
+        position += sizeof(segment.header);
+        if (segment.header.magic != TRACE_SEGMENT_MAGIC || file->size - position - CHIP8_STATE_SIZE < segment.header.length)
+            break;
+        segment.state = file->data + position;
+        segment.bytes = segment.state + CHIP8_STATE_SIZE;
+        position += CHIP8_STATE_SIZE + segment.header.length;
+
+        if (file->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            file->segments = realloc(file->segments, sizeof(Segment) * capacity);
+        }
+        file->segments[file->count++] = segment;
+    }
+
+    if (position != file->size)
+        printf("%s: cut short after %d segments, the rest is ignored\n", path, file->count);
+    return 0;
+}
+
+// the machine at the start of a segment, and the decoder ready for its records
+static void segmentStart(const Segment *segment, Chip8 *chip8, TraceCodec *codec)
+{
+    *chip8 = initialize();
+    loadState(chip8, segment->state);
+    traceCodecReset(codec, chip8->pc);
+}
+
+static void summarize(const TraceFile *file, const char *path, int verbose)
+{
+    unsigned long long instructions = 0, skipped = 0, records = 0, ticks = 0, events = 0;
+    uint64_t first = 0, last = 0;
+
+    for (int i = 0; i < file->count; i++)
+    {
+        const Segment *segment = &file->segments[i];
+        unsigned long long segmentSkipped = 0;
+        TraceCodec codec;
+        TraceRecord record;
+        size_t position = 0;
+        int result;
+        Chip8 chip8;
+
+        segmentStart(segment, &chip8, &codec);
+        while ((result = traceDecode(&codec, segment->bytes, segment->header.length, &position, &record)) == 1)
+        {
+            int kind = record.pc >> 12;
+            if (kind == TRACE_INSTRUCTION)
+                records++;
+            else if (kind == TRACE_TICK)
+                ticks++;
+            else
+                events++;
+            if (kind == TRACE_SKIP)
+                segmentSkipped += traceValue(record);
+        }
+        if (result < 0)
+            printf("segment %d: records cut short\n", i);
+
+        uint64_t end = segment->header.firstCycle + segment->header.instructions;
+        if (i == 0 || segment->header.firstCycle < first)
+            first = segment->header.firstCycle;
+        if (i == 0 || end > last)
+            last = end;
+        instructions += segment->header.instructions;
+        skipped += segmentSkipped;
+
+        if (verbose)
+        {
+            printf("segment %d: cycles %llu - %llu, %u bytes, %llu skipped\n", i,
+                (unsigned long long)segment->header.firstCycle, (unsigned long long)end,
+                segment->header.length, segmentSkipped);
+        }
+    }
+
+    printf("%s: %d segments, cycles %llu - %llu\n", path, file->count, (unsigned long long)first, (unsigned long long)last);
+    printf("%llu instructions: %llu recorded, %llu skipped as idle; %llu ticks, %llu other events\n",
+        instructions, records, skipped, ticks, events);
+    printf("%zu bytes, %.3f per recorded instruction, %.3f per instruction\n",
+        file->size, records ? (double)file->size / records : 0, instructions ? (double)file->size / instructions : 0);
+}
+
+static void listRecords(const TraceFile *file, uint64_t first, uint64_t last)
+{
+    for (int i = 0; i < file->count; i++)
+    {
+        const Segment *segment = &file->segments[i];
+        uint64_t cycle = segment->header.firstCycle;
+        if (cycle + segment->header.instructions < first || cycle > last)
+            continue;
+
+        TraceCodec codec;
+        TraceRecord record;
+        size_t position = 0;
+        Chip8 chip8;
+
+        printf("segment %d, keyframe at cycle %llu\n", i, (unsigned long long)cycle);
+        segmentStart(segment, &chip8, &codec);
+        while (cycle <= last && traceDecode(&codec, segment->bytes, segment->header.length, &position, &record) == 1)
+        {
+            int kind = record.pc >> 12;
+            uint64_t value = traceValue(record);
+
+            if (kind == TRACE_INSTRUCTION)
+            {
+                if (cycle >= first)
+                {
+                    printf("%10llu  %03X  %04X  V%X=%02X VF=%02X I=%03X\n", (unsigned long long)cycle,
+                        record.pc, record.opcode, (record.opcode >> 8) & 0xF, record.vx, record.vf, record.I);
+                }
+                cycle++;
+            }
+            else if (kind == TRACE_SKIP)
+            {
+                if (cycle + value > first)
+                    printf("%10llu  skip %llu idle\n", (unsigned long long)cycle, (unsigned long long)value);
+                cycle += value;
+            }
+            else if (kind == TRACE_TICK && cycle >= first)
+            {
+                printf("%10llu  tick\n", (unsigned long long)cycle);
+            }
+            else if (kind == TRACE_INPUT && cycle >= first)
+            {
+                printf("%10llu  keys %04X delay %u sound %u\n", (unsigned long long)cycle,
+                    (unsigned)(value & 0xFFFF), (unsigned)(value >> 16 & 0xFF), (unsigned)(value >> 24 & 0xFF));
+            }
+        }
+    }
+}
+
+// runs a segment up to `cycle`, checking each instruction against its
+// record -- returns 0 with chip8 at that cycle, -1 with a message printed
+static int replaySegment(const Segment *segment, Chip8 *chip8, uint64_t cycle)
+{
+    TraceCodec codec;
+    TraceRecord record;
+    size_t position = 0;
+    int result;
+
+    segmentStart(segment, chip8, &codec);
+    while (chip8->cycles < cycle)
+    {
+        result = traceDecode(&codec, segment->bytes, segment->header.length, &position, &record);
+        if (result != 1)
+        {
+            printf("records end at cycle %llu\n", (unsigned long long)chip8->cycles);
+            return -1;
+        }
+
+        int kind = record.pc >> 12;
+        uint64_t value = traceValue(record);
+
+        if (kind == TRACE_TICK)
+        {
+            updateTimers(chip8);
+        }
+        else if (kind == TRACE_INPUT)
+        {
+            for (int i = 0; i < 16; i++)
+                chip8->key[i] = value >> i & 1;
+            chip8->delay_timer = value >> 16 & 0xFF;
+            chip8->sound_timer = value >> 24 & 0xFF;
+        }
+        else if (kind == TRACE_SKIP)
+        {
+            // the laps end where they started, so only a cycle inside them needs running
+            if (chip8->cycles + value <= cycle)
+                chip8->cycles += value;
+            else
+                while (chip8->cycles < cycle)
+                    emulateCycle(chip8);
+        }
+        else if (kind == TRACE_INSTRUCTION)
+        {
+            unsigned short pc = chip8->pc & 0xFFF;
+            unsigned short opcode = chip8->memory[pc] << 8 | chip8->memory[(pc + 1) & 0xFFF];
+
+            emulateCycle(chip8);
+            if (record.pc != pc || record.opcode != opcode || record.vx != chip8->V[(opcode >> 8) & 0xF]
+                || record.vf != chip8->V[15] || record.I != chip8->I)
+            {
+                printf("cycle %llu: the trace has %03X %04X V%X=%02X VF=%02X I=%03X, the rerun %03X %04X V%X=%02X VF=%02X I=%03X\n",
+                    (unsigned long long)chip8->cycles - 1,
+                    record.pc, record.opcode, (record.opcode >> 8) & 0xF, record.vx, record.vf, record.I,
+                    pc, opcode, (opcode >> 8) & 0xF, chip8->V[(opcode >> 8) & 0xF], chip8->V[15], chip8->I);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void printState(const Chip8 *chip8)
+{
+    printf("cycle %llu  pc %03X  I %03X  sp %X  delay %u  sound %u  hash %016llx\n",
+        (unsigned long long)chip8->cycles, chip8->pc, chip8->I, chip8->sp,
+        chip8->delay_timer, chip8->sound_timer, (unsigned long long)stateHash(chip8));
+    for (int i = 0; i < 16; i++)
+        printf("V%X=%02X%c", i, chip8->V[i], i == 15 ? '\n' : ' ');
+    for (int y = 0; y < 32; y++)
+    {
+        char row[65];
+        for (int x = 0; x < 64; x++)
+            row[x] = gfxPixel(chip8, x, y) ? '#' : '.';
+        row[64] = '\0';
+        printf("%s\n", row);
+    }
+}
+
+static void usage()
+{
+    printf("usage: traceread [-v] [-l first-last] [-c cycle [-o state]] trace\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *range = NULL;
+    const char *statePath = NULL;
+    unsigned long long cycle = 0;
+    int rebuild = 0;
+    int verbose = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vl:c:o:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'v':
+                verbose = 1;
+                break;
+            case 'l':
+                range = optarg;
+                break;
+            case 'c':
+                cycle = strtoull(optarg, NULL, 10);
+                rebuild = 1;
+                break;
+            case 'o':
+                statePath = optarg;
+                break;
+            default:
+                usage();
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    if (optind != argc - 1 || (statePath != NULL && !rebuild))
+    {
+        usage();
+        return -1;
+    }
+
+    TraceFile file;
+    if (traceFileLoad(&file, argv[optind]) != 0)
+        return -1;
+
+    if (range != NULL)
+    {
+        const char *dash = strchr(range, '-');
+        uint64_t first = strtoull(range, NULL, 10);
+        uint64_t last = dash != NULL && dash[1] != '\0' ? strtoull(dash + 1, NULL, 10) : dash != NULL ? UINT64_MAX : first;
+        listRecords(&file, first, last);
+    }
+
+    if (rebuild)
+    {
+        const Segment *segment = NULL;
+        for (int i = file.count - 1; i >= 0 && segment == NULL; i--)
+        {
+            const TraceSegmentHeader *header = &file.segments[i].header;
+            if (header->firstCycle <= cycle && cycle <= header->firstCycle + header->instructions)
+                segment = &file.segments[i];
+        }
+        if (segment == NULL)
+        {
+            printf("Cycle %llu is not in the trace\n", cycle);
+            return -1;
+        }
+
+        Chip8 chip8;
+        if (replaySegment(segment, &chip8, cycle) != 0)
+            return 1;
+        printState(&chip8);
+
+        if (statePath != NULL && saveStateFile(&chip8, statePath) != 0)
+        {
+            printf("Could not write %s\n", statePath);
+            return -1;
+        }
+    }
+
+    if (range == NULL && !rebuild)
+        summarize(&file, argv[optind], verbose);
+
+    return 0;
+}
@@ -0,0 +1,388 @@
+// Video wall -- many Chip8 instances tiled into one window, for watching
+// dozens of machines at once.
+//
+//  usage: wall [-n instances] [-c columns] [-S scale] [-i ipf] [-s speed] [-Q quirks] rom ...
+//
+// Instance n runs ROM n modulo the number given (default one instance per
+// ROM) and seeds its random number generator with the time plus n. The
+// tiles are laid out `columns` wide (default the smallest square that fits)
+// and every pixel is `scale` window pixels (default 4).
+//
+// One CPU thread runs every instance a frame at a time and hands all the
+// displays over through the WallFrames triple buffer in handoff.h, marking
+// the ones whose drawFlag was set. The window is one texture atlas of all
+// the tiles: each present converts only the tiles marked since the last
+// one, uploads the rectangle around them in a single SDL_UpdateTexture and
+// draws the atlas with a single copy, so a wall of mostly idle machines
+// costs about what one machine does.
+//
+// The keypad goes to the focused tile, which is drawn in amber. Tab and
+// shift-Tab move the focus, as does clicking a tile; keys held on the tile
+// being left are released first.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <SDL2/SDL.h>
+#include "chip8.h"
+#include "handoff.h"
+#include "scheduler.h"
+
+#define WALL_MAX_INSTANCES 1024
+
+#define COLOR_ON 0xFF000000
+#define COLOR_OFF 0xFFFFFFFF
+#define COLOR_FOCUS 0xFFFFC040
+
+typedef struct Instance {
+    Chip8 chip8;
+    KeyQueue keys;
+} Instance;
+
+static atomic_int quit = 0;
+
+static Instance *instances;
+static int instanceCount;
+static Chip8Scheduler scheduler;
+static WallFrames frames;
+// SDL event the CPU thread pushes for a new frame, at most one in flight
+static Uint32 frameEvent;
+static atomic_int frameSignalled;
+
+// main thread only -- the tile with the keyboard, the keypad keys held on
+// it, and tiles to convert again on the next present besides dirty ones
+static int focus;
+static unsigned char held[16];
+static uint64_t *redraw;
+
+int cpuThread(void *unused);
+int keyIndex(SDL_Keycode sym);
+
+static void usage()
+{
+    printf("usage: wall [-n instances] [-c columns] [-S scale] [-i ipf] [-s speed] [-Q quirks] rom ...\n");
+}
+
+// one tile of the atlas, in the focus colour if it has the keyboard
+static void drawTile(uint32_t *atlas, int columns, int tile, const uint64_t *gfx, int focused)
+{
+    int pitch = columns * 64;
+    uint32_t *pixels = atlas + (tile / columns) * 32 * pitch + (tile % columns) * 64;
+    gfxToPixels(gfx, pixels, pitch, COLOR_ON, focused ? COLOR_FOCUS : COLOR_OFF);
+}
+
+// the tile being left gets its keys back up, and both are redrawn in their new colour
+static void moveFocus(SDL_Window *window, int tile)
+{
+    if (tile == focus)
+        return;
+
+    for (int key = 0; key < 16; key++)
+    {
+        if (held[key])
+        {
+            KeyEvent event = { SDL_GetTicks(), key, 0 };
+            keyQueuePush(&instances[focus].keys, event);
+            held[key] = 0;
+        }
+    }
+
+    redraw[focus / 64] |= 1ULL << (focus % 64);
+    redraw[tile / 64] |= 1ULL << (tile % 64);
+    focus = tile;
+
+    char title[64];
+    snprintf(title, sizeof(title), "chip8 wall -- instance %d", focus);
+    SDL_SetWindowTitle(window, title);
+}
+
+int main(int argc, char *argv[])
+{
+    int columns = 0;
+    int scale = 4;
+    int instructionsPerFrame = SCHEDULER_DEFAULT_IPF;
+    double speed = 1.0;
+    int quirks = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:S:i:s:Q:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                instanceCount = atoi(optarg);
+                break;
+            case 'c':
+                columns = atoi(optarg);
+                break;
+            case 'S':
+                scale = atoi(optarg);
+                break;
+            case 'i':
+                instructionsPerFrame = atoi(optarg);
+                break;
+            case 's':
+                speed = atof(optarg);
+                break;
+            case 'Q':
+                quirks = quirksParse(optarg);
+                if (quirks < 0)
+                {
+                    printf("Unknown quirks: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            default:
+                usage();
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+
+    int romCount = argc - optind;
+    if (instanceCount == 0)
+        instanceCount = romCount;
+    if (romCount < 1 || instanceCount < 1 || instanceCount > WALL_MAX_INSTANCES || columns < 0 || scale < 1)
+    {
+        usage();
+        return -1;
+    }
+    if (columns == 0)
+        columns = (int)ceil(sqrt(instanceCount));
+    if (columns > instanceCount)
+        columns = instanceCount;
+    int rows = (instanceCount + columns - 1) / columns;
+
+    instances = malloc(sizeof(Instance) * instanceCount);
+    uint32_t seed = (uint32_t)time(NULL);
+    for (int i = 0; i < instanceCount; i++)
+    {
+        const char *romPath = argv[optind + i % romCount];
+        Instance *instance = &instances[i];
+
+        instance->chip8 = initialize();
+        seedRandom(&instance->chip8, seed + i);
+        instance->chip8.quirks = quirks;
+        int result = loadGame(&instance->chip8, romPath);
+        if (result != ROM_OK)
+        {
+            printf("Could not load ROM %s: %s\n", romPath, romErrorString(result));
+            return -1;
+        }
+        keyQueueInit(&instance->keys);
+    }
+
+    if (SDL_Init(SDL_INIT_VIDEO) < 0)
+    {
+        printf("Could not initiliaze SDL!\n");
+        return -1;
+    }
+
+    int atlasWidth = columns * 64;
+    int atlasHeight = rows * 32;
+    SDL_Window *window = SDL_CreateWindow("chip8 wall", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+        atlasWidth * scale, atlasHeight * scale, 0);
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
+    SDL_Texture *texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, atlasWidth, atlasHeight);
+
+    // what the texture holds -- streaming textures can't be read back, and
+    // an upload of part of one needs the pixels around it at hand
+    uint32_t *atlas = calloc((size_t)atlasWidth * atlasHeight, sizeof(uint32_t));
+    redraw = calloc(WALL_DIRTY_WORDS(instanceCount), sizeof(uint64_t));
+
+    schedulerInit(&scheduler, instructionsPerFrame, speed);
+    wallFramesInit(&frames, instanceCount);
+    frameEvent = SDL_RegisterEvents(1);
+
+    // every tile is uploaded once, blank, along with the first frame
+    int current = -1;
+    for (int i = 0; i < instanceCount; i++)
+        redraw[i / 64] |= 1ULL << (i % 64);
+    static const uint64_t blank[32];
+    for (int i = instanceCount; i < columns * rows; i++)
+        drawTile(atlas, columns, i, blank, 0);
+
+    unsigned long long presents = 0;
+    unsigned long long tilesUploaded = 0;
+    unsigned long long pixelsUploaded = 0;
+
+    SDL_Thread *threadID = SDL_CreateThread(cpuThread, "CPU Thread", NULL);
+    SDL_Event e;
+
+    while (!quit)
+    {
+        int exposed = 0;
+
+        if (SDL_WaitEventTimeout(&e, 1000) != 0)
+        {
+            do
+            {
+                if (e.type == frameEvent)
+                {
+                    frameSignalled = 0;
+                }
+                else if (e.type == SDL_QUIT)
+                {
+                    quit = 1;
+                }
+                else if (e.type == SDL_WINDOWEVENT && e.window.event == SDL_WINDOWEVENT_EXPOSED)
+                {
+                    exposed = 1;
+                }
+                else if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_TAB)
+                {
+                    int step = (e.key.keysym.mod & KMOD_SHIFT) ? instanceCount - 1 : 1;
+                    moveFocus(window, (focus + step) % instanceCount);
+                }
+                else if (e.type == SDL_MOUSEBUTTONDOWN)
+                {
+                    int tile = e.button.y / (32 * scale) * columns + e.button.x / (64 * scale);
+                    if (tile >= 0 && tile < instanceCount)
+                        moveFocus(window, tile);
+                }
+                else if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP)
+                {
+                    int key = keyIndex(e.key.keysym.sym);
+                    if (key != -1 && !e.key.repeat)
+                    {
+                        held[key] = e.type == SDL_KEYDOWN;
+                        KeyEvent event = { e.key.timestamp, key, held[key] };
+                        keyQueuePush(&instances[focus].keys, event);
+                    }
+                }
+            } while (SDL_PollEvent(&e) != 0);
+        }
+
+        int index = wallFrameAcquire(&frames);
+        if (index >= 0)
+        {
+            current = index;
+            for (int i = 0; i < WALL_DIRTY_WORDS(instanceCount); i++)
+                redraw[i] |= frames.dirty[current][i];
+        }
+        if (current < 0)
+            continue;
+
+        // convert the marked tiles, keeping the bounds of what changed in tiles
+        int left = columns, top = rows, right = -1, bottom = -1;
+        for (int word = 0; word < WALL_DIRTY_WORDS(instanceCount); word++)
+        {
+            while (redraw[word] != 0)
+            {
+                int tile = word * 64 + __builtin_ctzll(redraw[word]);
+                redraw[word] &= redraw[word] - 1;
+
+                drawTile(atlas, columns, tile, frames.rows[current] + tile * 32, tile == focus);
+                int x = tile % columns, y = tile / columns;
+                left = x < left ? x : left;
+                right = x > right ? x : right;
+                top = y < top ? y : top;
+                bottom = y > bottom ? y : bottom;
+                tilesUploaded++;
+            }
+        }
+
+        if (right < 0 && !exposed)
+            continue;
+
+        if (right >= 0)
+        {
+            SDL_Rect area = { left * 64, top * 32, (right - left + 1) * 64, (bottom - top + 1) * 32 };
+            SDL_UpdateTexture(texture, &area, atlas + area.y * atlasWidth + area.x, atlasWidth * sizeof(uint32_t));
+            pixelsUploaded += (unsigned long long)area.w * area.h;
+        }
+
+        // blocks until vblank
+        SDL_RenderCopy(renderer, texture, NULL, NULL);
+        SDL_RenderPresent(renderer);
+        presents++;
+    }
+    printf("QUITTING\n");
+    SDL_WaitThread(threadID, NULL);
+
+    printf("%d instances, %llu presents, %.1f tiles and %.0f pixels uploaded per present\n", instanceCount, presents,
+        presents ? (double)tilesUploaded / presents : 0, presents ? (double)pixelsUploaded / presents : 0);
+
+    wallFramesDestroy(&frames);
+    free(redraw);
+    free(atlas);
+    free(instances);
+
+    SDL_DestroyTexture(texture);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+
+    return 0;
+}
+
+// runs every instance one frame at a time and hands the displays over together
+int cpuThread(void *unused)
+{
+    KeyEvent event;
+
+    schedulerSetSpeed(&scheduler, scheduler.speed);
+
+    while (!quit)
+    {
+        // the first frame always goes, so the wall starts out filled in
+        int drawn = scheduler.frames == 0;
+
+        for (int i = 0; i < instanceCount; i++)
+        {
+            Chip8 *chip8 = &instances[i].chip8;
+
+            while (keyQueuePop(&instances[i].keys, &event))
+                chip8->key[event.key] = event.pressed;
+
+            runFrame(chip8, scheduler.instructionsPerFrame);
+            wallFrameSet(&frames, i, chip8->gfx, chip8->drawFlag);
+            drawn |= chip8->drawFlag;
+            chip8->drawFlag = 0;
+        }
+
+        // an unchanged wall isn't worth a wakeup -- what is set now is set again next time
+        if (drawn)
+        {
+            wallFramePublish(&frames);
+
+            if (!atomic_exchange(&frameSignalled, 1))
+            {
+                SDL_Event wake;
+                memset(&wake, 0, sizeof(wake));
+                wake.type = frameEvent;
+                SDL_PushEvent(&wake);
+            }
+        }
+
+        schedulerWait(&scheduler);
+    }
+
+    return 0;
+}
+
+// the same keypad layout as main.c -- the left side of a QWERTY keyboard
+int keyIndex(SDL_Keycode sym)
+{
+    switch (sym)
+    {
+        case SDLK_1: return 0;
+        case SDLK_2: return 1;
+        case SDLK_3: return 2;
+        case SDLK_4: return 3;
+        case SDLK_q: return 4;
+        case SDLK_w: return 5;
+        case SDLK_e: return 6;
+        case SDLK_r: return 7;
+        case SDLK_a: return 8;
+        case SDLK_s: return 9;
+        case SDLK_d: return 10;
+        case SDLK_f: return 11;
+        case SDLK_z: return 12;
+        case SDLK_x: return 13;
+        case SDLK_c: return 14;
+        case SDLK_v: return 15;
+        default: return -1;
+    }
+}